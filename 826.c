@@ -1,26 +1,106 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <wait.h>
 
-#define MAXARGS 128
 #define MAXLINE 8192
-#define MAXJOBS 100
 
-extern char *environ[];
+typedef enum {
+  NOT_BUILTIN,
+  BUILTIN_SHELL,
+  BUILTIN_JOB,
+} Builtin;
+
+// A redirection of a stage of a pipeline. fd is the descriptor it applies
+// to, word the file, or for REDIR_DUP the descriptor to copy, "-" to close
+// fd. For REDIR_HEREDOC word is the delimiter, the body is read into a memfd
+// once the line is parsed.
+typedef enum {
+  REDIR_IN,
+  REDIR_OUT,
+  REDIR_APPEND,
+  REDIR_DUP,
+  REDIR_HEREDOC,
+} RedirType;
+
+// Flags of a REDIR_HEREDOC, <<- strips leading tabs from the body and
+// quoting any part of the delimiter leaves $(...) in it alone.
+#define HERE_STRIP 1
+#define HERE_QUOTED 2
+
+typedef struct redir {
+  RedirType type;
+  int fd;
+  char *word;
+  // memfd with the body of a REDIR_HEREDOC, and its HERE_ flags.
+  int hfd;
+  int hflags;
+  // Index of the stage of the pipeline it belongs to.
+  int stage;
+  struct redir *next;
+} redir;
 
 void eval(char *cmdline);
-int parseline(char *buf, char **argv);
+void eval_line(char *cmdline, char *text);
+char *read_heredocs(redir *r);
+void skip_heredocs(char *s, size_t len);
+char *subst_end(char *s);
+char **parseline(char *buf, int *bg, redir **redirs);
 int builtin_command(char **argv);
-void run_fg(pid_t);
-void run_bg(pid_t pid, char *);
+Builtin is_builtin(char *name);
+void wait_for_child();
+void run_fg(int);
+void run_bg(int);
+unsigned hash_str(const char *s);
+char *var_get(char *name);
 int parse_int(char *);
-int parse_pid(char *);
+double parse_secs(char *);
+int parse_job(char *);
+char *find_command(char *name);
+void unix_error(char *msg);
+double elapsed(struct timespec *a, struct timespec *b);
+void print_times(double real, struct timeval *utime, struct timeval *stime,
+                 long maxrss, long nvcsw, long nivcsw);
+int time_builtin(char **argv);
+int builtin_jobs(char **argv);
+int builtin_parallel(char **argv);
+int exit_code(int status);
+double tv_secs(struct timeval *tv);
+void client_done(int i);
+void sched_admit();
+void sched_drain();
+int have_running_jobs();
+void stats_tick();
+void write_full(int fd, char *buf, size_t len);
+void enter_subshell();
+char *builtin_name(size_t k);
+void glob_reset();
 
 static char sigbuf[100];
 
@@ -31,382 +111,7833 @@ typedef enum {
   TERMINATED,
 } Status;
 
-// TODO: heap-allocate the whole command for this job.
-// or allocate 12-byte string and trim the command to fit.
-// 12 instead of 8 because there will be 4-byte padding when
-// we use 8, so why not use the other 4 bytes.
+// A process of a job, jobs of a pipeline have one per stage.
 typedef struct {
   pid_t pid;
+  Status st;
+  // Last wait status reported for this process.
+  int status;
+  // Slot of the job this process belongs to.
+  int job;
+  // Next process in the same pid bucket, or in the free list when the slot is
+  // not in use.
+  int pid_next;
+  // Next process of the same job, in pipeline order.
+  int sibling;
+  // pidfd the wait builtin sleeps on, -1 until it needed one.
+  int pidfd;
+} proc;
+
+typedef struct {
+  // All processes of a job share one process group, led by the first one.
+  pid_t pgid;
+  // 0 for a foreground job which was never stopped, those don't get a jid.
   int jid;
   Status st;
+  // Processes which haven't terminated yet, and how many of them are stopped.
+  int nlive;
+  int nstopped;
+  // First process of the job.
+  int procs;
+  // Offset of the command line in cmd_slab, CMD_NONE if it has none.
+  unsigned cmd;
+  // Next slot in the same jid bucket.
+  int jid_next;
+  // Next slot in the free list, or in the done list once the job terminated.
+  int next;
+  // Slot of the server client which submitted the job and is told when it
+  // terminates, -1 for jobs started otherwise.
+  int client;
+  // Set for a background job while it's counted in sched_running.
+  int counted;
+  // CLOCK_MONOTONIC deadline in ns of a job started with timeout, 0 for none.
+  // Once it passes the job gets SIGTERM, and SIGKILL grace ns later.
+  long long deadline;
+  long long grace;
+  // 1 once SIGTERM was sent for the deadline, 2 once SIGKILL was.
+  int expired;
+  // Set while the job runs in background, it's reported at the next prompt
+  // once it terminates, or stops with stop_notice set.
+  int bg;
+  int stop_notice;
+  // Set for a background job until wait returned its status. It stays on
+  // the done list for wait after it terminated, see cleanup_jobs.
+  int unwaited;
+  // Resources used by the processes of the job which terminated so far, as
+  // reported by wait4.
+  struct timeval utime;
+  struct timeval stime;
+  long maxrss;
+  long nvcsw;
+  long nivcsw;
+  // CLOCK_MONOTONIC when the job was added and when it terminated.
+  struct timespec start;
+  struct timespec end;
+  // Terminal modes the job had when it was last stopped in foreground, put
+  // back when it's resumed with fg.
+  int has_tmodes;
+  struct termios tmodes;
 } job;
 
+// The job table grows on demand. Processes are found through a chained hash
+// index keyed on pid and jobs through one keyed on jid, and unused slots of
+// both are kept in free lists so adding and looking up a job are O(1).
+//
+// setjobstat is called from the SIGCHLD handler, so it must never allocate
+// or free anything. Jobs which terminate are only moved to a done list there
+// and cleanup_jobs removes them before the next command, both the tables and
+// the indexes only change in code that runs with SIGCHLD blocked.
 static int next_jid = 0;
-static job jobs[MAXJOBS];
-
-// Returns -1 when there are no empty slots to add the new job.
-// addjob is used in two scenarios:
-// 1. When adding a new job.
-// 2. When resuming a suspended job and running it in the background.
-int addjob(pid_t pid, Status st) {
-  job *free_job;
-  for (int i = 0; i < MAXJOBS; i++) {
-    job *j = &jobs[i];
+static job *jobs = NULL;
+static int jobs_cap = 0;
+// Slots [0, jobs_used) have been handed out at least once.
+static int jobs_used = 0;
+static int jobs_free = -1;
+static int jobs_done = -1;
+static int *jid_idx = NULL;
+static int jid_idx_cap = 0;
+
+static proc *procs = NULL;
+static int procs_cap = 0;
+static int procs_used = 0;
+static int procs_free = -1;
+static int *pid_idx = NULL;
+static int pid_idx_cap = 0;
+
+// Background jobs which haven't terminated yet, and how many of them may be
+// at the same time, 0 for no limit. The ones over the limit wait in sched_q.
+static int sched_running = 0;
+static int sched_limit = 0;
+
+// Counters of what the shell itself costs, shown by the stats builtin. They
+// are plain increments on the paths they count: the handlers which update
+// some of them block all signals, and the main loop updates the others with
+// SIGCHLD blocked, so there are no concurrent updates.
+typedef struct {
+  unsigned long forks;
+  unsigned long posix_spawns;
+  unsigned long zygote_spawns;
+  // External commands started, and the ones which couldn't be: not found,
+  // or failed in posix_spawn or the zygote. A failing execve in a forked
+  // child isn't seen by the shell.
+  unsigned long execs;
+  unsigned long exec_failures;
+  unsigned long signals_forwarded;
+  // Passes of reap_children, the statuses they collected, the most in one
+  // pass and the passes which found nothing.
+  unsigned long reap_calls;
+  unsigned long reaped;
+  unsigned long reaped_max;
+  unsigned long reap_empty;
+  // Jobs in the table, and the most there were.
+  unsigned long jobs_live;
+  unsigned long jobs_peak;
+  // Time the main loop spent with SIGCHLD blocked, or in event mode not
+  // reading the signalfd, and the longest stretch.
+  unsigned long long blocked_ns;
+  unsigned long long blocked_max_ns;
+} counters;
+
+static counters stats;
+
+int *pid_bucket(pid_t pid) {
+  return &pid_idx[(unsigned)pid & (pid_idx_cap - 1)];
+}
+
+int *jid_bucket(int jid) {
+  return &jid_idx[(unsigned)jid & (jid_idx_cap - 1)];
+}
+
+// Returns the slot of the live process with the given pid, or -1. A pid can
+// be reused once the process was reaped, so terminated ones are skipped.
+int findproc(pid_t pid) {
+  if (pid_idx_cap == 0)
+    return -1;
+
+  int p = *pid_bucket(pid);
+  while (p != -1 && (procs[p].pid != pid || procs[p].st == TERMINATED))
+    p = procs[p].pid_next;
+  return p;
+}
+
+// Returns the slot of the job with the given jid, or -1.
+int findjob_jid(int jid) {
+  if (jid_idx_cap == 0 || jid == 0)
+    return -1;
+
+  int i = *jid_bucket(jid);
+  while (i != -1 && jobs[i].jid != jid)
+    i = jobs[i].jid_next;
+  return i;
+}
+
+// Returns the slot of the job one of whose processes has the given pid.
+int findjob_pid(pid_t pid) {
+  int p = findproc(pid);
+  return p == -1 ? -1 : procs[p].job;
+}
+
+// Hands out a jid to the job in slot i and adds it to the jid index.
+int index_jid(int i) {
+  int jid = ++next_jid;
+  int *b = jid_bucket(jid);
+  jobs[i].jid = jid;
+  jobs[i].jid_next = *b;
+  *b = i;
+  return jid;
+}
+
+// Allocates a new index of cap buckets, all empty.
+int *new_index(int cap) {
+  int *idx = malloc(cap * sizeof(int));
+  if (idx == NULL)
+    unix_error("malloc error");
+  for (int i = 0; i < cap; i++)
+    idx[i] = -1;
+  return idx;
+}
+
+// Doubles the job table and rebuilds the jid index with twice as many
+// buckets as there are slots.
+void growjobs() {
+  int cap = jobs_cap ? jobs_cap * 2 : 64;
+  job *tab = realloc(jobs, cap * sizeof(job));
+  if (tab == NULL)
+    unix_error("growjobs error");
+  jobs = tab;
+  jobs_cap = cap;
+
+  free(jid_idx);
+  jid_idx_cap = cap * 2;
+  jid_idx = new_index(jid_idx_cap);
+  for (int i = 0; i < jobs_used; i++) {
+    if (jobs[i].st != UNINIT && jobs[i].jid != 0) {
+      int *b = jid_bucket(jobs[i].jid);
+      jobs[i].jid_next = *b;
+      *b = i;
+    }
+  }
+}
+
+// Same as growjobs for the process table and the pid index.
+void growprocs() {
+  int cap = procs_cap ? procs_cap * 2 : 64;
+  proc *tab = realloc(procs, cap * sizeof(proc));
+  if (tab == NULL)
+    unix_error("growprocs error");
+  procs = tab;
+  procs_cap = cap;
+
+  // Slots in the free list are marked UNINIT and never indexed.
+  free(pid_idx);
+  pid_idx_cap = cap * 2;
+  pid_idx = new_index(pid_idx_cap);
+  for (int p = 0; p < procs_used; p++) {
+    if (procs[p].st != UNINIT) {
+      int *b = pid_bucket(procs[p].pid);
+      procs[p].pid_next = *b;
+      *b = p;
+    }
+  }
+}
+
+// Command lines of jobs, interned in an append-only slab so that a job only
+// keeps an offset and the same command run again, e.g. in a loop, takes no
+// more room. Each string is preceded by a cmdent header. An index of
+// offsets hashed by content finds a string already in the slab. Strings no
+// job refers to stay in place, and are revived if they are interned again,
+// until more than half of the slab is dead and it gets compacted. Only
+// touched from the main loop, handlers never add or delete jobs.
+typedef struct {
+  unsigned refs;
+  unsigned len;
+  // New offset while compacting.
+  unsigned fwd;
+} cmdent;
+
+#define CMD_NONE ((unsigned)-1)
+
+static char *cmd_slab = NULL;
+static size_t cmd_slab_len = 0;
+static size_t cmd_slab_cap = 0;
+static size_t cmd_slab_dead = 0;
+static unsigned *cmd_idx = NULL;
+static size_t cmd_idx_cap = 0;
+static size_t cmd_idx_len = 0;
+
+cmdent *cmd_ent(unsigned off) { return (cmdent *)(cmd_slab + off); }
+
+char *cmd_str(unsigned off) {
+  return off == CMD_NONE ? "" : cmd_slab + off + sizeof(cmdent);
+}
+
+// Room a string of len bytes takes in the slab, keeping headers aligned.
+size_t cmd_size(size_t len) {
+  return (sizeof(cmdent) + len + 1 + sizeof(unsigned) - 1) &
+         ~(sizeof(unsigned) - 1);
+}
+
+void cmd_idx_insert(unsigned off) {
+  size_t h = hash_str(cmd_str(off)) & (cmd_idx_cap - 1);
+  while (cmd_idx[h] != CMD_NONE)
+    h = (h + 1) & (cmd_idx_cap - 1);
+  cmd_idx[h] = off;
+  cmd_idx_len++;
+}
+
+// Builds the index with room for at least cap entries over the live
+// strings, or all of them with all set.
+void cmd_idx_rebuild(size_t cap, int all) {
+  free(cmd_idx);
+  if ((cmd_idx = malloc(cap * sizeof(unsigned))) == NULL)
+    unix_error("malloc error");
+  memset(cmd_idx, 0xff, cap * sizeof(unsigned));
+  cmd_idx_cap = cap;
+  cmd_idx_len = 0;
+  for (size_t off = 0; off < cmd_slab_len;
+       off += cmd_size(cmd_ent(off)->len)) {
+    if (all || cmd_ent(off)->refs > 0)
+      cmd_idx_insert(off);
+  }
+}
+
+// Moves the live strings to the start of the slab and updates the jobs
+// which refer to them.
+void cmd_compact() {
+  size_t to = 0;
+  for (size_t off = 0; off < cmd_slab_len;
+       off += cmd_size(cmd_ent(off)->len)) {
+    if (cmd_ent(off)->refs > 0) {
+      cmd_ent(off)->fwd = to;
+      to += cmd_size(cmd_ent(off)->len);
+    }
+  }
+  for (int i = 0; i < jobs_used; i++) {
+    if (jobs[i].st != UNINIT && jobs[i].cmd != CMD_NONE)
+      jobs[i].cmd = cmd_ent(jobs[i].cmd)->fwd;
+  }
+  // Strings only move towards the start, so each one can be copied in
+  // place in order.
+  for (size_t off = 0, next; off < cmd_slab_len; off = next) {
+    cmdent *e = cmd_ent(off);
+    size_t size = cmd_size(e->len);
+    next = off + size;
+    if (e->refs > 0 && e->fwd != off)
+      memmove(cmd_slab + e->fwd, e, size);
+  }
+  cmd_slab_len = to;
+  cmd_slab_dead = 0;
+  cmd_idx_rebuild(cmd_idx_cap, 0);
+}
+
+// Returns the offset of the interned copy of the len bytes at s, which
+// needn't be NUL terminated.
+unsigned cmd_intern(char *s, size_t len) {
+  if (cmd_idx_cap == 0)
+    cmd_idx_rebuild(64, 0);
+
+  // Hash it where it'll be stored, so a match can be told from a fresh copy
+  // by the offset alone.
+  size_t size = cmd_size(len);
+  if (cmd_slab_len + size > cmd_slab_cap) {
+    size_t cap = cmd_slab_cap ? cmd_slab_cap * 2 : 4096;
+    while (cap < cmd_slab_len + size)
+      cap *= 2;
+    if ((cmd_slab = realloc(cmd_slab, cap)) == NULL)
+      unix_error("realloc error");
+    cmd_slab_cap = cap;
+  }
+  unsigned off = cmd_slab_len;
+  cmdent *e = cmd_ent(off);
+  memcpy(cmd_str(off), s, len);
+  cmd_str(off)[len] = '\0';
+  e->refs = 1;
+  e->len = len;
+
+  size_t h = hash_str(cmd_str(off)) & (cmd_idx_cap - 1);
+  for (; cmd_idx[h] != CMD_NONE; h = (h + 1) & (cmd_idx_cap - 1)) {
+    cmdent *m = cmd_ent(cmd_idx[h]);
+    if (m->len == len && !memcmp(cmd_str(cmd_idx[h]), s, len)) {
+      if (m->refs++ == 0)
+        cmd_slab_dead -= cmd_size(len);
+      return cmd_idx[h];
+    }
+  }
+
+  cmd_slab_len += size;
+  cmd_idx[h] = off;
+  if (++cmd_idx_len * 4 > cmd_idx_cap * 3)
+    cmd_idx_rebuild(cmd_idx_cap * 2, 1);
+  return off;
+}
+
+void cmd_release(unsigned off) {
+  if (off == CMD_NONE || --cmd_ent(off)->refs > 0)
+    return;
+  cmd_slab_dead += cmd_size(cmd_ent(off)->len);
+  if (cmd_slab_dead > 4096 && cmd_slab_dead * 2 > cmd_slab_len)
+    cmd_compact();
+}
+
+// Removes the job in slot i and its processes from the indexes and puts all
+// of their slots back in the free lists.
+void deljob(int i) {
+  int *p;
+  if (jobs[i].jid != 0) {
+    p = jid_bucket(jobs[i].jid);
+    while (*p != i)
+      p = &jobs[*p].jid_next;
+    *p = jobs[i].jid_next;
+  }
+
+  int pr = jobs[i].procs;
+  while (pr != -1) {
+    int sibling = procs[pr].sibling;
+    p = pid_bucket(procs[pr].pid);
+    while (*p != pr)
+      p = &procs[*p].pid_next;
+    *p = procs[pr].pid_next;
+
+    if (procs[pr].pidfd >= 0)
+      close(procs[pr].pidfd);
+    procs[pr].st = UNINIT;
+    procs[pr].pid_next = procs_free;
+    procs_free = pr;
+    pr = sibling;
+  }
+
+  jobs[i].st = UNINIT;
+  jobs[i].next = jobs_free;
+  jobs_free = i;
+  cmd_release(jobs[i].cmd);
+  stats.jobs_live--;
+}
+
+// 0 when running a script, a -c command or reading commands from something
+// other than a terminal. There's no prompt then.
+static int interactive = 1;
+
+// Background jobs kept on the done list for wait at most, so a script which
+// starts many without waiting for them doesn't grow the table forever.
+#define WAIT_KEEP 1024
+
+// Removes jobs which terminated since the last call. Background ones stay on
+// the done list until notify_jobs reported them at the prompt, and until
+// wait returned their status.
+void cleanup_jobs() {
+  int keep = -1, nkeep = 0;
+  while (jobs_done != -1) {
+    int i = jobs_done;
+    jobs_done = jobs[i].next;
+    if ((jobs[i].bg && interactive) ||
+        (jobs[i].unwaited && jobs[i].client < 0 && nkeep < WAIT_KEEP)) {
+      jobs[i].next = keep;
+      keep = i;
+      nkeep++;
+      continue;
+    }
+    if (jobs[i].client >= 0)
+      client_done(i);
+    deljob(i);
+  }
+  jobs_done = keep;
+}
+
+// Adds a job made of the n processes in pids, the first one being the
+// process group leader. Background jobs and stopped ones are given a jid
+// right away, foreground jobs only get one if they are stopped later on.
+// Returns the slot of the job, the tables grow as needed so there's always
+// room for a new one.
+int addjob(pid_t *pids, int n, Status st, char *cmd) {
+  int i;
+  if (jobs_free != -1) {
+    i = jobs_free;
+    jobs_free = jobs[i].next;
+  } else {
+    if (jobs_used == jobs_cap)
+      growjobs();
+    i = jobs_used++;
+  }
+
+  job *j = &jobs[i];
+  j->pgid = pids[0];
+  j->jid = 0;
+  j->st = st;
+  j->nlive = n;
+  j->nstopped = st == STOPPED ? n : 0;
+  j->procs = -1;
+  j->cmd = cmd != NULL ? cmd_intern(cmd, strlen(cmd)) : CMD_NONE;
+  timerclear(&j->utime);
+  timerclear(&j->stime);
+  j->maxrss = j->nvcsw = j->nivcsw = 0;
+  j->has_tmodes = 0;
+  j->client = -1;
+  j->counted = 0;
+  j->deadline = 0;
+  j->expired = 0;
+  j->bg = 0;
+  j->stop_notice = 0;
+  j->unwaited = 0;
+  clock_gettime(CLOCK_MONOTONIC, &j->start);
+
+  // Link processes in reverse so the list ends up in pipeline order.
+  for (int k = n - 1; k >= 0; k--) {
+    int p;
+    if (procs_free != -1) {
+      p = procs_free;
+      procs_free = procs[p].pid_next;
+    } else {
+      if (procs_used == procs_cap)
+        growprocs();
+      p = procs_used++;
+    }
+
+    procs[p].pid = pids[k];
+    procs[p].st = st;
+    procs[p].status = 0;
+    procs[p].job = i;
+    procs[p].sibling = j->procs;
+    procs[p].pidfd = -1;
+    j->procs = p;
+
+    int *b = pid_bucket(pids[k]);
+    procs[p].pid_next = *b;
+    *b = p;
+  }
+
+  if (st != RUNNING)
+    index_jid(i);
+  if (++stats.jobs_live > stats.jobs_peak)
+    stats.jobs_peak = stats.jobs_live;
+  return i;
+}
+
+// pid of a process of the job in slot i which didn't terminate yet, 0 if
+// there's none.
+pid_t live_proc(int i) {
+  for (int p = jobs[i].procs; p != -1; p = procs[p].sibling)
+    if (procs[p].st != TERMINATED)
+      return procs[p].pid;
+  return 0;
+}
+
+// Wait status of a job, which is the one of its last process.
+int job_status(int i) {
+  int p = jobs[i].procs;
+  while (procs[p].sibling != -1)
+    p = procs[p].sibling;
+  return procs[p].status;
+}
+
+// Background jobs with a stop_notice.
+static int stop_notices = 0;
+
+// Updates the status of a process and the job it belongs to from it. A job
+// is TERMINATED once all of its processes are, STOPPED when all the others
+// are stopped and RUNNING otherwise. ru is the usage wait4 reported for a
+// terminated process, it's added to the totals of the job. NULL otherwise.
+// Returns the slot of the job when there is a match for the given pid, or -1
+// otherwise.
+int setjobstat(pid_t pid, Status st, int status, struct rusage *ru) {
+  int p;
+  if ((p = findproc(pid)) == -1)
+    return -1;
+
+  proc *pr = &procs[p];
+  job *j = &jobs[pr->job];
+  pr->status = status;
+  if (pr->st == st)
+    return pr->job;
+
+  if (st == TERMINATED && ru != NULL) {
+    timeradd(&j->utime, &ru->ru_utime, &j->utime);
+    timeradd(&j->stime, &ru->ru_stime, &j->stime);
+    if (ru->ru_maxrss > j->maxrss)
+      j->maxrss = ru->ru_maxrss;
+    j->nvcsw += ru->ru_nvcsw;
+    j->nivcsw += ru->ru_nivcsw;
+  }
+
+  if (pr->st == STOPPED)
+    j->nstopped--;
+  if (st == STOPPED)
+    j->nstopped++;
+  if (st == TERMINATED)
+    j->nlive--;
+  pr->st = st;
+
+  if (j->nlive == 0) {
+    // clock_gettime is async-signal-safe.
+    clock_gettime(CLOCK_MONOTONIC, &j->end);
+    j->st = TERMINATED;
+    if (j->counted) {
+      sched_running--;
+      j->counted = 0;
+    }
+    j->next = jobs_done;
+    jobs_done = pr->job;
+  } else if (j->nstopped == j->nlive) {
+    j->st = STOPPED;
+    if (j->bg && !j->stop_notice) {
+      j->stop_notice = 1;
+      stop_notices++;
+    }
+  } else {
+    j->st = RUNNING;
+  }
+  return pr->job;
+}
+
+// Marks the stopped processes of a job as running again, used right after
+// sending SIGCONT to its process group.
+void continuejob(int i) {
+  for (int p = jobs[i].procs; p != -1; p = procs[p].sibling) {
+    if (procs[p].st == STOPPED)
+      setjobstat(procs[p].pid, RUNNING, 0, NULL);
+  }
+}
+
+char *jstatus_str(Status st) {
+  switch (st) {
+  case UNINIT:
+    return "UNINIT";
+  case RUNNING:
+    return "RUNNING";
+  case STOPPED:
+    return "STOPPED";
+  case TERMINATED:
+    return "TERMINATED";
+  }
+
+  return "";
+}
+
+// Used to forward Ctrl+C/Ctrl+Z to the foreground process group.
+// When a job is running in foreground, it should be set to
+// pgid of that job. When a command is run with &, this should
+// be set to 0 and there will be no signal forwarding.
+static int fg_pid = 0;
+
+// Set when Ctrl+C is typed while there is no foreground job, so the wait
+// builtin can stop waiting.
+static volatile sig_atomic_t sigint_pending = 0;
+
+// Status of the last command line: the exit status of its foreground job or
+// builtin, 0 once a background job is started and non-zero when the line
+// couldn't be run at all.
+static int last_status = 0;
+
+// Set once a $(...) of the line being evaluated ran, see subshell.
+static int subst_ran = 0;
+
+// Set by run_fg when Ctrl+C killed the job, the rest of the line is left
+// out then.
+static int list_break = 0;
+
+// Set when the shell reads commands from a terminal it controls. The
+// foreground job is then given the terminal with tcsetpgrp, so Ctrl+C and
+// Ctrl+Z reach all of its processes from the kernel, and the shell takes it
+// back with its own terminal modes once the job stops or terminates.
+// Otherwise signals the shell gets are forwarded by forward_to_fg.
+static int job_control = 0;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+
+// Called by children before they exec, the shell ignores the signals
+// stopping background jobs which touch the terminal.
+void reset_job_signals() {
+  if (job_control) {
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+  }
+}
+
+// Puts the shell in a process group of its own in the foreground of the
+// terminal, waiting until it gets there if it was started in background.
+// Without a controlling terminal the shell runs without job control.
+void init_job_control() {
+  pid_t fg;
+  while ((fg = tcgetpgrp(STDIN_FILENO)) != (shell_pgid = getpgrp())) {
+    if (fg < 0)
+      return;
+    kill(-shell_pgid, SIGTTIN);
+  }
+
+  signal(SIGTTOU, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  // Fails for a session leader, which leads its group already.
+  setpgid(0, 0);
+  shell_pgid = getpgrp();
+  if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0 ||
+      tcgetattr(STDIN_FILENO, &shell_tmodes) < 0)
+    return;
+  job_control = 1;
+}
+
+// Gives the terminal to the job in slot i, with the modes it had when it
+// stopped. Fails harmlessly for a job which terminated already.
+void tty_give(int i) {
+  if (!job_control)
+    return;
+  if (jobs[i].has_tmodes)
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &jobs[i].tmodes);
+  tcsetpgrp(STDIN_FILENO, jobs[i].pgid);
+}
+
+// Takes the terminal back from the job in slot i, saving its modes if it
+// stopped, and puts back the modes of the shell.
+void tty_take(int i) {
+  if (!job_control)
+    return;
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  if (jobs[i].st == STOPPED)
+    jobs[i].has_tmodes = tcgetattr(STDIN_FILENO, &jobs[i].tmodes) == 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+}
+
+void unix_error(char *msg) {
+  fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+  exit(0);
+}
+
+// Job lifecycle tracing, enabled with -t file or the trace builtin. Events
+// are stored in a fixed ring which keeps the last TRACE_CAP of them, a slot
+// is claimed with an atomic increment so handlers can record events too.
+// The ring is written out as Chrome trace-event JSON, where each job is a
+// process and each of its processes a thread, from spawn until exit.
+typedef enum {
+  EV_SPAWN,
+  EV_EXIT,
+  EV_STOP,
+  EV_CONT,
+  EV_FG_BEGIN,
+  EV_FG_END,
+  EV_RESUME_FG,
+  EV_RESUME_BG,
+} EvType;
+
+typedef struct {
+  uint64_t ns;
+  EvType type;
+  pid_t pid;
+  pid_t pgid;
+  int arg;
+} trace_ev;
+
+#define TRACE_CAP 4096
+
+static trace_ev trace_buf[TRACE_CAP];
+static unsigned long trace_head = 0;
+static int tracing = 0;
+// Written when the shell exits if set.
+static char *trace_path = NULL;
+static pid_t shell_pid;
+
+// Records an event if tracing is on. Async-signal-safe.
+void trace_event(EvType type, pid_t pid, pid_t pgid, int arg) {
+  if (!tracing)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  unsigned long k = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  trace_ev *e = &trace_buf[k % TRACE_CAP];
+  e->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  e->type = type;
+  e->pid = pid;
+  e->pgid = pgid;
+  e->arg = arg;
+}
+
+// Records what a wait status reported for a process of the job in slot i,
+// -1 if it's not in the job table.
+void trace_status(int i, pid_t pid, int status) {
+  EvType type;
+  if (WIFEXITED(status) || WIFSIGNALED(status))
+    type = EV_EXIT;
+  else if (WIFSTOPPED(status))
+    type = EV_STOP;
+  else
+    type = EV_CONT;
+  trace_event(type, pid, i >= 0 ? jobs[i].pgid : pid, status);
+}
+
+void trace_write_ev(FILE *f, trace_ev *e) {
+  static char *names[] = {"process", "process",    "stop", "continue",
+                          "foreground", "foreground", "fg", "bg"};
+  static char ph[] = {'B', 'E', 'i', 'i', 'B', 'E', 'i', 'i'};
+  pid_t pid = e->pgid, tid = e->pid;
+  if (e->type == EV_FG_BEGIN || e->type == EV_FG_END)
+    pid = tid = shell_pid;
+
+  fprintf(f, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+             "\"tid\":%d",
+          names[e->type], ph[e->type], e->ns / 1e3, pid, tid);
+  if (ph[e->type] == 'i')
+    fprintf(f, ",\"s\":\"t\"");
+  switch (e->type) {
+  case EV_EXIT:
+    if (WIFSIGNALED(e->arg))
+      fprintf(f, ",\"args\":{\"signal\":%d}", WTERMSIG(e->arg));
+    else
+      fprintf(f, ",\"args\":{\"exit\":%d}", WEXITSTATUS(e->arg));
+    break;
+  case EV_STOP:
+    fprintf(f, ",\"args\":{\"signal\":%d}", WSTOPSIG(e->arg));
+    break;
+  case EV_FG_BEGIN:
+  case EV_FG_END:
+    fprintf(f, ",\"args\":{\"pgid\":%d}", e->pgid);
+    break;
+  default:
+    break;
+  }
+  fprintf(f, "}");
+}
+
+// Writes the events in the ring, oldest first, to path or to stdout if it's
+// NULL. Returns -1 if path can't be written.
+int trace_dump(char *path) {
+  FILE *f = stdout;
+  if (path != NULL && (f = fopen(path, "we")) == NULL)
+    return -1;
+
+  // Keep handlers from recording while the ring is read.
+  sigset_t mask, prev;
+  sigfillset(&mask);
+  sigprocmask(SIG_BLOCK, &mask, &prev);
+
+  unsigned long end = trace_head;
+  unsigned long k = end > TRACE_CAP ? end - TRACE_CAP : 0;
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+             "\"args\":{\"name\":\"shell\"}}",
+          shell_pid);
+  for (; k < end; k++) {
+    fprintf(f, ",\n");
+    trace_write_ev(f, &trace_buf[k % TRACE_CAP]);
+  }
+  fprintf(f, "\n]}\n");
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  if (f != stdout)
+    fclose(f);
+  else
+    fflush(f);
+  return 0;
+}
+
+// Registered with atexit for -t. Children which exit through the same code,
+// e.g. builtins running in a child, don't write the file.
+void trace_exit() {
+  if (getpid() == shell_pid && trace_dump(trace_path) < 0)
+    fprintf(stderr, "%s: %s\n", trace_path, strerror(errno));
+}
+
+// Leveled logging for code which runs in signal handlers. Messages are
+// formatted into a single-producer ring, the producer being whichever
+// handler runs as they block all signals, or the main loop in event mode
+// where there are no handlers. The main loop drains the ring into log_fd
+// before each prompt and whenever it wakes up for children. A message is
+// dropped, and counted, when the ring is full.
+typedef enum {
+  LOG_ERROR,
+  LOG_INFO,
+  LOG_DEBUG,
+} LogLevel;
+
+#define LOG_SLOTS 256
+#define LOG_MSG 128
+
+typedef struct {
+  char msg[LOG_MSG];
+  size_t len;
+} logent;
 
-    // An entry already exists for this pid;
-    if (j->pid == pid) {
-      j->st = st;
-      return j->jid;
+static logent log_ring[LOG_SLOTS];
+static unsigned log_head = 0;
+static unsigned log_tail = 0;
+static unsigned log_dropped = 0;
+static LogLevel log_level = LOG_INFO;
+static int log_fd = STDERR_FILENO;
+static char *log_path = NULL;
+
+static char *log_levels[] = {"error", "info", "debug", NULL};
+
+// vsnprintf isn't async-signal-safe, this only knows %d, %s and %%. Output
+// is truncated to size - 1 and always ends with a newline. Returns the
+// length written.
+size_t log_fmt(char *buf, size_t size, const char *fmt, va_list ap) {
+  size_t n = 0;
+  size -= 1;
+  for (; *fmt && n < size; fmt++) {
+    if (*fmt != '%') {
+      buf[n++] = *fmt;
+      continue;
+    }
+    fmt++;
+    if (*fmt == 's') {
+      for (char *s = va_arg(ap, char *); *s && n < size; s++)
+        buf[n++] = *s;
+    } else if (*fmt == 'd') {
+      char digits[12];
+      int d = va_arg(ap, int), k = 0;
+      unsigned u = d < 0 ? -(unsigned)d : (unsigned)d;
+      do
+        digits[k++] = '0' + u % 10;
+      while ((u /= 10) > 0);
+      if (d < 0)
+        digits[k++] = '-';
+      while (k > 0 && n < size)
+        buf[n++] = digits[--k];
+    } else if (*fmt == '%') {
+      buf[n++] = '%';
+    } else {
+      break;
     }
+  }
+  buf[n++] = '\n';
+  return n;
+}
+
+// Queues a message if level is enabled. Async-signal-safe.
+void log_async(LogLevel level, const char *fmt, ...) {
+  if (level > log_level)
+    return;
+
+  unsigned head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == LOG_SLOTS) {
+    __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
 
-    if (j->st == UNINIT || j->st == TERMINATED) {
-      free_job = j;
+  logent *e = &log_ring[head % LOG_SLOTS];
+  va_list ap;
+  va_start(ap, fmt);
+  e->len = log_fmt(e->msg, sizeof(e->msg), fmt, ap);
+  va_end(ap);
+  __atomic_store_n(&log_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_write(char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(log_fd, buf, len);
+    if (n < 0 && errno == EINTR)
       continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+// Writes out the queued messages. Only called from the main loop.
+void log_flush() {
+  unsigned tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+  unsigned head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+  if (tail == head && log_dropped == 0)
+    return;
+
+  // Anything printed to stdout so far comes first when both are the
+  // terminal.
+  fflush(stdout);
+  for (; tail != head; tail++) {
+    logent *e = &log_ring[tail % LOG_SLOTS];
+    log_write(e->msg, e->len);
+    __atomic_store_n(&log_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  unsigned dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "[log] dropped %u messages\n",
+                       dropped);
+    log_write(buf, len);
+  }
+}
+
+// Appends log messages to path instead of stderr. Returns -1 if it can't be
+// opened.
+int log_open(char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  log_flush();
+  if (log_fd != STDERR_FILENO)
+    close(log_fd);
+  free(log_path);
+  log_fd = fd;
+  log_path = strdup(path);
+  return 0;
+}
+
+// Returns the level called name, or -1 if there's none.
+int log_parse_level(char *name) {
+  for (int i = 0; log_levels[i] != NULL; i++) {
+    if (!strcmp(log_levels[i], name))
+      return i;
+  }
+  return -1;
+}
+
+// log [error|info|debug] [-f file|-]
+// Sets the verbosity and where messages go, - being stderr. Prints both
+// without arguments.
+int builtin_log(char **argv) {
+  if (argv[1] == NULL) {
+    printf("%s %s\n", log_levels[log_level],
+           log_path != NULL ? log_path : "stderr");
+    return 0;
+  }
+
+  for (int k = 1; argv[k] != NULL; k++) {
+    int level;
+    if (!strcmp(argv[k], "-f") && argv[k + 1] != NULL) {
+      char *path = argv[++k];
+      if (!strcmp(path, "-")) {
+        log_flush();
+        if (log_fd != STDERR_FILENO)
+          close(log_fd);
+        free(log_path);
+        log_fd = STDERR_FILENO;
+        log_path = NULL;
+      } else if (log_open(path) < 0) {
+        printf("%s: %s\n", path, strerror(errno));
+        return 1;
+      }
+    } else if ((level = log_parse_level(argv[k])) >= 0) {
+      log_level = level;
+    } else {
+      printf("log: usage: log [error|info|debug] [-f file|-]\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Sends sig to every process of the foreground job. Only forward if there is
+// a foreground job, otherwise ignore the signal.
+void forward_to_fg(int sig) {
+  if (fg_pid) {
+    log_async(LOG_DEBUG, "[ForwardSignalHandler] forwarding sig %d to %d", sig,
+              fg_pid);
+    /* It's tempting to try to handle the error and not fail in case
+     * of ESRCH, but we're making sure that we will only call kill for
+     * valid pids by checking fg_pid, and we want such errors to be deteced.
+     * Addtionally all signals are blocked when this function starts, so it
+     * eliminates the possibility of receiving SIGINT while handling SIGTSTP,
+     * thus we won't end up sending the same signal twice to a process.
+     * Due to implicit signal blocking, receiving the same signal won't
+     * interrupt handling another, even without an explicit sigprocmask. */
+    if (kill(-fg_pid, sig) < 0) {
+      unix_error("Forward SIGINT|SIGTSTP error");
+    }
+    stats.signals_forwarded++;
+  } else if (sig == SIGINT) {
+    sigint_pending = 1;
+  }
+}
+
+// handles SIGINT and SIGTSTP.
+void forward_signal(int sig) {
+  // No need to save and restore errno as we don't expected any errors here.
+  sigset_t mask_all, prev_all;
+  if (sigfillset(&mask_all) < 0)
+    unix_error("sigfillset error");
+
+  if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
+    unix_error("sigprocmask block error");
+
+  forward_to_fg(sig);
+
+  if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+}
+
+// Deadlines of jobs started with timeout, in a binary heap ordered by time.
+// A single POSIX timer is armed for the earliest one. Its SIGALRM is handled
+// like SIGCHLD: by a handler in the default mode, from the signalfd in event
+// mode. The heap only grows in code running with SIGALRM blocked, and the
+// handler never allocates, an entry is replaced in place when SIGTERM was
+// sent and the job is due for SIGKILL.
+//
+// Entries aren't removed when their job terminates, they're skipped once
+// they expire.
+typedef struct {
+  long long at;
+  int slot;
+  pid_t pgid;
+} deadline_ent;
+
+static deadline_ent *tmo_heap = NULL;
+static int tmo_len = 0;
+static int tmo_cap = 0;
+static timer_t tmo_timer;
+static int tmo_timer_ok = 0;
+
+#define TIMEOUT_GRACE 2.0
+
+long long mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void tmo_sift_down(int k) {
+  while (1) {
+    int min = k;
+    for (int c = 2 * k + 1; c <= 2 * k + 2 && c < tmo_len; c++)
+      if (tmo_heap[c].at < tmo_heap[min].at)
+        min = c;
+    if (min == k)
+      return;
+    deadline_ent t = tmo_heap[k];
+    tmo_heap[k] = tmo_heap[min];
+    tmo_heap[min] = t;
+    k = min;
+  }
+}
+
+// Arms the timer for the earliest deadline, or disarms it. SIGALRM also
+// comes from the stats timer, before this one may have been created.
+void tmo_arm() {
+  if (!tmo_timer_ok)
+    return;
+  struct itimerspec its = {0};
+  if (tmo_len > 0) {
+    its.it_value.tv_sec = tmo_heap[0].at / 1000000000LL;
+    its.it_value.tv_nsec = tmo_heap[0].at % 1000000000LL;
+  }
+  if (timer_settime(tmo_timer, TIMER_ABSTIME, &its, NULL) < 0)
+    unix_error("timer_settime error");
+}
+
+// Gives the job in slot i a deadline secs from now.
+void timeout_add(int i, double secs, double grace) {
+  if (!tmo_timer_ok) {
+    struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL,
+                           .sigev_signo = SIGALRM};
+    if (timer_create(CLOCK_MONOTONIC, &sev, &tmo_timer) < 0)
+      unix_error("timer_create error");
+    tmo_timer_ok = 1;
+  }
+  if (tmo_len == tmo_cap) {
+    int cap = tmo_cap ? tmo_cap * 2 : 16;
+    deadline_ent *h = realloc(tmo_heap, cap * sizeof(deadline_ent));
+    if (h == NULL)
+      unix_error("realloc error");
+    tmo_heap = h;
+    tmo_cap = cap;
+  }
+
+  job *j = &jobs[i];
+  j->deadline = mono_ns() + (long long)(secs * 1e9);
+  j->grace = (long long)(grace * 1e9);
+  int k = tmo_len++;
+  tmo_heap[k] = (deadline_ent){j->deadline, i, j->pgid};
+  while (k > 0 && tmo_heap[k].at < tmo_heap[(k - 1) / 2].at) {
+    deadline_ent t = tmo_heap[k];
+    tmo_heap[k] = tmo_heap[(k - 1) / 2];
+    tmo_heap[(k - 1) / 2] = t;
+    k = (k - 1) / 2;
+  }
+  if (k == 0)
+    tmo_arm();
+}
+
+// Signals the jobs whose deadline passed. The status of the ones which
+// terminate is recorded when they're reaped, as for any other job.
+void timeout_expire() {
+  long long now = mono_ns();
+  while (tmo_len > 0 && tmo_heap[0].at <= now) {
+    deadline_ent *e = &tmo_heap[0];
+    job *j = &jobs[e->slot];
+    if (e->slot < jobs_used && j->st != UNINIT && j->st != TERMINATED &&
+        j->pgid == e->pgid && j->deadline == e->at) {
+      if (!j->expired) {
+        log_async(LOG_DEBUG, "[Timeout] SIGTERM to %d", j->pgid);
+        // A stopped job has to run to act on SIGTERM.
+        kill(-j->pgid, SIGTERM);
+        kill(-j->pgid, SIGCONT);
+        j->expired = 1;
+        j->deadline = e->at = now + j->grace;
+        tmo_sift_down(0);
+        continue;
+      }
+      log_async(LOG_DEBUG, "[Timeout] SIGKILL to %d", j->pgid);
+      kill(-j->pgid, SIGKILL);
+      j->expired = 2;
+    }
+    tmo_heap[0] = tmo_heap[--tmo_len];
+    tmo_sift_down(0);
+  }
+  tmo_arm();
+}
+
+// SIGALRM handler of the default mode.
+void timeout_handler(int sig) {
+  int olderrno = errno;
+  sigset_t mask_all, prev_all;
+  if (sigfillset(&mask_all) < 0)
+    unix_error("sigfillset error");
+  if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
+    unix_error("sigprocmask block error");
+
+  timeout_expire();
+  stats_tick();
+
+  if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+  errno = olderrno;
+}
+
+// Exit status of the job in slot i which terminated, 124 if it was stopped
+// for its deadline as with timeout(1).
+int job_exit(int i) {
+  return jobs[i].expired ? 124 : exit_code(job_status(i));
+}
+
+// stats [reset | dump file secs | dump off]
+// Prints the counters of the shell, or resets them. dump appends them to
+// file as one line of name=value pairs every secs seconds, driven by a timer
+// of its own which raises SIGALRM like the one for deadlines.
+static long long blocked_since = 0;
+static int stats_fd = -1;
+static timer_t stats_timer;
+static int stats_timer_ok = 0;
+static long long stats_every = 0;
+static long long stats_next = 0;
+
+// Called where SIGCHLD gets blocked in the main loop, or in event mode where
+// the signalfd stops being read, and where that ends.
+void blocked_begin() {
+  if (blocked_since == 0)
+    blocked_since = mono_ns();
+}
+
+void blocked_end() {
+  if (blocked_since == 0)
+    return;
+  unsigned long long d = mono_ns() - blocked_since;
+  blocked_since = 0;
+  stats.blocked_ns += d;
+  if (d > stats.blocked_max_ns)
+    stats.blocked_max_ns = d;
+}
+
+// Appends name, '=', v and sep to buf at n and returns the new length.
+// Async-signal-safe, unlike snprintf, the dump is written from the SIGALRM
+// handler.
+size_t stats_put(char *buf, size_t n, char *name, unsigned long long v,
+                 char sep) {
+  while (*name)
+    buf[n++] = *name++;
+  buf[n++] = '=';
+  char digits[20];
+  int k = 0;
+  do
+    digits[k++] = '0' + v % 10;
+  while ((v /= 10) > 0);
+  while (k > 0)
+    buf[n++] = digits[--k];
+  buf[n++] = sep;
+  return n;
+}
+
+// Formats all counters into buf, which has room for STATS_MAX bytes.
+#define STATS_MAX 1024
+
+size_t stats_format(char *buf, size_t n, char sep) {
+  struct {
+    char *name;
+    unsigned long long v;
+  } f[] = {
+      {"forks", stats.forks},
+      {"posix_spawns", stats.posix_spawns},
+      {"zygote_spawns", stats.zygote_spawns},
+      {"execs", stats.execs},
+      {"exec_failures", stats.exec_failures},
+      {"signals_forwarded", stats.signals_forwarded},
+      {"reap_calls", stats.reap_calls},
+      {"reaped", stats.reaped},
+      {"reaped_max", stats.reaped_max},
+      {"reap_empty", stats.reap_empty},
+      {"jobs_live", stats.jobs_live},
+      {"jobs_peak", stats.jobs_peak},
+      {"jobs_cap", jobs_cap},
+      {"blocked_us", stats.blocked_ns / 1000},
+      {"blocked_max_us", stats.blocked_max_ns / 1000},
+  };
+  for (size_t k = 0; k < sizeof(f) / sizeof(f[0]); k++)
+    n = stats_put(buf, n, f[k].name, f[k].v, sep);
+  return n;
+}
+
+// Writes a line to the dump file once it's due. Also called for SIGALRMs of
+// the deadline timer, which come at other times.
+void stats_tick() {
+  if (stats_fd < 0)
+    return;
+  long long now = mono_ns();
+  if (now < stats_next)
+    return;
+  while (stats_next <= now)
+    stats_next += stats_every;
+
+  char buf[STATS_MAX];
+  size_t n = stats_put(buf, 0, "time_ms", now / 1000000, ' ');
+  n = stats_format(buf, n, ' ');
+  buf[n - 1] = '\n';
+  if (write(stats_fd, buf, n) < 0)
+    log_async(LOG_ERROR, "stats dump: %s", strerror(errno));
+}
+
+void stats_dump_off() {
+  if (stats_fd < 0)
+    return;
+  struct itimerspec its = {0};
+  timer_settime(stats_timer, 0, &its, NULL);
+  close(stats_fd);
+  stats_fd = -1;
+}
+
+int builtin_stats(char **argv) {
+  if (argv[1] == NULL) {
+    char buf[STATS_MAX];
+    size_t n = stats_format(buf, 0, '\n');
+    fwrite(buf, 1, n, stdout);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "reset") && argv[2] == NULL) {
+    unsigned long live = stats.jobs_live;
+    memset(&stats, 0, sizeof(stats));
+    stats.jobs_live = stats.jobs_peak = live;
+    return 0;
+  }
+
+  if (strcmp(argv[1], "dump") || argv[2] == NULL) {
+    printf("usage: stats [reset | dump file secs | dump off]\n");
+    return 1;
+  }
+  if (!strcmp(argv[2], "off")) {
+    stats_dump_off();
+    return 0;
+  }
+  double secs = parse_secs(argv[3]);
+  if (secs <= 0) {
+    printf("stats: %s: invalid interval\n", argv[3] ? argv[3] : "");
+    return 1;
+  }
+  int fd = open(argv[2], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    printf("%s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+  if (!stats_timer_ok) {
+    struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL,
+                           .sigev_signo = SIGALRM};
+    if (timer_create(CLOCK_MONOTONIC, &sev, &stats_timer) < 0)
+      unix_error("timer_create error");
+    stats_timer_ok = 1;
+  }
+  stats_dump_off();
+  stats_fd = fd;
+  stats_every = secs * 1e9;
+  stats_next = mono_ns() + stats_every;
+  struct itimerspec its;
+  its.it_value.tv_sec = its.it_interval.tv_sec = stats_every / 1000000000;
+  its.it_value.tv_nsec = its.it_interval.tv_nsec = stats_every % 1000000000;
+  if (timer_settime(stats_timer, 0, &its, NULL) < 0)
+    unix_error("timer_settime error");
+  return 0;
+}
+
+// Set to 1 to receive signals through a signalfd polled together with stdin
+// instead of asynchronous handlers.
+static int event_mode = 0;
+static int sig_fd = -1;
+
+// Listening socket of server mode, which stops once SIGINT or SIGTERM is
+// read from the signalfd.
+static int server_fd = -1;
+static int server_stop = 0;
+
+// Children whose status changed, collected by reap_children before the job
+// table is touched. It's static as it's filled in the SIGCHLD handler.
+#define REAP_BATCH 64
+
+typedef struct {
+  pid_t pid;
+  int status;
+  struct rusage ru;
+} reap_ent;
+
+static reap_ent reap_batch[REAP_BATCH];
+
+// The wait status wait4 would have returned for the change waitid reported.
+int si_wait_status(siginfo_t *si) {
+  switch (si->si_code) {
+  case CLD_EXITED:
+    return (si->si_status & 0xff) << 8;
+  case CLD_KILLED:
+    return si->si_status;
+  case CLD_DUMPED:
+    return si->si_status | 0x80;
+  case CLD_STOPPED:
+  case CLD_TRAPPED:
+    return (si->si_status << 8) | 0x7f;
+  default: // CLD_CONTINUED
+    return 0xffff;
+  }
+}
+
+// Reaps children and updates the job status to be one of the following:
+// TERMINATED: when child exists normally or terminated by a signal.
+// STOPPED: when child is suspended with SIGTSTP.
+// RUNNING: when child resumes execution.
+//
+// Every child which is ready is collected with waitid into reap_batch first,
+// then the whole batch is applied to the job table in one pass, so a storm
+// of jobs finishing together costs one pass per REAP_BATCH of them. Nothing
+// is printed here, background jobs are reported by notify_jobs before the
+// next prompt.
+void reap_children() {
+  unsigned long total = 0;
+  int n;
+  do {
+    // We want to be informed if children were terminated, stopped or
+    // continued so that we can keep update their status accordingly.
+    // glibc's waitid has no argument for the resources used by terminated
+    // ones, the system call does.
+    for (n = 0; n < REAP_BATCH; n++) {
+      siginfo_t si;
+      si.si_pid = 0;
+      if (syscall(SYS_waitid, P_ALL, 0, &si,
+                  WNOHANG | WEXITED | WSTOPPED | WCONTINUED,
+                  &reap_batch[n].ru) < 0) {
+        assert(errno == ECHILD);
+        break;
+      }
+      if (si.si_pid == 0)
+        break;
+      reap_batch[n].pid = si.si_pid;
+      reap_batch[n].status = si_wait_status(&si);
+    }
+
+    for (int k = 0; k < n; k++) {
+      reap_ent *e = &reap_batch[k];
+      Status st;
+      if (WIFEXITED(e->status) || WIFSIGNALED(e->status))
+        st = TERMINATED;
+      else if (WIFSTOPPED(e->status))
+        st = STOPPED;
+      else // WIFCONTINUED
+        st = RUNNING;
+      int i = setjobstat(e->pid, st, e->status,
+                         st == TERMINATED ? &e->ru : NULL);
+      trace_status(i, e->pid, e->status);
+    }
+    total += n;
+  } while (n == REAP_BATCH);
+  if (total > 0)
+    log_async(LOG_DEBUG, "[ReapChildHandler] reaped %d children", (int)total);
+
+  stats.reap_calls++;
+  stats.reaped += total;
+  if (total > stats.reaped_max)
+    stats.reaped_max = total;
+  stats.reap_empty += total == 0;
+}
+
+// SIGCHLD handler of the default mode.
+void reap_child(int sig) {
+  sigset_t mask_all, prev_all;
+  if (sigfillset(&mask_all) < 0)
+    unix_error("sigfillset error");
+
+  if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
+    unix_error("sigprocmask block error");
+
+  reap_children();
+
+  if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+}
+
+// Drains the signalfd in event mode. All pending SIGCHLDs are coalesced into
+// a single pass of reap_children.
+void handle_signals() {
+  struct signalfd_siginfo si[16];
+  ssize_t n;
+  int reap = 0;
+
+  while ((n = read(sig_fd, si, sizeof(si))) > 0) {
+    for (size_t i = 0; i < n / sizeof(si[0]); i++) {
+      if (si[i].ssi_signo == SIGCHLD)
+        reap = 1;
+      else if (si[i].ssi_signo == SIGALRM) {
+        timeout_expire();
+        stats_tick();
+      }
+      else if (server_fd >= 0 && si[i].ssi_signo != SIGTSTP)
+        server_stop = 1;
+      else
+        forward_to_fg(si[i].ssi_signo);
+    }
+  }
+  if (n < 0 && errno != EAGAIN)
+    unix_error("signalfd read error");
+
+  if (reap)
+    reap_children();
+}
+
+// Blocks until children changed state and the job table was updated for
+// them, and admits queued jobs there's room for now. SIGCHLD and SIGALRM
+// must be blocked by the caller in the default mode, they're only let
+// through for as long as sigsuspend sleeps.
+void wait_for_child() {
+  if (event_mode) {
+    struct pollfd pfd = {.fd = sig_fd, .events = POLLIN};
+    blocked_end();
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      unix_error("poll error");
+    blocked_begin();
+    handle_signals();
+    sched_admit();
+    log_flush();
+    return;
+  }
+
+  sigset_t mask;
+  if (sigprocmask(SIG_SETMASK, NULL, &mask) < 0 ||
+      sigdelset(&mask, SIGCHLD) < 0 || sigdelset(&mask, SIGALRM) < 0)
+    unix_error("sigprocmask error");
+  blocked_end();
+  sigsuspend(&mask);
+  blocked_begin();
+  sched_admit();
+  log_flush();
+}
+
+// PATH lookup cache, maps a command name to the full path it resolved to the
+// first time it was run. Entries are chained per bucket and the table doubles
+// once it's more than 3/4 full. The whole table is dropped when the value of
+// PATH differs from the one it was filled with.
+typedef struct pathent {
+  char *name;
+  char *path;
+  unsigned hits;
+  struct pathent *next;
+} pathent;
+
+static pathent **path_tab = NULL;
+static size_t path_tab_cap = 0;
+static size_t path_tab_len = 0;
+static char *path_tab_env = NULL;
+
+#define DEFAULT_PATH "/usr/bin:/bin"
+
+// FNV-1a, good enough for short command names.
+unsigned hash_str(const char *s) {
+  unsigned h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void path_reset() {
+  for (size_t i = 0; i < path_tab_cap; i++) {
+    pathent *e = path_tab[i];
+    while (e) {
+      pathent *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
+    }
+    path_tab[i] = NULL;
+  }
+  path_tab_len = 0;
+}
+
+// Drops the cache if PATH was changed since the table was filled. An unset
+// PATH searches DEFAULT_PATH rather than the current directory.
+void path_check_env() {
+  char *env = var_get("PATH");
+  if (env == NULL)
+    env = DEFAULT_PATH;
+
+  if (path_tab_env != NULL && !strcmp(path_tab_env, env))
+    return;
+
+  path_reset();
+  free(path_tab_env);
+  if ((path_tab_env = strdup(env)) == NULL)
+    unix_error("strdup error");
+}
+
+pathent *path_lookup(char *name) {
+  if (path_tab_cap == 0)
+    return NULL;
+
+  pathent *e = path_tab[hash_str(name) & (path_tab_cap - 1)];
+  for (; e; e = e->next) {
+    if (!strcmp(e->name, name))
+      return e;
+  }
+  return NULL;
+}
+
+void path_grow() {
+  size_t cap = path_tab_cap ? path_tab_cap * 2 : 64;
+  pathent **tab = calloc(cap, sizeof(pathent *));
+  if (tab == NULL)
+    unix_error("calloc error");
+
+  for (size_t i = 0; i < path_tab_cap; i++) {
+    pathent *e = path_tab[i];
+    while (e) {
+      pathent *next = e->next;
+      size_t b = hash_str(e->name) & (cap - 1);
+      e->next = tab[b];
+      tab[b] = e;
+      e = next;
+    }
+  }
+
+  free(path_tab);
+  path_tab = tab;
+  path_tab_cap = cap;
+}
+
+pathent *path_insert(char *name, char *path) {
+  if (path_tab_len + 1 > path_tab_cap / 4 * 3)
+    path_grow();
+
+  pathent *e = malloc(sizeof(pathent));
+  if (e == NULL || (e->name = strdup(name)) == NULL ||
+      (e->path = strdup(path)) == NULL)
+    unix_error("malloc error");
+  e->hits = 0;
+
+  size_t b = hash_str(name) & (path_tab_cap - 1);
+  e->next = path_tab[b];
+  path_tab[b] = e;
+  path_tab_len++;
+  return e;
+}
+
+// Walks the PATH directories looking for an executable regular file named
+// name. Returns 1 and fills buf when found, 0 otherwise.
+int path_search(char *name, char *buf, size_t size) {
+  char *dirs = path_tab_env;
+  struct stat sb;
+
+  while (1) {
+    char *end = strchr(dirs, ':');
+    size_t len = end ? (size_t)(end - dirs) : strlen(dirs);
+
+    // An empty PATH entry means the current directory.
+    int n;
+    if (len == 0)
+      n = snprintf(buf, size, "./%s", name);
+    else
+      n = snprintf(buf, size, "%.*s/%s", (int)len, dirs, name);
+
+    if (n > 0 && (size_t)n < size && stat(buf, &sb) == 0 &&
+        S_ISREG(sb.st_mode) && access(buf, X_OK) == 0)
+      return 1;
+
+    if (end == NULL)
+      return 0;
+    dirs = end + 1;
+  }
+}
+
+// Returns the path that should be passed to execve for name, or NULL when no
+// such command exist. Names containing a slash are used as is, the rest are
+// resolved through PATH and remembered so following runs skip the search.
+char *find_command(char *name) {
+  if (strchr(name, '/'))
+    return name;
+
+  path_check_env();
+
+  pathent *e;
+  if ((e = path_lookup(name)) == NULL) {
+    char buf[MAXLINE];
+    if (!path_search(name, buf, sizeof(buf)))
+      return NULL;
+    e = path_insert(name, buf);
+  }
+
+  e->hits++;
+  return e->path;
+}
+
+// hash [-r] [name ...]
+// Without arguments lists the cached commands, -r forgets all of them and
+// names are looked up and added to the cache without running them.
+int builtin_hash(char **argv) {
+  path_check_env();
+
+  if (argv[1] == NULL) {
+    if (path_tab_len == 0) {
+      printf("hash: hash table empty\n");
+      return 0;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < path_tab_cap; i++) {
+      for (pathent *e = path_tab[i]; e; e = e->next)
+        printf("%4u\t%s\n", e->hits, e->path);
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = 1; argv[i] != NULL; i++) {
+    if (!strcmp(argv[i], "-r")) {
+      path_reset();
+      continue;
+    }
+    if (strchr(argv[i], '/') || path_lookup(argv[i]))
+      continue;
+
+    char buf[MAXLINE];
+    if (path_search(argv[i], buf, sizeof(buf))) {
+      path_insert(argv[i], buf);
+    } else {
+      printf("hash: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Bump allocator for everything a command needs until eval returns: argv,
+// the stages of a pipeline and their pids. Chunks are chained, reset frees
+// all but the newest one which is reused by the next command.
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t cap;
+  size_t used;
+  max_align_t data[];
+} arena_chunk;
+
+typedef struct {
+  arena_chunk *head;
+} arena;
+
+#define ARENA_CHUNK 65536
+
+static arena cmd_arena = {0};
+
+void *arena_alloc(arena *a, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  arena_chunk *c = a->head;
+  if (c == NULL || c->cap - c->used < size) {
+    size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    if ((c = malloc(sizeof(arena_chunk) + cap)) == NULL)
+      unix_error("malloc error");
+    c->cap = cap;
+    c->used = 0;
+    c->next = a->head;
+    a->head = c;
+  }
+  void *p = (char *)c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+// Position of an arena, everything allocated after it is freed at once by
+// arena_release. The arena is empty again when m is the position it had
+// before anything was allocated from it.
+typedef struct {
+  arena_chunk *head;
+  size_t used;
+} arena_mark;
+
+arena_mark arena_pos(arena *a) {
+  return (arena_mark){a->head, a->head != NULL ? a->head->used : 0};
+}
+
+void arena_release(arena *a, arena_mark m) {
+  while (a->head != m.head) {
+    // The first chunk is kept for the next command.
+    if (a->head->next == NULL && m.head == NULL) {
+      a->head->used = 0;
+      return;
+    }
+    arena_chunk *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+  if (a->head != NULL)
+    a->head->used = m.used;
+}
+
+// Input buffer for reading command lines with read(2) instead of stdio.
+// Lines are handed out in place: the byte following the newline is replaced
+// with a NUL and put back when the next line is requested.
+typedef struct {
+  char *buf;
+  size_t start;
+  size_t len;
+  size_t cap;
+  char saved;
+  int has_saved;
+} linebuf;
+
+#define LB_CHUNK 65536
+
+void lb_restore(linebuf *lb) {
+  if (lb->has_saved) {
+    lb->buf[lb->start] = lb->saved;
+    lb->has_saved = 0;
+  }
+}
+
+// Returns the next complete line including its newline, or NULL when there
+// is none buffered. The line is valid until the next call on lb.
+char *lb_next(linebuf *lb) {
+  lb_restore(lb);
+
+  if (lb->start == lb->len)
+    return NULL;
+  char *line = lb->buf + lb->start;
+  char *nl = memchr(line, '\n', lb->len - lb->start);
+  if (nl == NULL)
+    return NULL;
+
+  // There's always at least one byte of room past len, see lb_fill.
+  lb->start = nl + 1 - lb->buf;
+  lb->saved = lb->buf[lb->start];
+  lb->has_saved = 1;
+  lb->buf[lb->start] = '\0';
+  return line;
+}
+
+// Makes room for n more bytes past len, plus the two spare ones.
+void lb_reserve(linebuf *lb, size_t n) {
+  lb_restore(lb);
+
+  if (lb->start > 0) {
+    memmove(lb->buf, lb->buf + lb->start, lb->len - lb->start);
+    lb->len -= lb->start;
+    lb->start = 0;
+  }
+
+  // Keep two spare bytes for the newline and NUL lb_finish may add.
+  if (lb->cap - lb->len < n + 2) {
+    size_t cap = lb->len + n + 2;
+    char *buf = realloc(lb->buf, cap);
+    if (buf == NULL)
+      unix_error("realloc error");
+    lb->buf = buf;
+    lb->cap = cap;
+  }
+}
+
+// Reads whatever is available from fd. Returns the result of read, 0 on EOF.
+ssize_t lb_fill(linebuf *lb, int fd) {
+  lb_reserve(lb, LB_CHUNK);
+  ssize_t n = read(fd, lb->buf + lb->len, lb->cap - lb->len - 2);
+  if (n > 0)
+    lb->len += n;
+  return n;
+}
+
+// Adds n bytes as if they were read.
+void lb_append(linebuf *lb, char *s, size_t n) {
+  lb_reserve(lb, n);
+  memcpy(lb->buf + lb->len, s, n);
+  lb->len += n;
+}
+
+// Terminates a trailing line which is missing its newline at EOF, so that
+// lb_next returns it.
+void lb_finish(linebuf *lb) {
+  lb_restore(lb);
+  if (lb->len > lb->start)
+    lb->buf[lb->len++] = '\n';
+}
+
+// Maps a whole script of size bytes instead of reading it. The file is
+// mapped privately over a slightly bigger anonymous mapping, so there are
+// always the two spare bytes past the end lb_next and lb_finish write to,
+// even when size is a multiple of the page size. Returns -1 on errors.
+int lb_map(linebuf *lb, int fd, size_t size) {
+  size_t cap = size + 2;
+  char *buf = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    return -1;
+  if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(buf, cap);
+    return -1;
+  }
+  madvise(buf, size, MADV_SEQUENTIAL);
+
+  lb->buf = buf;
+  lb->start = 0;
+  lb->len = size;
+  lb->cap = cap;
+  lb_finish(lb);
+  return 0;
+}
+
+// Shell variables, chained per bucket of var_tab like the PATH lookup cache.
+// entry is name=value in one allocation. The exported ones make up the
+// environment of the commands the shell runs, env_vec, which is only built
+// again after one of them changed, so starting a command costs nothing for
+// its environment. Each exported variable knows its slot in env_vec, which
+// lets var_overlay replace it for VAR=value prefixes of one command without
+// going through the others.
+#define NAME_CHARS                                                             \
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_"
+
+typedef struct var {
+  char *entry;
+  size_t name_len;
+  int exported;
+  // Slot in env_vec, for exported variables while it's up to date.
+  int slot;
+  struct var *next;
+} var;
+
+static var **var_tab = NULL;
+static size_t var_tab_cap = 0;
+static size_t var_tab_len = 0;
+
+static char **env_vec = NULL;
+static size_t env_len = 0;
+static size_t env_cap = 0;
+static int env_stale = 1;
+// env_vec packed as the zygote wants it, see zygote_spawn.
+static char *env_packed = NULL;
+static size_t env_packed_len = 0;
+
+// Length of the variable name s starts with, 0 if it doesn't start with one.
+size_t var_name_len(char *s) {
+  return *s >= '0' && *s <= '9' ? 0 : strspn(s, NAME_CHARS);
+}
+
+// hash_str of the first len chars of s.
+unsigned hash_name(char *s, size_t len) {
+  unsigned h = 2166136261u;
+  for (size_t k = 0; k < len; k++) {
+    h ^= (unsigned char)s[k];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+var *var_find(char *name, size_t len) {
+  if (var_tab_cap == 0)
+    return NULL;
+  for (var *v = var_tab[hash_name(name, len) & (var_tab_cap - 1)]; v;
+       v = v->next)
+    if (v->name_len == len && !memcmp(v->entry, name, len))
+      return v;
+  return NULL;
+}
+
+// Value of the variable name of len chars, NULL if it isn't set. ? is the
+// exit status of the last pipeline.
+char *var_get_n(char *name, size_t len) {
+  if (len == 1 && *name == '?') {
+    static char status[16];
+    snprintf(status, sizeof(status), "%d", last_status);
+    return status;
+  }
+  var *v = var_find(name, len);
+  return v != NULL ? v->entry + v->name_len + 1 : NULL;
+}
+
+char *var_get(char *name) { return var_get_n(name, strlen(name)); }
+
+void var_grow() {
+  size_t cap = var_tab_cap ? var_tab_cap * 2 : 256;
+  var **tab = calloc(cap, sizeof(var *));
+  if (tab == NULL)
+    unix_error("calloc error");
+  for (size_t i = 0; i < var_tab_cap; i++) {
+    for (var *v = var_tab[i], *next; v != NULL; v = next) {
+      next = v->next;
+      size_t b = hash_name(v->entry, v->name_len) & (cap - 1);
+      v->next = tab[b];
+      tab[b] = v;
+    }
+  }
+  free(var_tab);
+  var_tab = tab;
+  var_tab_cap = cap;
+}
+
+// Sets the variable name of len chars to value, and exports it with
+// export. A variable which was exported stays so.
+void var_set(char *name, size_t len, char *value, int export) {
+  var *v = var_find(name, len);
+  if (v == NULL) {
+    if (var_tab_len + 1 > var_tab_cap / 4 * 3)
+      var_grow();
+    if ((v = malloc(sizeof(var))) == NULL)
+      unix_error("malloc error");
+    size_t b = hash_name(name, len) & (var_tab_cap - 1);
+    v->entry = NULL;
+    v->name_len = len;
+    v->exported = 0;
+    v->slot = -1;
+    v->next = var_tab[b];
+    var_tab[b] = v;
+    var_tab_len++;
+  }
+  size_t vlen = strlen(value);
+  char *entry = malloc(len + vlen + 2);
+  if (entry == NULL)
+    unix_error("malloc error");
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, vlen + 1);
+  // env_vec may point to the old entry, it's rebuilt before it's used.
+  free(v->entry);
+  v->entry = entry;
+  v->exported |= export;
+  env_stale |= v->exported;
+}
+
+void var_unset(char *name, size_t len) {
+  if (var_tab_cap == 0)
+    return;
+  for (var **p = &var_tab[hash_name(name, len) & (var_tab_cap - 1)]; *p;
+       p = &(*p)->next) {
+    var *v = *p;
+    if (v->name_len == len && !memcmp(v->entry, name, len)) {
+      *p = v->next;
+      env_stale |= v->exported;
+      free(v->entry);
+      free(v);
+      var_tab_len--;
+      return;
+    }
+  }
+}
+
+// Sets the name=value entries of env, exported with export.
+void var_import(char **env, int export) {
+  for (char **e = env; *e != NULL; e++) {
+    char *eq = strchr(*e, '=');
+    if (eq != NULL && eq > *e)
+      var_set(*e, eq - *e, eq + 1, export);
+  }
+}
+
+// The environment of the exported variables, NULL terminated. It stays
+// valid until one of them changes.
+char **var_environ() {
+  if (!env_stale)
+    return env_vec;
+  env_len = 0;
+  env_packed_len = 0;
+  for (size_t i = 0; i < var_tab_cap; i++) {
+    for (var *v = var_tab[i]; v != NULL; v = v->next) {
+      v->slot = -1;
+      if (!v->exported)
+        continue;
+      if (env_len + 1 >= env_cap) {
+        env_cap = env_cap ? 2 * env_cap : 256;
+        if ((env_vec = realloc(env_vec, env_cap * sizeof(char *))) == NULL)
+          unix_error("realloc error");
+      }
+      v->slot = env_len;
+      env_vec[env_len++] = v->entry;
+      env_packed_len += strlen(v->entry) + 1;
+    }
+  }
+  if (env_vec == NULL && (env_vec = malloc(sizeof(char *))) == NULL)
+    unix_error("malloc error");
+  env_vec[env_len] = NULL;
+
+  free(env_packed);
+  if ((env_packed = malloc(env_packed_len + 1)) == NULL)
+    unix_error("malloc error");
+  char *p = env_packed;
+  for (size_t k = 0; k < env_len; k++)
+    p = stpcpy(p, env_vec[k]) + 1;
+  env_stale = 0;
+  return env_vec;
+}
+
+// The environment with the n name=value entries of assigns on top, in the
+// command arena. Only the pointers of env_vec are copied, a variable which
+// is exported has its slot replaced.
+char **var_overlay(char **assigns, int n) {
+  char **base = var_environ();
+  char **env = arena_alloc(&cmd_arena, (env_len + n + 1) * sizeof(char *));
+  memcpy(env, base, env_len * sizeof(char *));
+  size_t len = env_len;
+  for (int k = 0; k < n; k++) {
+    size_t nlen = strchr(assigns[k], '=') - assigns[k];
+    var *v = var_find(assigns[k], nlen);
+    size_t slot = len;
+    if (v != NULL && v->exported)
+      slot = v->slot;
+    // The same name twice in assigns, the last one wins.
+    for (size_t j = env_len; j < len && slot == len; j++)
+      if (!strncmp(env[j], assigns[k], nlen + 1))
+        slot = j;
+    env[slot] = assigns[k];
+    len += slot == len;
+  }
+  env[len] = NULL;
+  return env;
+}
+
+// Number of the words in argv which are assignments, name=value, before
+// the first one which isn't.
+int count_assigns(char **argv) {
+  int n = 0;
+  while (argv[n] != NULL) {
+    size_t len = var_name_len(argv[n]);
+    if (len == 0 || argv[n][len] != '=')
+      break;
+    n++;
+  }
+  return n;
+}
+
+// Value a variable had before var_push changed it, for var_pop.
+typedef struct {
+  char *name;
+  size_t len;
+  char *value;
+  int exported;
+} var_saved;
+
+// Sets the n name=value entries of assigns and exports them for as long as
+// a builtin runs, what they had before is saved to save.
+void var_push(char **assigns, int n, var_saved *save) {
+  for (int k = 0; k < n; k++) {
+    size_t len = strchr(assigns[k], '=') - assigns[k];
+    var *v = var_find(assigns[k], len);
+    save[k].name = assigns[k];
+    save[k].len = len;
+    save[k].value = NULL;
+    save[k].exported = v != NULL && v->exported;
+    if (v != NULL) {
+      char *value = v->entry + len + 1;
+      save[k].value = arena_alloc(&cmd_arena, strlen(value) + 1);
+      strcpy(save[k].value, value);
+    }
+    var_set(assigns[k], len, assigns[k] + len + 1, 1);
+  }
+}
+
+// Undoes var_push, the same name twice in assigns gets its first value back.
+void var_pop(var_saved *save, int n) {
+  for (int k = n - 1; k >= 0; k--) {
+    var_saved *s = &save[k];
+    if (s->value == NULL) {
+      var_unset(s->name, s->len);
+      continue;
+    }
+    var_set(s->name, s->len, s->value, 0);
+    var *v = var_find(s->name, s->len);
+    env_stale |= v->exported != s->exported;
+    v->exported = s->exported;
+  }
+}
+
+// If s, which is at a $, starts a reference to a variable, $name or
+// ${name}, returns the position past it and sets *name and *len. $? is one
+// as well.
+char *var_ref(char *s, char **name, size_t *len) {
+  int brace = s[1] == '{';
+  char *p = s + 1 + brace;
+  size_t n = *p == '?' ? 1 : var_name_len(p);
+  if (n == 0 || (brace && p[n] != '}'))
+    return NULL;
+  *name = p;
+  *len = n;
+  return p + n + brace;
+}
+
+pid_t Fork() {
+  pid_t pid;
+
+  if ((pid = fork()) < 0)
+    unix_error("Fork error");
+  stats.forks++;
+  return pid;
+}
+
+typedef enum {
+  SPAWN_FORK,
+  SPAWN_POSIX,
+  SPAWN_ZYGOTE,
+} SpawnMode;
+
+// How eval starts external commands. posix_spawn is backed by
+// clone(CLONE_VM|CLONE_VFORK) in glibc, so the cost of starting a child does
+// not grow with the size of the shell's address space the way fork does.
+static SpawnMode spawn_mode = SPAWN_POSIX;
+
+// Signal mask the shell was started with, children are given this one
+// instead of whatever the shell is blocking at the time of spawning.
+static sigset_t child_mask;
+
+char *spawn_mode_str(SpawnMode mode) {
+  switch (mode) {
+  case SPAWN_FORK:
+    return "fork";
+  case SPAWN_POSIX:
+    return "posix";
+  case SPAWN_ZYGOTE:
+    return "zygote";
+  }
+
+  return "";
+}
+
+// CPU placement of jobs. spawn_cmd gives every process it starts the CPUs in
+// spawn_cpus when it's set: the fork and zygote children set their own
+// affinity before the exec, for posix_spawn the shell changes its own for as
+// long as it takes to spawn so the child inherits it.
+//
+// With a place mode, background jobs which weren't given CPUs with pin are
+// spread over the CPUs, or the NUMA nodes, the shell may run on in
+// round-robin order. Memory isn't bound, a job pinned to a node allocates
+// from it as long as its memory is first touched there.
+typedef enum {
+  PLACE_OFF,
+  PLACE_CPU,
+  PLACE_NODE,
+} PlaceMode;
+
+static char *place_names[] = {"off", "cpu", "node", NULL};
+static PlaceMode place_mode = PLACE_OFF;
+static int place_next_cpu = 0;
+static int place_next_node = 0;
+
+static cpu_set_t shell_cpus;
+static cpu_set_t *spawn_cpus = NULL;
+// Environment of the next command spawn_cmd starts when it has VAR=value
+// prefixes, see var_overlay, var_environ() otherwise.
+static char **spawn_env = NULL;
+
+// CPUs of every online NUMA node, limited to shell_cpus, read from sysfs
+// the first time they're needed. Nodes without any of those CPUs are left
+// out.
+static cpu_set_t *node_cpus = NULL;
+static int *node_ids = NULL;
+static int nnodes = -1;
+
+// Parses a list of CPUs like 0-3,8 as found in sysfs, returns -1 if s isn't
+// one.
+int parse_cpulist(char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (1) {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+    if (end == s || lo < 0)
+      return -1;
+    s = end;
+    if (*s == '-') {
+      hi = strtol(s + 1, &end, 10);
+      if (end == s + 1 || hi < lo)
+        return -1;
+      s = end;
+    }
+    if (hi >= CPU_SETSIZE)
+      return -1;
+    for (long c = lo; c <= hi; c++)
+      CPU_SET(c, set);
+    if (*s != ',')
+      break;
+    s++;
+  }
+  return *s == '\0' || *s == '\n' ? 0 : -1;
+}
+
+// Reads a cpulist file of sysfs into set.
+int read_cpulist(char *path, cpu_set_t *set) {
+  char buf[4096];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  return parse_cpulist(buf, set);
+}
+
+void load_nodes() {
+  cpu_set_t online;
+  nnodes = 0;
+  if (read_cpulist("/sys/devices/system/node/online", &online) < 0)
+    return;
+  int cap = CPU_COUNT(&online);
+  if ((node_cpus = malloc(cap * sizeof(cpu_set_t))) == NULL ||
+      (node_ids = malloc(cap * sizeof(int))) == NULL)
+    unix_error("malloc error");
+
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    if (!CPU_ISSET(node, &online))
+      continue;
+    char path[64];
+    cpu_set_t *set = &node_cpus[nnodes];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if (read_cpulist(path, set) < 0)
+      continue;
+    CPU_AND(set, set, &shell_cpus);
+    if (CPU_COUNT(set) > 0)
+      node_ids[nnodes++] = node;
+  }
+}
+
+// Sets set to the CPUs of the given NUMA node, returns -1 if the shell can't
+// run on any.
+int find_node(int node, cpu_set_t *set) {
+  if (nnodes < 0)
+    load_nodes();
+  for (int k = 0; k < nnodes; k++) {
+    if (node_ids[k] == node) {
+      *set = node_cpus[k];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Picks the CPUs of the next background job for the place mode, returns -1
+// if there's nothing to pick from.
+int place_next(cpu_set_t *set) {
+  if (place_mode == PLACE_NODE) {
+    if (nnodes < 0)
+      load_nodes();
+    if (nnodes == 0)
+      return -1;
+    place_next_node %= nnodes;
+    *set = node_cpus[place_next_node++];
+    return 0;
+  }
+
+  for (int k = 0; k < CPU_SETSIZE; k++) {
+    int c = (place_next_cpu + k) % CPU_SETSIZE;
+    if (CPU_ISSET(c, &shell_cpus)) {
+      place_next_cpu = c + 1;
+      CPU_ZERO(set);
+      CPU_SET(c, set);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int redir_flags(RedirType type) {
+  switch (type) {
+  case REDIR_IN:
+    return O_RDONLY;
+  case REDIR_OUT:
+    return O_WRONLY | O_CREAT | O_TRUNC;
+  case REDIR_APPEND:
+    return O_WRONLY | O_CREAT | O_APPEND;
+  case REDIR_DUP:
+  case REDIR_HEREDOC:
+    break;
+  }
+  return 0;
+}
+
+// A descriptor replaced by a redirection in the shell itself, copy is -1 if
+// fd wasn't open. flags are its descriptor flags, dup2 doesn't carry
+// FD_CLOEXEC over when it's put back.
+typedef struct {
+  int fd;
+  int copy;
+  int flags;
+} saved_fd;
+
+// Applies the redirections in r, in order, to the calling process. Unless
+// save is NULL the descriptors they replace are copied there first, *nsave
+// counts them, so restore_redirs can undo them. Prints an error and returns
+// -1 if one of them fails.
+int apply_redirs(redir *r, saved_fd *save, int *nsave) {
+  for (; r != NULL; r = r->next) {
+    if (save != NULL) {
+      save[*nsave].fd = r->fd;
+      save[*nsave].flags = fcntl(r->fd, F_GETFD);
+      save[(*nsave)++].copy = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+    }
+
+    int fd;
+    if (r->type == REDIR_HEREDOC) {
+      if ((fd = r->hfd) != r->fd && dup2(fd, r->fd) < 0) {
+        fprintf(stderr, "%d: %s\n", r->fd, strerror(errno));
+        return -1;
+      }
+    } else if (r->type == REDIR_DUP) {
+      if (!strcmp(r->word, "-")) {
+        close(r->fd);
+        continue;
+      }
+      if ((fd = parse_int(r->word)) < 0) {
+        fprintf(stderr, "%s: ambiguous redirect\n", r->word);
+        return -1;
+      }
+      if (fd != r->fd && dup2(fd, r->fd) < 0) {
+        fprintf(stderr, "%s: %s\n", r->word, strerror(errno));
+        return -1;
+      }
+    } else {
+      if ((fd = open(r->word, redir_flags(r->type) | O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "%s: %s\n", r->word, strerror(errno));
+        return -1;
+      }
+      if (fd != r->fd) {
+        int err = dup2(fd, r->fd);
+        close(fd);
+        if (err < 0) {
+          fprintf(stderr, "%d: %s\n", r->fd, strerror(errno));
+          return -1;
+        }
+      }
+    }
+    // dup2 clears O_CLOEXEC on the copy, which doesn't happen when fd already
+    // is the right descriptor.
+    if (fd == r->fd)
+      fcntl(fd, F_SETFD, 0);
+  }
+  return 0;
+}
+
+// Puts back the descriptors saved by apply_redirs, last one first.
+void restore_redirs(saved_fd *save, int nsave) {
+  while (nsave-- > 0) {
+    if (save[nsave].copy < 0) {
+      close(save[nsave].fd);
+      continue;
+    }
+    dup2(save[nsave].copy, save[nsave].fd);
+    if (save[nsave].flags > 0)
+      fcntl(save[nsave].fd, F_SETFD, save[nsave].flags);
+    close(save[nsave].copy);
+  }
+}
+
+// Adds the redirections in r to the file actions of posix_spawn. Errors are
+// returned like posix_spawn does, an ambiguous redirect is EBADF.
+int add_redirs(posix_spawn_file_actions_t *fa, redir *r) {
+  int err = 0;
+  for (; r != NULL && err == 0; r = r->next) {
+    if (r->type == REDIR_HEREDOC) {
+      err = posix_spawn_file_actions_adddup2(fa, r->hfd, r->fd);
+    } else if (r->type != REDIR_DUP) {
+      err = posix_spawn_file_actions_addopen(fa, r->fd, r->word,
+                                             redir_flags(r->type), 0666);
+    } else if (!strcmp(r->word, "-")) {
+      err = posix_spawn_file_actions_addclose(fa, r->fd);
+    } else {
+      int fd = parse_int(r->word);
+      err = fd < 0 ? EBADF : posix_spawn_file_actions_adddup2(fa, fd, r->fd);
+    }
+  }
+  return err;
+}
+
+int has_heredoc(redir *r) {
+  for (; r != NULL; r = r->next)
+    if (r->type == REDIR_HEREDOC)
+      return 1;
+  return 0;
+}
+
+// Zygote mode. A helper forked early, while the shell is still small,
+// receives spawn requests over a Unix socket and starts the commands, so the
+// cost of starting one doesn't grow with the shell. The helper clones them
+// with CLONE_PARENT, which makes them children of the shell: it reaps them,
+// gets their SIGCHLD and can continue or signal them like any other child.
+//
+// A request is a zreq header, sent together with the working directory of
+// the shell and the pipe ends as SCM_RIGHTS, followed by len bytes: nredir
+// pairs of type and fd, then the NUL terminated path, argv, environment and
+// the words of the redirections. The helper replies with a zreply once the
+// command was exec'd or failed to.
+typedef struct {
+  size_t len;
+  pid_t pgid;
+  // Take the terminal, see spawn_cmd.
+  int fg;
+  int argc;
+  int envc;
+  int nredir;
+  int has_in;
+  int has_out;
+  // CPUs to run on, see spawn_cpus.
+  int has_cpus;
+  cpu_set_t cpus;
+} zreq;
+
+typedef struct {
+  pid_t pid;
+  int err;
+} zreply;
+
+static int zygote_fd = -1;
+
+// Reads or writes exactly n bytes, returns -1 on errors and EOF.
+int read_full(int fd, void *buf, size_t n) {
+  while (n > 0) {
+    ssize_t k = read(fd, buf, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return -1;
+    buf = (char *)buf + k;
+    n -= k;
+  }
+  return 0;
+}
+
+int send_full(int fd, void *buf, size_t n) {
+  while (n > 0) {
+    ssize_t k = send(fd, buf, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k < 0)
+      return -1;
+    buf = (char *)buf + k;
+    n -= k;
+  }
+  return 0;
+}
+
+// Copies the n strings from s on to v, returns the position past them.
+char *unpack_strs(char *s, char **v, int n) {
+  for (int k = 0; k < n; k++) {
+    v[k] = s;
+    s += strlen(s) + 1;
+  }
+  v[n] = NULL;
+  return s;
+}
+
+// Runs one request in the zygote. fds are the descriptors which came with
+// it: the working directory, then stdin and stdout if the header has them.
+void zygote_spawn_one(zreq *req, char *buf, int *fds, zreply *rep) {
+  int *types = (int *)buf;
+  char **argv = malloc((req->argc + 1) * sizeof(char *));
+  char **envp = malloc((req->envc + 1) * sizeof(char *));
+  redir *redirs = malloc(req->nredir * sizeof(redir) + 1);
+  if (argv == NULL || envp == NULL || redirs == NULL)
+    unix_error("malloc error");
+
+  char *path = buf + req->nredir * 2 * sizeof(int);
+  char *s = path + strlen(path) + 1;
+  s = unpack_strs(s, argv, req->argc);
+  s = unpack_strs(s, envp, req->envc);
+  for (int k = 0; k < req->nredir; k++) {
+    redirs[k].type = types[2 * k];
+    redirs[k].fd = types[2 * k + 1];
+    redirs[k].word = s;
+    redirs[k].next = k + 1 < req->nredir ? &redirs[k + 1] : NULL;
+    s += strlen(s) + 1;
+  }
+
+  // The child reports the errno of a failed exec through errp, which is
+  // closed with no data once the exec succeeded.
+  int errp[2];
+  if (pipe2(errp, O_CLOEXEC) < 0) {
+    rep->pid = -1;
+    rep->err = errno;
+  } else if ((rep->pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0,
+                                 0)) == 0) {
+    int in = fds[1], out = fds[1 + req->has_in];
+    if (setpgid(0, req->pgid) < 0 || fchdir(fds[0]) < 0)
+      _exit(127);
+    if (req->fg)
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (req->has_cpus)
+      sched_setaffinity(0, sizeof(cpu_set_t), &req->cpus);
+    if ((req->has_in && dup2(in, STDIN_FILENO) < 0) ||
+        (req->has_out && dup2(out, STDOUT_FILENO) < 0))
+      _exit(127);
+    if (apply_redirs(req->nredir ? redirs : NULL, NULL, NULL) < 0)
+      _exit(1);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    reset_job_signals();
+    sigprocmask(SIG_SETMASK, &child_mask, NULL);
+    execve(path, argv, envp);
+    int err = errno;
+    write(errp[1], &err, sizeof(err));
+    _exit(127);
+  } else {
+    rep->err = rep->pid < 0 ? errno : 0;
+    close(errp[1]);
+    if (rep->pid > 0 && read_full(errp[0], &rep->err, sizeof(rep->err)) == 0)
+      rep->pid = -1;
+    else if (rep->pid > 0)
+      rep->err = 0;
+    close(errp[0]);
+  }
+
+  free(argv);
+  free(envp);
+  free(redirs);
+}
+
+// Main loop of the zygote, exits once the shell closed its end of sock.
+void zygote_main(int sock) {
+  // Kept out of the process group of the shell so Ctrl+C doesn't reach it,
+  // and it has no use for the signal setup of the shell.
+  setpgid(0, 0);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  // Its children take the terminal from the background.
+  signal(SIGTTOU, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  if (sig_fd >= 0)
+    close(sig_fd);
+
+  char *buf = NULL;
+  size_t cap = 0;
+  while (1) {
+    zreq req;
+    int fds[3];
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = ctl,
+                         .msg_controllen = sizeof(ctl)};
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+      _exit(0);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c == NULL || c->cmsg_type != SCM_RIGHTS)
+      _exit(1);
+    int nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+
+    if ((size_t)n < sizeof(req) &&
+        read_full(sock, (char *)&req + n, sizeof(req) - n) < 0)
+      _exit(1);
+    if (req.len + 1 > cap) {
+      cap = req.len + 1;
+      if ((buf = realloc(buf, cap)) == NULL)
+        unix_error("realloc error");
+    }
+    if (read_full(sock, buf, req.len) < 0)
+      _exit(1);
+
+    zreply rep;
+    zygote_spawn_one(&req, buf, fds, &rep);
+    for (int k = 0; k < nfds; k++)
+      close(fds[k]);
+    if (send_full(sock, &rep, sizeof(rep)) < 0)
+      _exit(1);
+  }
+}
+
+void start_zygote() {
+  // Otherwise the zygote would have a copy of whatever is buffered.
+  fflush(stdout);
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    unix_error("socketpair error");
+  if (Fork() == 0) {
+    close(sv[0]);
+    zygote_main(sv[1]);
+  }
+  close(sv[1]);
+  zygote_fd = sv[0];
+}
+
+// Starts a command through the zygote, see spawn_cmd. Returns the pid of the
+// child, -1 with err set if it couldn't be started, or -2 if the zygote is
+// gone.
+pid_t zygote_spawn(char *path, char **argv, pid_t pgid, int in, int out,
+                   redir *redirs, int fg, int *err) {
+  zreq req = {
+      .pgid = pgid, .fg = fg, .has_in = in != -1, .has_out = out != -1};
+  if (spawn_cpus != NULL) {
+    req.has_cpus = 1;
+    req.cpus = *spawn_cpus;
+  }
+  size_t len = strlen(path) + 1;
+  for (; argv[req.argc] != NULL; req.argc++)
+    len += strlen(argv[req.argc]) + 1;
+  // The environment of the shell is packed already, only an overlay has to
+  // be copied string by string.
+  char **envp = spawn_env;
+  if (envp == NULL) {
+    var_environ();
+    req.envc = env_len;
+    len += env_packed_len;
+  }
+  for (; envp != NULL && envp[req.envc] != NULL; req.envc++)
+    len += strlen(envp[req.envc]) + 1;
+  for (redir *r = redirs; r != NULL; r = r->next, req.nredir++)
+    len += 2 * sizeof(int) + strlen(r->word) + 1;
+  req.len = len;
+
+  char *buf = arena_alloc(&cmd_arena, len), *p = buf;
+  int *types = (int *)buf;
+  p += req.nredir * 2 * sizeof(int);
+  for (redir *r = redirs; r != NULL; r = r->next) {
+    *types++ = r->type;
+    *types++ = r->fd;
+  }
+  p = stpcpy(p, path) + 1;
+  for (int k = 0; k < req.argc; k++)
+    p = stpcpy(p, argv[k]) + 1;
+  if (envp == NULL)
+    p = mempcpy(p, env_packed, env_packed_len);
+  for (int k = 0; envp != NULL && k < req.envc; k++)
+    p = stpcpy(p, envp[k]) + 1;
+  for (redir *r = redirs; r != NULL; r = r->next)
+    p = stpcpy(p, r->word) + 1;
+
+  int fds[3], nfds = 0;
+  if ((fds[nfds++] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    *err = errno;
+    return -1;
+  }
+  if (in != -1)
+    fds[nfds++] = in;
+  if (out != -1)
+    fds[nfds++] = out;
+
+  char ctl[CMSG_SPACE(sizeof(fds))];
+  memset(ctl, 0, sizeof(ctl));
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctl,
+                       .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+  zreply rep;
+  ssize_t n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+  close(fds[0]);
+  if (n != sizeof(req) || send_full(zygote_fd, buf, len) < 0 ||
+      read_full(zygote_fd, &rep, sizeof(rep)) < 0) {
+    close(zygote_fd);
+    zygote_fd = -1;
+    return -2;
+  }
+  *err = rep.err;
+  return rep.pid;
+}
+
+// Starts one stage of a job with child_mask as its signal mask in both modes.
+// pgid is the process group to join, 0 to lead a new one. in and out become
+// stdin and stdout of the child unless they are -1, redirs are applied after
+// them. path is NULL for builtins, which always run in a full child. With fg
+// the process group is made the foreground one of the terminal by the child
+// itself, before it can read from it. Returns the pid of the child, or -1 if
+// posix_spawn failed to run the command.
+pid_t spawn_cmd(char *path, char **argv, pid_t pgid, int in, int out,
+                redir *redirs, int fg) {
+  pid_t pid;
+  // Built before the fork, so the next child finds it up to date as well.
+  char **envp = spawn_env ? spawn_env : var_environ();
+
+  if (spawn_mode == SPAWN_FORK || path == NULL) {
+    // Otherwise the child would write out whatever is buffered once more.
+    fflush(stdout);
+
+    /* START - CHILD PROCESS */
+    if ((pid = Fork()) == 0) {
+      // Set process group ID of this job to the pid of its first process.
+      if (setpgid(0, pgid) < 0) {
+        unix_error("setpgid error");
+      }
+      if (fg)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+      if (spawn_cpus != NULL)
+        sched_setaffinity(0, sizeof(cpu_set_t), spawn_cpus);
+      reset_job_signals();
+      if ((in != -1 && dup2(in, STDIN_FILENO) < 0) ||
+          (out != -1 && dup2(out, STDOUT_FILENO) < 0))
+        unix_error("dup2 error");
+      if (apply_redirs(redirs, NULL, NULL) < 0)
+        exit(1);
+
+      if (path == NULL) {
+        enter_subshell();
+        if (spawn_env != NULL)
+          var_import(spawn_env, 1);
+        exit(builtin_command(argv));
+      }
+      if (sigprocmask(SIG_SETMASK, &child_mask, NULL) < 0)
+        unix_error("sigprocmask set mask error");
+      if (execve(path, argv, envp) < 0) {
+        printf("%s: Command not found.\n", argv[0]);
+        exit(0);
+      }
+    }
+    /* END - CHILD PROCESS */
+
+    // Also done by the parent, so the group exists by the time the next stage
+    // joins it. Fails harmlessly if the child got to execve first.
+    setpgid(pid, pgid ? pgid : pid);
+    stats.execs += path != NULL;
+    trace_event(EV_SPAWN, pid, pgid ? pgid : pid, 0);
+    return pid;
+  }
+
+  // The memfds of here-documents are descriptors of the shell, the zygote
+  // has no copy of them to hand to the child.
+  int err;
+  if (spawn_mode == SPAWN_ZYGOTE && !has_heredoc(redirs)) {
+    if ((pid = zygote_spawn(path, argv, pgid, in, out, redirs, fg, &err)) >=
+        0) {
+      trace_event(EV_SPAWN, pid, pgid ? pgid : pid, 0);
+      stats.zygote_spawns++;
+      stats.execs++;
+      return pid;
+    }
+    if (pid == -1) {
+      printf("%s: %s\n", argv[0], strerror(err));
+      stats.exec_failures++;
+      return -1;
+    }
+    printf("spawn: zygote exited, using posix_spawn\n");
+    spawn_mode = SPAWN_POSIX;
+  }
+
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t fa;
+  if ((err = posix_spawnattr_init(&attr)) != 0 ||
+      (err = posix_spawn_file_actions_init(&fa)) != 0) {
+    errno = err;
+    unix_error("posix_spawn init error");
+  }
+  // Process group 0 means the pgid will be the pid of the child, same as
+  // setpgid(0, 0) in the fork path. SIGTTOU and SIGTTIN are put back to the
+  // default when the shell ignores them for job control.
+  sigset_t sigdef;
+  sigemptyset(&sigdef);
+  if (job_control) {
+    sigaddset(&sigdef, SIGTTOU);
+    sigaddset(&sigdef, SIGTTIN);
+  }
+  if ((err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                                 POSIX_SPAWN_SETSIGMASK |
+                                                 POSIX_SPAWN_SETSIGDEF)) != 0 ||
+      (err = posix_spawnattr_setpgroup(&attr, pgid)) != 0 ||
+      (err = posix_spawnattr_setsigmask(&attr, &child_mask)) != 0 ||
+      (err = posix_spawnattr_setsigdefault(&attr, &sigdef)) != 0) {
+    errno = err;
+    unix_error("posix_spawnattr error");
+  }
+  // Done after setpgid and before stdin is replaced, all signals are blocked
+  // in the child until the exec.
+  if (fg && (err = posix_spawn_file_actions_addtcsetpgrp_np(
+                 &fa, STDIN_FILENO)) != 0) {
+    errno = err;
+    unix_error("posix_spawn_file_actions error");
+  }
+  // Pipe ends are opened with O_CLOEXEC, dup2 clears it on the copy so only
+  // stdin and stdout survive the exec.
+  if ((in != -1 &&
+       (err = posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO)) != 0) ||
+      (out != -1 && (err = posix_spawn_file_actions_adddup2(
+                         &fa, out, STDOUT_FILENO)) != 0)) {
+    errno = err;
+    unix_error("posix_spawn_file_actions error");
+  }
+  if ((err = add_redirs(&fa, redirs)) != 0) {
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    printf("%s: %s\n", argv[0], strerror(err));
+    stats.exec_failures++;
+    return -1;
+  }
+
+  if (spawn_cpus != NULL)
+    sched_setaffinity(0, sizeof(cpu_set_t), spawn_cpus);
+  err = posix_spawn(&pid, path, &fa, &attr, argv, envp);
+  if (spawn_cpus != NULL)
+    sched_setaffinity(0, sizeof(cpu_set_t), &shell_cpus);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0) {
+    printf("%s: %s\n", argv[0], strerror(err));
+    stats.exec_failures++;
+    return -1;
+  }
+  trace_event(EV_SPAWN, pid, pgid ? pgid : pid, 0);
+  stats.posix_spawns++;
+  stats.execs++;
+  return pid;
+}
+
+// trace [on|off|dump [file]]
+// Turns job tracing on or off, or writes the recorded events as Chrome
+// trace JSON to file or stdout. Prints whether it's on without arguments.
+int builtin_trace(char **argv) {
+  if (argv[1] == NULL) {
+    printf("%s, %lu events\n", tracing ? "on" : "off",
+           trace_head < TRACE_CAP ? trace_head : TRACE_CAP);
+    return 0;
+  }
+  if (!strcmp(argv[1], "on")) {
+    tracing = 1;
+    return 0;
+  }
+  if (!strcmp(argv[1], "off")) {
+    tracing = 0;
+    return 0;
+  }
+  if (!strcmp(argv[1], "dump")) {
+    if (trace_dump(argv[2]) < 0) {
+      printf("%s: %s\n", argv[2], strerror(errno));
+      return 1;
+    }
+    return 0;
+  }
+  printf("trace: usage: trace [on|off|dump [file]]\n");
+  return 1;
+}
+
+// spawn [fork|posix|zygote]
+// Selects how external commands are started, prints the current mode when
+// called without arguments. The zygote is started the first time it's
+// selected, use -z to have it forked at startup instead.
+int builtin_spawn(char **argv) {
+  if (argv[1] == NULL) {
+    printf("%s\n", spawn_mode_str(spawn_mode));
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "fork")) {
+    spawn_mode = SPAWN_FORK;
+  } else if (!strcmp(argv[1], "posix")) {
+    spawn_mode = SPAWN_POSIX;
+  } else if (!strcmp(argv[1], "zygote")) {
+    if (zygote_fd < 0)
+      start_zygote();
+    spawn_mode = SPAWN_ZYGOTE;
+  } else {
+    printf("spawn: %s: invalid mode, expected fork, posix or zygote\n",
+           argv[1]);
+    return 1;
+  }
+  return 0;
+}
+
+// Capacity requested with F_SETPIPE_SZ for the pipes between stages of a
+// pipeline, 0 leaves the kernel default (64 KiB). Bigger pipes mean fewer
+// context switches between stages that move a lot of data.
+static int pipe_size = 0;
+
+// pipesz [bytes]
+// Sets the capacity for pipes of the following pipelines, 0 goes back to the
+// default. Prints the current value when called without arguments.
+int builtin_pipesz(char **argv) {
+  if (argv[1] == NULL) {
+    printf("%d\n", pipe_size);
+    return 0;
+  }
+
+  int size = parse_int(argv[1]);
+  if (size < 0) {
+    printf("pipesz: %s: invalid size\n", argv[1]);
+    return 1;
+  }
+
+  // Try it on a scratch pipe, so that a size above
+  // /proc/sys/fs/pipe-max-size is reported here instead of on every pipeline.
+  if (size > 0) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+      unix_error("pipe error");
+    int ok = fcntl(fds[1], F_SETPIPE_SZ, size) >= 0;
+    if (!ok)
+      printf("pipesz: %s: %s\n", argv[1], strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    if (!ok)
+      return 1;
+  }
+  pipe_size = size;
+  return 0;
+}
+
+// place [off|cpu|node] shows or sets how background jobs are spread over
+// the CPUs, see place_next.
+int builtin_place(char **argv) {
+  if (argv[1] == NULL) {
+    printf("%s\n", place_names[place_mode]);
+    return 0;
+  }
+
+  for (int k = 0; place_names[k] != NULL; k++) {
+    if (!strcmp(argv[1], place_names[k])) {
+      place_mode = k;
+      return 0;
+    }
+  }
+  printf("place: %s: invalid mode\n", argv[1]);
+  return 1;
+}
+
+// An input line of parallel whose output has to be printed in order.
+typedef struct {
+  // memfd the command writes its output to.
+  int out;
+  int done;
+} pitem;
+
+// Builds the command line for arg from the template in cmd. Every {} in the
+// template is replaced by arg, if there's none arg is appended at the end.
+// Returns a NULL terminated array, its strings are allocated only where a
+// substitution happened.
+char **parallel_argv(char **cmd, char *arg) {
+  int n = 0;
+  int subst = 0;
+  while (cmd[n] != NULL) {
+    if (strstr(cmd[n], "{}"))
+      subst = 1;
+    n++;
+  }
+
+  char **argv = malloc((n + 2) * sizeof(char *));
+  if (argv == NULL)
+    unix_error("malloc error");
+
+  size_t arglen = strlen(arg);
+  for (int k = 0; k < n; k++) {
+    char *p = cmd[k];
+    char *q;
+    if ((q = strstr(p, "{}")) == NULL) {
+      argv[k] = p;
+      continue;
+    }
+
+    // Worst case every two characters of the template are a {}.
+    char *buf = malloc(strlen(p) / 2 * arglen + strlen(p) + 1);
+    if (buf == NULL)
+      unix_error("malloc error");
+    char *w = buf;
+    do {
+      memcpy(w, p, q - p);
+      w += q - p;
+      memcpy(w, arg, arglen);
+      w += arglen;
+      p = q + 2;
+    } while ((q = strstr(p, "{}")) != NULL);
+    strcpy(w, p);
+    argv[k] = buf;
+  }
+
+  if (!subst)
+    argv[n++] = arg;
+  argv[n] = NULL;
+  return argv;
+}
+
+void free_parallel_argv(char **cmd, char **argv) {
+  for (int k = 0; cmd[k] != NULL; k++) {
+    if (argv[k] != cmd[k])
+      free(argv[k]);
+  }
+  free(argv);
+}
+
+// Copies the buffered output of an item to stdout.
+void parallel_flush(pitem *it) {
+  char buf[LB_CHUNK];
+  off_t off = 0;
+  ssize_t n;
+  while ((n = pread(it->out, buf, sizeof(buf), off)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("read error");
+    }
+    for (ssize_t w = 0; w < n;) {
+      ssize_t r = write(STDOUT_FILENO, buf + w, n - w);
+      if (r < 0 && errno != EINTR)
+        unix_error("write error");
+      if (r > 0)
+        w += r;
+    }
+    off += n;
+  }
+  close(it->out);
+  it->out = -1;
+}
+
+// parallel [-j N] [-k] [-a file] command [arg ...]
+// Runs command once for every line of stdin, or of file with -a, with at
+// most N of them running at once, N defaults to the number of online CPUs.
+// Output of the commands is not buffered, with -k it's buffered in memfds
+// and printed in the order of the input lines instead.
+//
+// It always runs as a job of its own in a forked child of the shell, with
+// the commands in its process group. That way fg/bg/jobs, Ctrl+C and Ctrl+Z
+// treat the whole fan-out like any other job, and the next command starts as
+// soon as the reap path marks one as terminated in the job table.
+int builtin_parallel(char **argv) {
+  int max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int keep_order = 0;
+  char *file = NULL;
+  int k = 1;
+
+  for (; argv[k] != NULL && argv[k][0] == '-'; k++) {
+    if (!strcmp(argv[k], "--")) {
+      k++;
+      break;
+    } else if (!strcmp(argv[k], "-k")) {
+      keep_order = 1;
+    } else if (!strcmp(argv[k], "-j") && argv[k + 1] != NULL) {
+      max = parse_int(argv[++k]);
+    } else if (!strncmp(argv[k], "-j", 2)) {
+      max = parse_int(argv[k] + 2);
+    } else if (!strcmp(argv[k], "-a") && argv[k + 1] != NULL) {
+      file = argv[++k];
+    } else {
+      max = -1;
+      break;
+    }
+  }
+  char **cmd = &argv[k];
+  if (max <= 0 || cmd[0] == NULL) {
+    printf("usage: parallel [-j N] [-k] [-a file] command [arg ...]\n");
+    return 1;
+  }
+
+  char *path;
+  if (is_builtin(cmd[0]) != NOT_BUILTIN ||
+      (path = find_command(cmd[0])) == NULL) {
+    printf("%s: Command not found.\n", cmd[0]);
+    return 1;
+  }
+
+  int fd = STDIN_FILENO;
+  if (file != NULL && (fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+    printf("parallel: %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  // Input lines come from stdin unless -a was given, the commands get
+  // /dev/null instead so they can't eat lines meant for later ones.
+  int in = -1;
+  if (fd == STDIN_FILENO &&
+      (in = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+    unix_error("open error");
+
+  linebuf lb = {0};
+  int eof = 0;
+  int failed = 0;
+  int running = 0;
+
+  // With -k items are kept in a ring indexed by their input line, [first, n)
+  // are the ones which are still running or waiting for an earlier one to be
+  // printed. Reading ahead is limited to window lines, so a slow command
+  // holds back at most that many memfds.
+  int window = keep_order ? 4 * max : 0;
+  pitem *items = NULL;
+  long first = 0;
+  long n = 0;
+  if (keep_order && (items = malloc(window * sizeof(pitem))) == NULL)
+    unix_error("malloc error");
+
+  // Line of each job slot started by us, -1 for slots that aren't ours.
+  long *line_of = NULL;
+  int line_of_cap = 0;
+
+  fflush(stdout);
+  while (1) {
+    while (running < max && (!keep_order || n - first < window)) {
+      char *line;
+      while ((line = lb_next(&lb)) == NULL && !eof) {
+        ssize_t r = lb_fill(&lb, fd);
+        if (r < 0 && errno != EINTR)
+          unix_error("read error");
+        if (r == 0) {
+          lb_finish(&lb);
+          eof = 1;
+        }
+      }
+      if (line == NULL)
+        break;
+      line[strlen(line) - 1] = '\0';
+
+      int out = -1;
+      if (keep_order && (out = memfd_create("parallel", MFD_CLOEXEC)) < 0)
+        unix_error("memfd_create error");
+
+      char **args = parallel_argv(cmd, line);
+      pid_t pid = spawn_cmd(path, args, getpgrp(), in, out, NULL, 0);
+      free_parallel_argv(cmd, args);
+      if (pid < 0) {
+        failed++;
+        if (out != -1)
+          close(out);
+        continue;
+      }
+
+      int j = addjob(&pid, 1, RUNNING, NULL);
+      if (j >= line_of_cap) {
+        int cap = jobs_cap;
+        if ((line_of = realloc(line_of, cap * sizeof(long))) == NULL)
+          unix_error("realloc error");
+        for (int i = line_of_cap; i < cap; i++)
+          line_of[i] = -1;
+        line_of_cap = cap;
+      }
+      line_of[j] = n;
+      if (keep_order) {
+        items[n % window].out = out;
+        items[n % window].done = 0;
+      }
+      n++;
+      running++;
+    }
+
+    if (running == 0)
+      break;
+    wait_for_child();
+
+    // Only the jobs which terminated since the last wakeup are visited, they
+    // are all in the done list until cleanup_jobs.
+    for (int j = jobs_done; j != -1; j = jobs[j].next) {
+      if (j >= line_of_cap || line_of[j] == -1)
+        continue;
+
+      int status = job_status(j);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed++;
+      if (keep_order)
+        items[line_of[j] % window].done = 1;
+      line_of[j] = -1;
+      running--;
+    }
+    cleanup_jobs();
+
+    // Print the output of the items which are done and have no earlier
+    // item still running.
+    while (keep_order && first < n && items[first % window].done) {
+      parallel_flush(&items[first % window]);
+      first++;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
+
+// Admission queue of background jobs. Once sched_limit of them are live,
+// further ones are queued with the text of their command line and evaluated
+// again when they are admitted, so lines are only parsed and resolved twice
+// when the limit is reached. Entries are kept in a binary heap ordered by
+// priority and then by the order they were queued in.
+//
+// Jobs are admitted by sched_admit between commands and whenever the shell
+// wakes up for terminated children, never from the SIGCHLD handler itself.
+typedef enum {
+  PRI_NORMAL,
+  PRI_LOW,
+  PRI_IDLE,
+} Priority;
+
+static char *pri_names[] = {"normal", "low", "idle", NULL};
+
+typedef struct {
+  char *text;
+  Priority pri;
+  // Shown by jobs, and given back to server clients once the entry is
+  // admitted.
+  int qid;
+  // Server client which queued the line, or -1.
+  int client;
+} pending;
+
+static pending *sched_q = NULL;
+static int sched_len = 0;
+static int sched_cap = 0;
+static int sched_qid = 0;
+// Set while queued lines are evaluated.
+static int sched_admitting = 0;
+
+int pending_before(pending *a, pending *b) {
+  return a->pri != b->pri ? a->pri < b->pri : a->qid < b->qid;
+}
+
+int compare_pending(const void *a, const void *b) {
+  return pending_before((pending *)a, (pending *)b) ? -1 : 1;
+}
+
+void sched_swap(int a, int b) {
+  pending t = sched_q[a];
+  sched_q[a] = sched_q[b];
+  sched_q[b] = t;
+}
+
+// Queues a copy of text, returns the qid of the entry.
+int sched_push(char *text, Priority pri, int client) {
+  if (sched_len == sched_cap) {
+    int cap = sched_cap ? sched_cap * 2 : 64;
+    pending *q = realloc(sched_q, cap * sizeof(pending));
+    if (q == NULL)
+      unix_error("realloc error");
+    sched_q = q;
+    sched_cap = cap;
+  }
+
+  int k = sched_len++;
+  sched_q[k].qid = ++sched_qid;
+  sched_q[k].pri = pri;
+  sched_q[k].client = client;
+  // Two spare bytes, it's read back through a linebuf.
+  size_t len = strlen(text);
+  if ((sched_q[k].text = malloc(len + 2)) == NULL)
+    unix_error("malloc error");
+  memcpy(sched_q[k].text, text, len + 1);
+  while (k > 0 && pending_before(&sched_q[k], &sched_q[(k - 1) / 2])) {
+    sched_swap(k, (k - 1) / 2);
+    k = (k - 1) / 2;
+  }
+  return sched_q[k].qid;
+}
+
+pending sched_pop() {
+  pending top = sched_q[0];
+  sched_q[0] = sched_q[--sched_len];
+  int k = 0;
+  while (1) {
+    int min = k;
+    for (int c = 2 * k + 1; c <= 2 * k + 2 && c < sched_len; c++)
+      if (pending_before(&sched_q[c], &sched_q[min]))
+        min = c;
+    if (min == k)
+      break;
+    sched_swap(k, min);
+    k = min;
+  }
+  return top;
+}
+
+// Whether a new background job has to wait, entries are admitted in order
+// so there's no overtaking the queue either.
+int sched_full() {
+  return sched_limit > 0 && (sched_running >= sched_limit || sched_len > 0);
+}
+
+int parse_pri(char *name) {
+  for (int k = 0; pri_names[k] != NULL; k++)
+    if (!strcmp(name, pri_names[k]))
+      return k;
+  return -1;
+}
+
+// Lowers the CPU priority of a process of a job started with prio. This
+// happens once it runs, children it forked before are left as they are.
+void sched_renice(pid_t pid, Priority pri) {
+  int err;
+  if (pri == PRI_IDLE) {
+    struct sched_param sp = {0};
+    err = sched_setscheduler(pid, SCHED_IDLE, &sp);
+  } else {
+    err = setpriority(PRIO_PROCESS, pid, 10);
+  }
+  if (err < 0)
+    log_async(LOG_DEBUG, "renice %d: %s", pid, strerror(errno));
+}
+
+// History of the lines typed at the prompt, shared by the interactive shells
+// of a user through $HISTFILE, ~/.ash_history by default. The file is a
+// header followed by a ring of records which is mapped shared: lines are
+// appended at tail and the oldest ones dropped from head once it's full, so
+// the file is never read or rewritten as a whole and opening it costs the
+// same whatever its size. Positions count the bytes ever written to the ring
+// and only grow, the offset of one is modulo the size of the ring. Appends
+// hold an exclusive flock of the file, reads a shared one.
+//
+// A record never wraps around the end of the ring, the room left there is
+// taken by a padding record. Records end with their length so that they can
+// be walked from the newest one back, which is the order they're looked at.
+#define HIST_MAGIC 0x7473696868736161ULL
+#define HIST_HDR 4096
+#define HIST_RING (64 << 20)
+#define HIST_ALIGN 16
+#define HIST_PAD UINT32_MAX
+
+typedef struct {
+  uint64_t magic;
+  // Size of the ring which follows the header.
+  uint64_t ring;
+  uint64_t head;
+  uint64_t tail;
+  // Number of the last line, lines are numbered from 1 in order.
+  uint64_t count;
+} hist_hdr;
+
+typedef struct {
+  // Of the whole record, up to and including the trailing copy of it.
+  uint32_t len;
+  // HIST_PAD for padding.
+  uint32_t text_len;
+  uint64_t num;
+} hist_rec;
+
+static hist_hdr *hist = NULL;
+static char *hist_ring;
+static int hist_fd = -1;
+static int hist_tried = 0;
+
+// Positions of the lines looked at so far, found by walking back from the
+// tail the first time each one is needed. hist_new has the ones numbered
+// above hist_anchor in order, hist_old those from hist_anchor down in
+// reverse. hist_high and hist_low are the positions the walks stopped at.
+typedef struct {
+  uint64_t *pos;
+  size_t len;
+  size_t cap;
+} hist_index;
+
+static hist_index hist_new = {0};
+static hist_index hist_old = {0};
+static uint64_t hist_anchor;
+static uint64_t hist_high;
+static uint64_t hist_low;
+
+// The expansion of the line being read.
+static char *hist_buf = NULL;
+static size_t hist_buf_cap = 0;
+
+void hist_lock(int op) {
+  while (flock(hist_fd, op) < 0)
+    if (errno != EINTR)
+      unix_error("flock error");
+}
+
+// Maps the history file, creating it if needed. Returns -1 if there's no
+// history, it's only tried once.
+int hist_open() {
+  if (hist_tried)
+    return hist != NULL ? 0 : -1;
+  hist_tried = 1;
+
+  char *path = var_get("HISTFILE");
+  char *home = var_get("HOME");
+  char *buf = NULL;
+  if (path == NULL) {
+    if (home == NULL)
+      return -1;
+    size_t n = strlen(home) + sizeof("/.ash_history");
+    if ((buf = malloc(n)) == NULL)
+      unix_error("malloc error");
+    snprintf(buf, n, "%s/.ash_history", home);
+    path = buf;
+  }
+  if (*path == '\0')
+    return -1;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    log_async(LOG_ERROR, "%s: %s", path, strerror(errno));
+    free(buf);
+    return -1;
+  }
+  hist_fd = fd;
+  hist_lock(LOCK_EX);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    unix_error("fstat error");
+  hist_hdr h = {0};
+  if (st.st_size == 0) {
+    h.magic = HIST_MAGIC;
+    h.ring = HIST_RING;
+    if (ftruncate(fd, HIST_HDR + h.ring) < 0 ||
+        pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+      log_async(LOG_ERROR, "%s: %s", path, strerror(errno));
+      goto fail;
+    }
+  } else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+             h.magic != HIST_MAGIC || h.ring % HIST_ALIGN != 0 ||
+             h.ring < HIST_HDR || (uint64_t)st.st_size < HIST_HDR + h.ring) {
+    log_async(LOG_ERROR, "%s: not a history file", path);
+    goto fail;
+  }
+
+  void *map = mmap(NULL, HIST_HDR + h.ring, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    log_async(LOG_ERROR, "%s: %s", path, strerror(errno));
+    goto fail;
+  }
+  hist = map;
+  hist_ring = (char *)map + HIST_HDR;
+  hist_anchor = hist->count;
+  hist_high = hist_low = hist->tail;
+  hist_lock(LOCK_UN);
+  free(buf);
+  return 0;
+
+fail:
+  close(fd);
+  hist_fd = -1;
+  free(buf);
+  return -1;
+}
+
+hist_rec *hist_at(uint64_t pos) {
+  return (hist_rec *)(hist_ring + pos % hist->ring);
+}
+
+// Start of the record which ends at pos, or UINT64_MAX if it was dropped.
+uint64_t hist_prev(uint64_t pos) {
+  uint64_t end = pos % hist->ring;
+  if (end == 0)
+    end = hist->ring;
+  uint32_t len;
+  memcpy(&len, hist_ring + end - sizeof(len), sizeof(len));
+  if (len < sizeof(hist_rec) || len > end || pos - hist->head < len)
+    return UINT64_MAX;
+  return pos - len;
+}
+
+void hist_push(hist_index *x, uint64_t pos) {
+  if (x->len == x->cap) {
+    x->cap = x->cap ? 2 * x->cap : 256;
+    if ((x->pos = realloc(x->pos, x->cap * sizeof(uint64_t))) == NULL)
+      unix_error("realloc error");
+  }
+  x->pos[x->len++] = pos;
+}
+
+// Position of line num, or UINT64_MAX if there's no such line anymore. The
+// file has to be locked.
+uint64_t hist_pos(uint64_t num) {
+  if (num == 0 || num > hist->count)
+    return UINT64_MAX;
+
+  uint64_t pos;
+  if (num > hist_anchor) {
+    // Lines added since the last look are walked back from the tail to where
+    // that look stopped, then put in order.
+    size_t from = hist_new.len;
+    for (pos = hist->tail; pos > hist_high;) {
+      if ((pos = hist_prev(pos)) == UINT64_MAX)
+        break;
+      if (hist_at(pos)->text_len != HIST_PAD)
+        hist_push(&hist_new, pos);
+    }
+    hist_high = hist->tail;
+    for (size_t a = from, b = hist_new.len; a + 1 < b; a++, b--) {
+      uint64_t t = hist_new.pos[a];
+      hist_new.pos[a] = hist_new.pos[b - 1];
+      hist_new.pos[b - 1] = t;
+    }
+    // Those which were dropped before they could be walked leave a gap at
+    // the start, then the numbers don't match the slots anymore.
+    if (hist_new.len > 0) {
+      uint64_t first = hist_at(hist_new.pos[0])->num;
+      if (hist_new.pos[0] < hist->head || first != hist_anchor + 1) {
+        hist_new.len = 0;
+        hist_old.len = 0;
+        hist_anchor = hist->count;
+        hist_high = hist_low = hist->tail;
+        return hist_pos(num);
+      }
+    }
+    if (num - hist_anchor > hist_new.len)
+      return UINT64_MAX;
+    pos = hist_new.pos[num - hist_anchor - 1];
+  } else {
+    while (hist_anchor - num >= hist_old.len) {
+      if (hist_low <= hist->head || (pos = hist_prev(hist_low)) == UINT64_MAX)
+        return UINT64_MAX;
+      hist_low = pos;
+      if (hist_at(pos)->text_len != HIST_PAD)
+        hist_push(&hist_old, pos);
+    }
+    pos = hist_old.pos[hist_anchor - num];
+  }
+  return pos < hist->head ? UINT64_MAX : pos;
+}
+
+// Text of line num and its length, NULL if there's no such line. It's in the
+// ring, only valid while the file is locked.
+char *hist_get(uint64_t num, size_t *len) {
+  uint64_t pos = hist_pos(num);
+  if (pos == UINT64_MAX)
+    return NULL;
+  hist_rec *r = hist_at(pos);
+  *len = r->text_len;
+  return (char *)(r + 1);
+}
+
+// Number of the newest line below num which starts with s, or contains it
+// unless prefix, 0 if there's none. The file has to be locked.
+uint64_t hist_find(char *s, size_t n, int prefix, uint64_t below) {
+  if (below > hist->count + 1)
+    below = hist->count + 1;
+  for (uint64_t num = below - 1; num > 0; num--) {
+    size_t len;
+    char *text = hist_get(num, &len);
+    if (text == NULL)
+      break;
+    if (prefix ? len >= n && !memcmp(text, s, n)
+               : memmem(text, len, s, n) != NULL)
+      return num;
+  }
+  return 0;
+}
+
+// Appends a line, dropping the oldest ones to make room.
+void hist_add(char *text, size_t len) {
+  uint64_t rlen = sizeof(hist_rec) + len + sizeof(uint32_t);
+  rlen = (rlen + HIST_ALIGN - 1) / HIST_ALIGN * HIST_ALIGN;
+  hist_lock(LOCK_EX);
+  if (rlen > hist->ring / 2) {
+    hist_lock(LOCK_UN);
+    return;
+  }
+
+  uint64_t off = hist->tail % hist->ring;
+  uint64_t pad = off + rlen > hist->ring ? hist->ring - off : 0;
+  while (hist->tail + pad + rlen - hist->head > hist->ring)
+    hist->head += hist_at(hist->head)->len;
+
+  hist_rec r;
+  uint32_t trailer;
+  if (pad > 0) {
+    r.len = trailer = pad;
+    r.text_len = HIST_PAD;
+    r.num = 0;
+    memcpy(hist_ring + off, &r, sizeof(r));
+    memcpy(hist_ring + hist->ring - sizeof(trailer), &trailer,
+           sizeof(trailer));
+    hist->tail += pad;
+    off = 0;
+  }
+  r.len = trailer = rlen;
+  r.text_len = len;
+  r.num = hist->count + 1;
+  memcpy(hist_ring + off, &r, sizeof(r));
+  memcpy(hist_ring + off + sizeof(r), text, len);
+  memcpy(hist_ring + off + rlen - sizeof(trailer), &trailer, sizeof(trailer));
+  hist->tail += rlen;
+  hist->count++;
+  hist_lock(LOCK_UN);
+}
+
+void hist_append(size_t *n, char *s, size_t len) {
+  if (*n + len >= hist_buf_cap) {
+    while (*n + len >= hist_buf_cap)
+      hist_buf_cap = hist_buf_cap ? 2 * hist_buf_cap : MAXLINE;
+    if ((hist_buf = realloc(hist_buf, hist_buf_cap)) == NULL)
+      unix_error("realloc error");
+  }
+  memcpy(hist_buf + *n, s, len);
+  *n += len;
+}
+
+// Expands the events of line into hist_buf as bash does: !! is the previous
+// line, !n line n, !-n the nth line back, !str the last one starting with
+// str and !?str? the last one containing it. Single quotes and a backslash
+// keep a ! as it is. Returns line if it has none, NULL if one can't be
+// found. The file has to be locked.
+char *hist_expand(char *line) {
+  if (strchr(line, '!') == NULL)
+    return line;
+
+  // line up to copied is in hist_buf already.
+  char *copied = line;
+  size_t n = 0;
+  int quoted = 0;
+  char *s = line;
+  while (*s != '\0') {
+    if (*s == '\'' && !quoted) {
+      char *end = strchr(s + 1, '\'');
+      s = end != NULL ? end + 1 : s + strlen(s);
+      continue;
+    }
+    if (*s == '"')
+      quoted = !quoted;
+    if (*s == '\\' && s[1] != '\0')
+      s++;
+    if (*s != '!' || s[1] == '\0' || strchr(" \t\n=(", s[1])) {
+      s++;
+      continue;
+    }
+
+    char *ev = s++;
+    uint64_t num = 0;
+    if (*s == '!') {
+      num = hist->count;
+      s++;
+    } else if (*s == '-' || (*s >= '0' && *s <= '9')) {
+      char *end;
+      long long k = strtoll(s, &end, 10);
+      if (end > s + (*s == '-')) {
+        if (k >= 0)
+          num = k;
+        else if ((uint64_t)-k <= hist->count)
+          num = hist->count + 1 + k;
+        s = end;
+      }
+    } else if (*s == '?') {
+      char *str = ++s;
+      s += strcspn(s, "?\n");
+      num = hist_find(str, s - str, 0, UINT64_MAX);
+      if (*s == '?')
+        s++;
+    } else {
+      char *str = s;
+      s += strcspn(s, " \t\n;&|<>()\"'");
+      num = hist_find(str, s - str, 1, UINT64_MAX);
+    }
+
+    size_t len;
+    char *text = hist_get(num, &len);
+    if (text == NULL) {
+      printf("%.*s: event not found\n", (int)(s - ev), ev);
+      return NULL;
+    }
+    hist_append(&n, copied, ev - copied);
+    hist_append(&n, text, len);
+    copied = s;
+  }
+  if (copied == line)
+    return line;
+  hist_append(&n, copied, s - copied + 1);
+  return hist_buf;
+}
+
+// Expands the events of a line typed at the prompt and adds it to the
+// history. Returns the line to run, or NULL if it can't be expanded. Lines
+// of scripts and -c commands are left alone.
+char *hist_input(char *cmdline) {
+  if (!interactive || hist_open() < 0)
+    return cmdline;
+
+  hist_lock(LOCK_SH);
+  char *line = hist_expand(cmdline);
+  size_t len = 0, last_len = 0;
+  char *last = NULL;
+  if (line != NULL) {
+    len = strlen(line);
+    while (len > 0 && strchr(" \t\n", line[len - 1]))
+      len--;
+    last = hist_get(hist->count, &last_len);
+  }
+  // Blank lines, lines starting with a space and repeats of the last one
+  // aren't kept, like with HISTCONTROL=ignoreboth.
+  int keep = len > 0 && !strchr(" \t", line[0]) &&
+             (last == NULL || last_len != len || memcmp(last, line, len));
+  hist_lock(LOCK_UN);
+
+  if (line == NULL)
+    return NULL;
+  // bash shows the line it runs too.
+  if (line != cmdline)
+    printf("%s", line);
+  if (keep)
+    hist_add(line, len);
+  return line;
+}
+
+// history [n] lists the last n lines, all of them by default, history -g
+// text [n] the last n containing text.
+int builtin_history(char **argv) {
+  char **args = argv + 1;
+  char *pat = NULL;
+  if (args[0] != NULL && !strcmp(args[0], "-g")) {
+    if ((pat = args[1]) == NULL)
+      goto usage;
+    args += 2;
+  }
+  long max = -1;
+  if (args[0] != NULL) {
+    if (args[1] != NULL || (max = parse_int(args[0])) < 0)
+      goto usage;
+  }
+  if (hist_open() < 0) {
+    printf("history: no history file\n");
+    return 1;
+  }
+
+  hist_lock(LOCK_SH);
+  uint64_t *nums = NULL;
+  size_t n = 0, cap = 0;
+  size_t plen = pat != NULL ? strlen(pat) : 0;
+  uint64_t num = hist->count + 1;
+  while (max < 0 || n < (size_t)max) {
+    if (pat != NULL)
+      num = hist_find(pat, plen, 0, num);
+    else
+      num = hist_pos(num - 1) != UINT64_MAX ? num - 1 : 0;
+    if (num == 0)
+      break;
+    if (n == cap) {
+      cap = cap ? 2 * cap : 256;
+      if ((nums = realloc(nums, cap * sizeof(uint64_t))) == NULL)
+        unix_error("realloc error");
+    }
+    nums[n++] = num;
+  }
+  while (n > 0) {
+    size_t len = 0;
+    char *text = hist_get(nums[--n], &len);
+    printf("%5llu  %.*s\n", (unsigned long long)nums[n], (int)len, text);
+  }
+  hist_lock(LOCK_UN);
+  free(nums);
+  return 0;
+
+usage:
+  printf("usage: history [-g text] [n]\n");
+  return 1;
+}
+
+// Commands are read from input_fd into input. It is -1 once EOF was reached,
+// or from the start when the whole input is already in the buffer.
+static linebuf input = {0};
+static int input_fd = STDIN_FILENO;
+
+// Line editor of an interactive shell on a terminal other than TERM=dumb.
+// The terminal is raw only while a line is edited: prompt starts one and
+// the key which ends it puts the modes back before the line is run. Keys
+// are handled as input_more reads them, so waiting for children and the
+// signalfd in between works as it does with cooked input, and a finished
+// line is handed over through input like one read in cooked mode. A line
+// wider than the terminal scrolls sideways.
+//
+//   ^A ^E ^B ^F Home End Left Right  move
+//   ^H Backspace ^D Delete           delete, ^D on an empty line is EOF
+//   ^K ^U ^W                         delete to the end, the start, a word
+//   Up Down ^P ^N                    previous and next line of the history
+//   ^R                               search the history backwards
+//   ^C                               drop the line
+//   ^L                               clear the screen
+//   Tab                              complete, twice lists the candidates
+static int ed_on = 0;
+static int ed_active = 0;
+static struct termios ed_cooked;
+static char *ed_prompt = "";
+static char *ed_buf = NULL;
+static size_t ed_len = 0;
+static size_t ed_cap = 0;
+static size_t ed_pos = 0;
+// History line shown with Up and Down, 0 for the one being typed, which is
+// kept in ed_saved meanwhile. The reverse search keeps it there too.
+static uint64_t ed_hnum = 0;
+static char *ed_saved = NULL;
+static size_t ed_saved_len = 0;
+static int ed_searching = 0;
+static char ed_spat[128];
+static size_t ed_spat_len = 0;
+static uint64_t ed_snum = 0;
+// Bytes of an escape sequence read so far.
+static char ed_esc[8];
+static int ed_esc_len = 0;
+static int ed_last_tab = 0;
+// Bytes read past the end of the last line, they're handled once the next
+// one starts.
+#define ED_READ 256
+static char ed_pend[ED_READ];
+static int ed_pend_len = 0;
+// What a key redraws, written at once.
+static char *ed_out = NULL;
+static size_t ed_out_len = 0;
+static size_t ed_out_cap = 0;
+
+void ed_init() {
+  char *term = var_get("TERM");
+  if (term == NULL || !strcmp(term, "dumb") ||
+      tcgetattr(STDIN_FILENO, &ed_cooked) < 0)
+    return;
+  ed_on = 1;
+}
+
+void ed_puts(char *s, size_t n) {
+  if (n == 0)
+    return;
+  if (ed_out_len + n >= ed_out_cap) {
+    while (ed_out_len + n >= ed_out_cap)
+      ed_out_cap = ed_out_cap ? 2 * ed_out_cap : 1024;
+    if ((ed_out = realloc(ed_out, ed_out_cap)) == NULL)
+      unix_error("realloc error");
+  }
+  memcpy(ed_out + ed_out_len, s, n);
+  ed_out_len += n;
+}
+
+void ed_flush() {
+  write_full(STDOUT_FILENO, ed_out, ed_out_len);
+  ed_out_len = 0;
+}
+
+void ed_reserve(size_t n) {
+  if (ed_len + n + 1 > ed_cap) {
+    while (ed_len + n + 1 > ed_cap)
+      ed_cap = ed_cap ? 2 * ed_cap : 256;
+    if ((ed_buf = realloc(ed_buf, ed_cap)) == NULL)
+      unix_error("realloc error");
+  }
+}
+
+void ed_insert(char *s, size_t n) {
+  ed_reserve(n);
+  memmove(ed_buf + ed_pos + n, ed_buf + ed_pos, ed_len - ed_pos);
+  memcpy(ed_buf + ed_pos, s, n);
+  ed_len += n;
+  ed_pos += n;
+}
+
+void ed_delete(size_t from, size_t to) {
+  memmove(ed_buf + from, ed_buf + to, ed_len - to);
+  ed_len -= to - from;
+  ed_pos = from;
+}
+
+void ed_set(char *s, size_t n) {
+  ed_len = ed_pos = 0;
+  ed_insert(s, n);
+}
+
+// Columns taken by s, UTF-8 characters are counted as one.
+size_t ed_width(char *s, size_t n) {
+  size_t w = 0;
+  for (size_t k = 0; k < n; k++)
+    w += ((unsigned char)s[k] & 0xc0) != 0x80;
+  return w;
+}
+
+size_t ed_left(size_t pos) {
+  while (pos > 0 && ((unsigned char)ed_buf[--pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+size_t ed_right(size_t pos) {
+  while (pos < ed_len && ((unsigned char)ed_buf[++pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+int ed_cols() {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0)
+    return 80;
+  return ws.ws_col;
+}
+
+// Redraws the line, shifted so the cursor fits on the screen.
+void ed_refresh() {
+  char *prompt = ed_prompt;
+  char sprompt[sizeof(ed_spat) + 32];
+  if (ed_searching) {
+    snprintf(sprompt, sizeof(sprompt), "(reverse-i-search)`%.*s': ",
+             (int)ed_spat_len, ed_spat);
+    prompt = sprompt;
+  }
+  size_t plen = strlen(prompt);
+  size_t pw = ed_width(prompt, plen);
+  size_t cols = ed_cols();
+  size_t room = cols > pw + 1 ? cols - pw - 1 : 1;
+
+  size_t start = 0;
+  while (ed_width(ed_buf + start, ed_pos - start) > room)
+    start++;
+  while (start < ed_pos && ((unsigned char)ed_buf[start] & 0xc0) == 0x80)
+    start++;
+  size_t end = start;
+  for (size_t w = 0; end < ed_len; end++) {
+    if (((unsigned char)ed_buf[end] & 0xc0) != 0x80 && w++ == room)
+      break;
+  }
+
+  ed_puts("\r", 1);
+  ed_puts(prompt, plen);
+  ed_puts(ed_buf + start, end - start);
+  ed_puts("\x1b[K\r", 4);
+  char mv[32];
+  size_t col = pw + ed_width(ed_buf + start, ed_pos - start);
+  if (col > 0)
+    ed_puts(mv, snprintf(mv, sizeof(mv), "\x1b[%zuC", col));
+}
+
+void ed_begin(char *prompt) {
+  struct termios raw;
+  if (tcgetattr(STDIN_FILENO, &ed_cooked) < 0) {
+    ed_on = 0;
+    printf("%s", prompt);
+    fflush(stdout);
+    return;
+  }
+  raw = ed_cooked;
+  raw.c_iflag &= ~(ICRNL | INLCR | IXON);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+  ed_active = 1;
+  ed_prompt = prompt;
+  ed_len = ed_pos = 0;
+  ed_hnum = 0;
+  ed_searching = 0;
+  ed_esc_len = 0;
+  ed_last_tab = 0;
+  ed_refresh();
+  ed_flush();
+}
+
+void ed_end() {
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &ed_cooked);
+  ed_active = 0;
+}
+
+void ed_save() {
+  if ((ed_saved = realloc(ed_saved, ed_len + 1)) == NULL)
+    unix_error("realloc error");
+  memcpy(ed_saved, ed_buf, ed_len);
+  ed_saved_len = ed_len;
+}
+
+// Shows the line of the history before or after the one shown, past the
+// newest one the line being typed.
+void ed_history(int back) {
+  if (hist_open() < 0)
+    return;
+  hist_lock(LOCK_SH);
+  uint64_t num = ed_hnum > 0 ? ed_hnum : hist->count + 1;
+  num += back ? -1 : 1;
+  size_t len;
+  char *text = hist_get(num, &len);
+  if (text != NULL) {
+    if (ed_hnum == 0)
+      ed_save();
+    ed_hnum = num;
+    ed_set(text, len);
+  } else if (!back && ed_hnum > 0) {
+    ed_hnum = 0;
+    ed_set(ed_saved, ed_saved_len);
+  } else {
+    ed_puts("\a", 1);
+  }
+  hist_lock(LOCK_UN);
+}
+
+// Looks for the search text from line below down and shows the match.
+void ed_search(uint64_t below) {
+  if (hist_open() < 0)
+    return;
+  hist_lock(LOCK_SH);
+  uint64_t num = hist_find(ed_spat, ed_spat_len, 0, below);
+  size_t len;
+  char *text = hist_get(num, &len);
+  if (text != NULL) {
+    ed_snum = num;
+    ed_set(text, len);
+  } else {
+    ed_puts("\a", 1);
+  }
+  hist_lock(LOCK_UN);
+}
+
+// A candidate of a completion, pathdir is the PATH directory of a command
+// found there, -1 for the rest.
+typedef struct {
+  char *name;
+  int isdir;
+  int pathdir;
+} ed_cand;
+
+static ed_cand *ed_cands = NULL;
+static size_t ed_ncands = 0;
+static size_t ed_cands_cap = 0;
+
+void ed_add_cand(char *name, int isdir, int pathdir) {
+  if (ed_ncands == ed_cands_cap) {
+    ed_cands_cap = ed_cands_cap ? 2 * ed_cands_cap : 64;
+    if ((ed_cands = realloc(ed_cands, ed_cands_cap * sizeof(ed_cand))) ==
+        NULL)
+      unix_error("realloc error");
+  }
+  ed_cands[ed_ncands++] = (ed_cand){name, isdir, pathdir};
+}
+
+int compare_cand(const void *a, const void *b) {
+  return strcmp(((const ed_cand *)a)->name, ((const ed_cand *)b)->name);
+}
+
+// Listing of a directory read with getdents64, the names sorted. Each is
+// stored in pool after its d_type. It's kept with the mtime of the
+// directory, which tells when it has to be read again.
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  char *pool;
+  size_t pool_len;
+  size_t pool_cap;
+  size_t *ents;
+  size_t n;
+  size_t cap;
+} dirlist;
+
+struct dirent64_raw {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#define DENTS_BUF (64 << 10)
+
+char *dir_name(dirlist *d, size_t k) { return d->pool + d->ents[k] + 1; }
+
+int dir_type(dirlist *d, size_t k) { return d->pool[d->ents[k]]; }
+
+int compare_dirent(const void *a, const void *b, void *pool) {
+  return strcmp((char *)pool + *(const size_t *)a + 1,
+                (char *)pool + *(const size_t *)b + 1);
+}
+
+// Makes d a listing of path, reading the directory only if it's not the one
+// listed or it was modified since. Returns 1 when it was read, 0 when d was
+// up to date already. A directory which can't be read lists nothing.
+int dir_fresh(dirlist *d, char *path) {
+  struct stat sb;
+  int ok = stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+  if (d->path != NULL && !strcmp(d->path, path)) {
+    if (!ok && d->n == 0)
+      return 0;
+    if (ok && d->mtime.tv_sec == sb.st_mtim.tv_sec &&
+        d->mtime.tv_nsec == sb.st_mtim.tv_nsec)
+      return 0;
+  } else {
+    free(d->path);
+    if ((d->path = strdup(path)) == NULL)
+      unix_error("strdup error");
+  }
+  d->n = d->pool_len = 0;
+  d->mtime = ok ? sb.st_mtim : (struct timespec){0};
+
+  int fd;
+  if (!ok || (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return 1;
+  static char *dents = NULL;
+  if (dents == NULL && (dents = malloc(DENTS_BUF)) == NULL)
+    unix_error("malloc error");
+  long got;
+  while ((got = syscall(SYS_getdents64, fd, dents, DENTS_BUF)) > 0) {
+    for (long off = 0; off < got;) {
+      struct dirent64_raw *e = (struct dirent64_raw *)(dents + off);
+      off += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == '\0' || !strcmp(e->d_name, "..")))
+        continue;
+      size_t len = strlen(e->d_name);
+      if (d->pool_len + len + 2 > d->pool_cap) {
+        while (d->pool_len + len + 2 > d->pool_cap)
+          d->pool_cap = d->pool_cap ? 2 * d->pool_cap : 4096;
+        if ((d->pool = realloc(d->pool, d->pool_cap)) == NULL)
+          unix_error("realloc error");
+      }
+      if (d->n == d->cap) {
+        d->cap = d->cap ? 2 * d->cap : 256;
+        if ((d->ents = realloc(d->ents, d->cap * sizeof(size_t))) == NULL)
+          unix_error("realloc error");
+      }
+      d->ents[d->n++] = d->pool_len;
+      d->pool[d->pool_len] = e->d_type;
+      memcpy(d->pool + d->pool_len + 1, e->d_name, len + 1);
+      d->pool_len += len + 2;
+    }
+  }
+  close(fd);
+  if (d->n > 1)
+    qsort_r(d->ents, d->n, sizeof(size_t), compare_dirent, d->pool);
+  return 1;
+}
+
+// First entry of d which isn't before prefix.
+size_t dir_lower(dirlist *d, char *prefix) {
+  size_t lo = 0, hi = d->n;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (strcmp(dir_name(d, mid), prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Commands of the PATH directories, merged from their listings into one
+// sorted array where a name is only listed for the first directory which
+// has it, as path_search finds it. The listings are checked against the
+// mtime of their directory on each completion, only those which changed are
+// read again. It follows the PATH of the PATH lookup cache.
+typedef struct {
+  char *name;
+  int dir;
+} pathcmd;
+
+static dirlist *cmd_dirs = NULL;
+static int cmd_ndirs = 0;
+static char *cmd_env = NULL;
+static pathcmd *cmd_ents = NULL;
+static size_t cmd_len = 0;
+static size_t cmd_cap = 0;
+
+int compare_pathcmd(const void *a, const void *b) {
+  const pathcmd *x = a, *y = b;
+  int c = strcmp(x->name, y->name);
+  return c != 0 ? c : x->dir - y->dir;
+}
+
+void cmd_refresh() {
+  path_check_env();
+  int changed = 0;
+  if (cmd_env == NULL || strcmp(cmd_env, path_tab_env)) {
+    for (int k = 0; k < cmd_ndirs; k++) {
+      free(cmd_dirs[k].path);
+      free(cmd_dirs[k].pool);
+      free(cmd_dirs[k].ents);
+    }
+    free(cmd_env);
+    if ((cmd_env = strdup(path_tab_env)) == NULL)
+      unix_error("strdup error");
+    cmd_ndirs = 1;
+    for (char *s = cmd_env; *s; s++)
+      cmd_ndirs += *s == ':';
+    if ((cmd_dirs = realloc(cmd_dirs, cmd_ndirs * sizeof(dirlist))) == NULL)
+      unix_error("realloc error");
+    memset(cmd_dirs, 0, cmd_ndirs * sizeof(dirlist));
+    changed = 1;
+  }
+
+  char *dirs = cmd_env;
+  for (int k = 0; k < cmd_ndirs; k++) {
+    char *end = strchr(dirs, ':');
+    size_t len = end ? (size_t)(end - dirs) : strlen(dirs);
+    char path[MAXLINE];
+    // An empty PATH entry means the current directory.
+    snprintf(path, sizeof(path), "%.*s", (int)len, len > 0 ? dirs : ".");
+    changed |= dir_fresh(&cmd_dirs[k], path);
+    dirs += len + (end != NULL);
+  }
+  if (!changed)
+    return;
+
+  cmd_len = 0;
+  for (int k = 0; k < cmd_ndirs; k++) {
+    dirlist *d = &cmd_dirs[k];
+    for (size_t i = 0; i < d->n; i++) {
+      int type = dir_type(d, i);
+      if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+        continue;
+      if (cmd_len == cmd_cap) {
+        cmd_cap = cmd_cap ? 2 * cmd_cap : 1024;
+        if ((cmd_ents = realloc(cmd_ents, cmd_cap * sizeof(pathcmd))) == NULL)
+          unix_error("realloc error");
+      }
+      cmd_ents[cmd_len++] = (pathcmd){dir_name(d, i), k};
+    }
+  }
+  if (cmd_len > 1)
+    qsort(cmd_ents, cmd_len, sizeof(pathcmd), compare_pathcmd);
+  size_t n = 0;
+  for (size_t i = 0; i < cmd_len; i++)
+    if (n == 0 || strcmp(cmd_ents[n - 1].name, cmd_ents[i].name))
+      cmd_ents[n++] = cmd_ents[i];
+  cmd_len = n;
+}
+
+// Adds the builtins and the executable commands of PATH starting with
+// prefix.
+void complete_command(char *prefix) {
+  size_t n = strlen(prefix);
+  char *name;
+  for (size_t k = 0; (name = builtin_name(k)) != NULL; k++)
+    if (!strncmp(name, prefix, n))
+      ed_add_cand(name, 0, -1);
+
+  cmd_refresh();
+  size_t lo = 0, hi = cmd_len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (strcmp(cmd_ents[mid].name, prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; i < cmd_len && !strncmp(cmd_ents[i].name, prefix, n);
+       i++) {
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%s/%s", cmd_dirs[cmd_ents[i].dir].path,
+             cmd_ents[i].name);
+    if (access(path, X_OK) == 0)
+      ed_add_cand(cmd_ents[i].name, 0, cmd_ents[i].dir);
+  }
+}
+
+// Adds the files starting with the part of word past its last slash, in the
+// directory before it. Dot files only match a prefix starting with a dot.
+void complete_file(char *word) {
+  static dirlist files = {0};
+  char *slash = strrchr(word, '/');
+  char *base = slash != NULL ? slash + 1 : word;
+  char dir[MAXLINE];
+  char *home = var_get("HOME");
+  if (slash == NULL)
+    snprintf(dir, sizeof(dir), ".");
+  else if (word[0] == '~' && word[1] == '/' && home != NULL)
+    snprintf(dir, sizeof(dir), "%s%.*s", home, (int)(slash - word - 1),
+             word + 1);
+  else
+    snprintf(dir, sizeof(dir), "%.*s", slash > word ? (int)(slash - word) : 1,
+             word);
+
+  dir_fresh(&files, dir);
+  size_t n = strlen(base);
+  for (size_t i = dir_lower(&files, base);
+       i < files.n && !strncmp(dir_name(&files, i), base, n); i++) {
+    char *name = dir_name(&files, i);
+    if (name[0] == '.' && base[0] != '.')
+      continue;
+    int type = dir_type(&files, i);
+    int isdir = type == DT_DIR;
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+      char path[2 * MAXLINE];
+      struct stat sb;
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+      isdir = stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+    }
+    ed_add_cand(name, isdir, -1);
+  }
+}
+
+// Inserts s, with a backslash before the characters the parser would take
+// for something else.
+void ed_insert_quoted(char *s, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    if (strchr(" \t\\'\"|&;<>()$`*?[]!", s[k]))
+      ed_insert("\\", 1);
+    ed_insert(s + k, 1);
+  }
+}
+
+void ed_list_cands() {
+  size_t w = 0;
+  for (size_t k = 0; k < ed_ncands; k++) {
+    size_t cw = ed_width(ed_cands[k].name, strlen(ed_cands[k].name)) +
+                ed_cands[k].isdir + 2;
+    if (cw > w)
+      w = cw;
+  }
+  size_t per_row = ed_cols() / w;
+  if (per_row == 0)
+    per_row = 1;
+  ed_puts("\r\n", 2);
+  for (size_t k = 0; k < ed_ncands; k++) {
+    char *name = ed_cands[k].name;
+    size_t len = strlen(name);
+    ed_puts(name, len);
+    if (ed_cands[k].isdir)
+      ed_puts("/", 1);
+    if ((k + 1) % per_row == 0 || k + 1 == ed_ncands) {
+      ed_puts("\r\n", 2);
+    } else {
+      for (size_t cw = ed_width(name, len) + ed_cands[k].isdir; cw < w; cw++)
+        ed_puts(" ", 1);
+    }
+  }
+}
+
+// Completes the word before the cursor: as a command at the start of a
+// command unless it has a slash, as a file name elsewhere. A single
+// candidate is inserted whole, several as far as they agree. If that adds
+// nothing a second Tab lists them.
+void ed_complete() {
+  size_t ws = ed_pos;
+  while (ws > 0 && !strchr(" \t|;&<>()", ed_buf[ws - 1]))
+    ws--;
+  size_t b = ws;
+  while (b > 0 && strchr(" \t", ed_buf[b - 1]))
+    b--;
+  int cmd = b == 0 || strchr("|;&(", ed_buf[b - 1]);
+
+  char word[MAXLINE];
+  snprintf(word, sizeof(word), "%.*s", (int)(ed_pos - ws), ed_buf + ws);
+  int tab_again = ed_last_tab;
+  ed_ncands = 0;
+  if (cmd && strchr(word, '/') == NULL)
+    complete_command(word);
+  else
+    complete_file(word);
+
+  if (ed_ncands == 0) {
+    ed_puts("\a", 1);
+    return;
+  }
+  // A builtin can be a command of PATH too.
+  qsort(ed_cands, ed_ncands, sizeof(ed_cand), compare_cand);
+  size_t n = 0;
+  for (size_t k = 0; k < ed_ncands; k++)
+    if (n == 0 || strcmp(ed_cands[n - 1].name, ed_cands[k].name))
+      ed_cands[n++] = ed_cands[k];
+  ed_ncands = n;
+
+  char *slash = strrchr(word, '/');
+  size_t typed = strlen(slash != NULL ? slash + 1 : word);
+  if (ed_ncands == 1) {
+    ed_cand *c = &ed_cands[0];
+    ed_insert_quoted(c->name + typed, strlen(c->name) - typed);
+    ed_insert(c->isdir ? "/" : " ", 1);
+    // The PATH lookup the command will need is done already.
+    if (c->pathdir >= 0 && path_lookup(c->name) == NULL) {
+      char path[MAXLINE];
+      struct stat sb;
+      snprintf(path, sizeof(path), "%s/%s", cmd_dirs[c->pathdir].path,
+               c->name);
+      if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+        path_insert(c->name, path);
+    }
+    return;
+  }
+
+  size_t common = strlen(ed_cands[0].name);
+  for (size_t k = 1; k < ed_ncands; k++) {
+    size_t i = 0;
+    while (i < common && ed_cands[k].name[i] == ed_cands[0].name[i])
+      i++;
+    common = i;
+  }
+  if (common > typed) {
+    ed_insert_quoted(ed_cands[0].name + typed, common - typed);
+  } else if (tab_again) {
+    ed_list_cands();
+  } else {
+    ed_puts("\a", 1);
+  }
+  ed_last_tab = 1;
+}
+
+// Hands the line over to input, 1 to tell ed_feed it's done.
+int ed_submit() {
+  ed_searching = 0;
+  ed_pos = ed_len;
+  ed_refresh();
+  ed_puts("\r\n", 2);
+  ed_flush();
+  ed_end();
+  ed_reserve(1);
+  ed_buf[ed_len] = '\n';
+  lb_append(&input, ed_buf, ed_len + 1);
+  return 1;
+}
+
+// Handles an escape sequence, the arrows and Home, End and Delete keys.
+void ed_escape(char *seq, int n) {
+  char key = seq[n - 1];
+  if (n == 4 && seq[3] == '~')
+    key = seq[2];
+  switch (key) {
+  case 'A':
+    ed_history(1);
+    break;
+  case 'B':
+    ed_history(0);
+    break;
+  case 'C':
+    ed_pos = ed_right(ed_pos);
+    break;
+  case 'D':
+    ed_pos = ed_left(ed_pos);
+    break;
+  case 'H':
+  case '1':
+  case '7':
+    ed_pos = 0;
+    break;
+  case 'F':
+  case '4':
+  case '8':
+    ed_pos = ed_len;
+    break;
+  case '3':
+    if (ed_pos < ed_len)
+      ed_delete(ed_pos, ed_right(ed_pos));
+    break;
+  }
+}
+
+// Handles a key of the reverse search. Returns 0 when it ended the search
+// without using the key, which is then handled as an editing key.
+int ed_search_key(unsigned char c) {
+  uint64_t top = UINT64_MAX;
+  switch (c) {
+  case 0x12: // ^R
+    ed_search(ed_snum);
+    return 1;
+  case 0x07: // ^G
+  case 0x03: // ^C
+    ed_searching = 0;
+    ed_set(ed_saved, ed_saved_len);
+    return 1;
+  case 0x7f:
+  case 0x08:
+    while (ed_spat_len > 0 &&
+           ((unsigned char)ed_spat[--ed_spat_len] & 0xc0) == 0x80)
+      ;
+    ed_search(top);
+    return 1;
+  }
+  if (c < 0x20) {
+    ed_searching = 0;
+    return 0;
+  }
+  if (ed_spat_len < sizeof(ed_spat)) {
+    ed_spat[ed_spat_len++] = c;
+    // The line found so far is a candidate for the longer text too.
+    ed_search(ed_snum < top ? ed_snum + 1 : top);
+  }
+  return 1;
+}
+
+// Handles a key, returns 1 once the line is done.
+int ed_key(unsigned char c) {
+  if (ed_esc_len > 0) {
+    ed_esc[ed_esc_len++] = c;
+    if (ed_esc[1] != '[' && ed_esc[1] != 'O') {
+      ed_esc_len = 0;
+    } else if (ed_esc_len > 2 && c >= 0x40 && c <= 0x7e) {
+      ed_escape(ed_esc, ed_esc_len);
+      ed_esc_len = 0;
+    } else if (ed_esc_len == (int)sizeof(ed_esc)) {
+      ed_esc_len = 0;
+    }
+    return 0;
+  }
+  if (ed_searching && ed_search_key(c))
+    return 0;
+  if (c != '\t')
+    ed_last_tab = 0;
+
+  switch (c) {
+  case '\r':
+  case '\n':
+    return ed_submit();
+  case 0x1b:
+    ed_esc[ed_esc_len++] = c;
+    break;
+  case '\t':
+    ed_complete();
+    break;
+  case 0x01: // ^A
+    ed_pos = 0;
+    break;
+  case 0x05: // ^E
+    ed_pos = ed_len;
+    break;
+  case 0x02: // ^B
+    ed_pos = ed_left(ed_pos);
+    break;
+  case 0x06: // ^F
+    ed_pos = ed_right(ed_pos);
+    break;
+  case 0x7f:
+  case 0x08: // ^H
+    if (ed_pos > 0)
+      ed_delete(ed_left(ed_pos), ed_pos);
+    break;
+  case 0x04: // ^D
+    if (ed_len == 0) {
+      ed_puts("\r\n", 2);
+      ed_flush();
+      ed_end();
+      lb_finish(&input);
+      input_fd = -1;
+      return 1;
+    }
+    if (ed_pos < ed_len)
+      ed_delete(ed_pos, ed_right(ed_pos));
+    break;
+  case 0x0b: // ^K
+    ed_len = ed_pos;
+    break;
+  case 0x15: // ^U
+    ed_delete(0, ed_pos);
+    break;
+  case 0x17: { // ^W
+    size_t p = ed_pos;
+    while (p > 0 && strchr(" \t", ed_buf[p - 1]))
+      p--;
+    while (p > 0 && !strchr(" \t", ed_buf[p - 1]))
+      p--;
+    ed_delete(p, ed_pos);
+    break;
+  }
+  case 0x10: // ^P
+    ed_history(1);
+    break;
+  case 0x0e: // ^N
+    ed_history(0);
+    break;
+  case 0x12: // ^R
+    ed_save();
+    ed_searching = 1;
+    ed_spat_len = 0;
+    ed_snum = UINT64_MAX;
+    break;
+  case 0x03: // ^C
+    ed_pos = ed_len;
+    ed_refresh();
+    ed_puts("^C\r\n", 4);
+    ed_len = ed_pos = 0;
+    ed_hnum = 0;
+    break;
+  case 0x0c: // ^L
+    ed_puts("\x1b[H\x1b[2J", 7);
+    break;
+  default:
+    if (c >= 0x20) {
+      char ch = c;
+      ed_insert(&ch, 1);
+    }
+  }
+  return 0;
+}
+
+// Reads and handles what was typed, or what was left over from the last
+// line. Starts a line without a prompt if none was started, for the lines
+// of a here-document.
+void ed_feed() {
+  if (!ed_active)
+    ed_begin("");
+  if (!ed_active) // Not a terminal anymore.
+    return;
+
+  char buf[ED_READ];
+  ssize_t n = ed_pend_len;
+  if (n > 0) {
+    memcpy(buf, ed_pend, n);
+    ed_pend_len = 0;
+  } else if ((n = read(STDIN_FILENO, buf, sizeof(buf))) < 0) {
+    if (errno == EINTR)
+      return;
+    unix_error("read error");
+  } else if (n == 0) {
+    ed_end();
+    lb_finish(&input);
+    input_fd = -1;
+    return;
+  }
+
+  for (ssize_t k = 0; k < n; k++) {
+    if (ed_key(buf[k])) {
+      ed_pend_len = n - k - 1;
+      memcpy(ed_pend, buf + k + 1, ed_pend_len);
+      return;
+    }
+  }
+  ed_refresh();
+  ed_flush();
+}
+
+// While jobs are queued, waits for input with SIGCHLD let through and admits
+// them as the running ones terminate. Returns 1 once there's input to read.
+int wait_input() {
+  sigset_t mask, prev;
+  if (sigemptyset(&mask) < 0 || sigaddset(&mask, SIGCHLD) < 0 ||
+      sigaddset(&mask, SIGALRM) < 0 ||
+      sigprocmask(SIG_BLOCK, &mask, &prev) < 0)
+    unix_error("sigprocmask block error");
+  blocked_begin();
+
+  sched_admit();
+  int ready = 1;
+  if (sched_len > 0) {
+    struct pollfd pfd = {.fd = input_fd, .events = POLLIN};
+    sigset_t wait_mask = prev;
+    if (sigdelset(&wait_mask, SIGCHLD) < 0 ||
+        sigdelset(&wait_mask, SIGALRM) < 0)
+      unix_error("sigdelset error");
+    blocked_end();
+    int n = ppoll(&pfd, 1, NULL, &wait_mask);
+    if (n < 0 && errno != EINTR)
+      unix_error("ppoll error");
+    blocked_begin();
+    ready = n > 0;
+  }
+
+  if (sigprocmask(SIG_SETMASK, &prev, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+  blocked_end();
+  return ready;
+}
+
+// Reads more of the input, blocking until some is there.
+void input_more() {
+  if (ed_on) {
+    ed_feed();
+    return;
+  }
+  ssize_t n = lb_fill(&input, input_fd);
+  if (n < 0) {
+    if (errno == EINTR)
+      return;
+    unix_error("read error");
+  }
+  // Ctrl+D sends EOF signal.
+  if (n == 0) {
+    lb_finish(&input);
+    input_fd = -1;
+  }
+}
+
+// Returns the next command line, blocking until there is one. Returns NULL
+// at the end of the input.
+char *read_command() {
+  char *cmdline;
+  while ((cmdline = lb_next(&input)) == NULL) {
+    if (input_fd < 0)
+      return NULL;
+    if (sched_len > 0 && ed_pend_len == 0 && !wait_input())
+      continue;
+    input_more();
+  }
+  return cmdline;
+}
+
+// Like read_command for the lines of a here-document, which are read in the
+// middle of a command so nothing is admitted while waiting for them.
+char *input_line() {
+  char *line;
+  while ((line = lb_next(&input)) == NULL) {
+    if (input_fd < 0)
+      return NULL;
+    input_more();
+  }
+  return line;
+}
+
+// Where the bodies of here-documents are read from, the input of the line
+// being evaluated. NULL in a command substitution, which has no input of its
+// own.
+static char *(*here_next)() = input_line;
+
+// memfds of here-documents of the lines being evaluated, closed by eval.
+static int *here_fds = NULL;
+static int here_len = 0;
+static int here_cap = 0;
+
+int compare_jid(const void *a, const void *b) {
+  return jobs[*(const int *)a].jid - jobs[*(const int *)b].jid;
+}
+
+// Reports the background jobs which terminated or stopped since the last
+// prompt, ordered by jid, as bash does before its prompt. They're formatted
+// into one buffer and written at once, so a storm of jobs finishing together
+// is one message which doesn't interleave with anything.
+void notify_jobs() {
+  sigset_t mask, prev;
+  if (sigemptyset(&mask) < 0 || sigaddset(&mask, SIGCHLD) < 0 ||
+      sigprocmask(SIG_BLOCK, &mask, &prev) < 0)
+    unix_error("sigprocmask block error");
+
+  int n = 0;
+  for (int i = jobs_done; i != -1; i = jobs[i].next)
+    n += jobs[i].bg;
+  int *v = NULL;
+  if (n + stop_notices > 0 &&
+      (v = malloc((n + stop_notices) * sizeof(int))) == NULL)
+    unix_error("malloc error");
+  n = 0;
+  for (int i = jobs_done; i != -1; i = jobs[i].next)
+    if (jobs[i].bg)
+      v[n++] = i;
+  for (int i = 0; stop_notices > 0 && i < jobs_used; i++) {
+    if (jobs[i].stop_notice) {
+      jobs[i].stop_notice = 0;
+      stop_notices--;
+      if (jobs[i].st == STOPPED)
+        v[n++] = i;
+    }
+  }
+
+  if (n > 0) {
+    qsort(v, n, sizeof(int), compare_jid);
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+    if (f == NULL)
+      unix_error("open_memstream error");
+    for (int k = 0; k < n; k++) {
+      job *j = &jobs[v[k]];
+      fprintf(f, "[%d] %d ", j->jid, j->pgid);
+      int status = job_status(v[k]);
+      if (j->st == STOPPED)
+        fprintf(f, "Stopped");
+      else if (j->expired)
+        fprintf(f, "Timed out");
+      else if (WIFSIGNALED(status))
+        fprintf(f, "%s", strsignal(WTERMSIG(status)));
+      else if (WEXITSTATUS(status) != 0)
+        fprintf(f, "Exit %d", WEXITSTATUS(status));
+      else
+        fprintf(f, "Done");
+      fprintf(f, " %s\n", cmd_str(j->cmd));
+      // Terminated ones are reported once, stopped ones once per stop.
+      j->bg = j->st != TERMINATED;
+    }
+    fclose(f);
+    fflush(stdout);
+    write_full(STDOUT_FILENO, buf, len);
+    free(buf);
+  }
+  free(v);
+
+  if (sigprocmask(SIG_SETMASK, &prev, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+}
+
+void prompt() {
+  log_flush();
+  if (!interactive)
+    return;
+  notify_jobs();
+  if (ed_on) {
+    fflush(stdout);
+    ed_begin("> ");
+    return;
+  }
+  printf("> ");
+  fflush(stdout);
+}
+
+// Blocks SIGCHLD, SIGALRM, SIGINT and SIGTSTP on top of the signals already
+// in mask for the lifetime of the shell and opens sig_fd to read all of them.
+void open_signalfd(sigset_t *mask) {
+  if (sigaddset(mask, SIGCHLD) < 0 || sigaddset(mask, SIGALRM) < 0 ||
+      sigaddset(mask, SIGINT) < 0 || sigaddset(mask, SIGTSTP) < 0)
+    unix_error("sigset error");
+  if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+    unix_error("sigprocmask block error");
+  if ((sig_fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    unix_error("signalfd error");
+}
+
+// Main loop of event mode. Signals are read from a signalfd polled together
+// with stdin, so job status changes are handled synchronously between
+// commands and there's nothing to block around eval.
+void event_loop() {
+  sigset_t mask;
+  if (sigemptyset(&mask) < 0)
+    unix_error("sigset error");
+  open_signalfd(&mask);
+
+  struct pollfd fds[2] = {
+      {.fd = sig_fd, .events = POLLIN},
+      {.fd = input_fd, .events = POLLIN},
+  };
+  char *cmdline;
+
+  prompt();
+  blocked_begin();
+  while (1) {
+    while ((cmdline = lb_next(&input)) != NULL) {
+      if ((cmdline = hist_input(cmdline)) != NULL)
+        eval(cmdline);
+      prompt();
+    }
+    if (input_fd < 0) {
+      sched_drain();
+      exit(0);
+    }
+    // Keys typed past the last line are there to be handled already.
+    if (ed_pend_len > 0) {
+      input_more();
+      continue;
+    }
+
+    blocked_end();
+    int n = poll(fds, 2, -1);
+    blocked_begin();
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("poll error");
+    }
+
+    // Handle signals first so that reaps which happened before a command was
+    // typed are visible to it.
+    if (fds[0].revents & POLLIN) {
+      handle_signals();
+      sched_admit();
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+      input_more();
+  }
+}
+
+// Server mode, ash -s path. Clients connect to a Unix domain socket and send
+// command lines, each of which is run as a background job once it's
+// complete. Every line is answered with one of
+//
+//   job <jid> <pgid>
+//   status <n>
+//
+// the latter for lines which didn't start a job, with last_status. Lines
+// over the limit of the admission queue are answered with
+//
+//   queued <qid>
+//
+// instead, and once they're admitted with the same replies as above followed
+// by the qid. Once a job terminates, the client which submitted it gets
+//
+//   done <jid> <exit status> <real> <user> <sys> <maxrss>
+//
+// with the times in seconds and maxrss in kilobytes, as reported by wait4.
+// Jobs write to the stdout of the server unless they are redirected.
+//
+// All clients are served from one poll loop together with the signalfd. A
+// client which shuts down its side of the socket stays connected until all
+// of its jobs were reported.
+typedef struct {
+  // -1 for an unused slot.
+  int fd;
+  linebuf in;
+  // Replies which couldn't be sent yet.
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  // Jobs and queued lines of the client which weren't reported yet.
+  int njobs;
+  // Slot of the job started by the line being evaluated, or -1.
+  int started;
+  // qid of the line being evaluated when it was queued, or 0.
+  int queued;
+  int eof;
+} client;
+
+static char *server_path = NULL;
+static client *clients = NULL;
+static int clients_cap = 0;
+// Set when accept ran out of descriptors, the socket isn't polled until a
+// client goes away.
+static int accept_paused = 0;
+// Client whose line is being evaluated, -1 when there's none.
+static int server_client = -1;
+
+void client_printf(int c, const char *fmt, ...) {
+  client *cl = &clients[c];
+  va_list ap;
+  while (1) {
+    size_t room = cl->out_cap - cl->out_len;
+    va_start(ap, fmt);
+    int n = vsnprintf(cl->out + cl->out_len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      unix_error("vsnprintf error");
+    if ((size_t)n < room) {
+      cl->out_len += n;
+      return;
+    }
+
+    size_t cap = cl->out_cap * 2 + n;
+    char *out = realloc(cl->out, cap);
+    if (out == NULL)
+      unix_error("realloc error");
+    cl->out = out;
+    cl->out_cap = cap;
+  }
+}
+
+// Sends as much of the pending replies as the socket takes. Returns -1 once
+// the client is gone.
+int client_flush(int c) {
+  client *cl = &clients[c];
+  size_t sent = 0;
+  while (sent < cl->out_len) {
+    ssize_t n = send(cl->fd, cl->out + sent, cl->out_len - sent,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return -1;
+    }
+    sent += n;
+  }
+  memmove(cl->out, cl->out + sent, cl->out_len - sent);
+  cl->out_len -= sent;
+  return 0;
+}
+
+// Jobs of a client which hung up keep running, they just aren't reported.
+void client_close(int c) {
+  client *cl = &clients[c];
+  close(cl->fd);
+  free(cl->in.buf);
+  free(cl->out);
+  memset(cl, 0, sizeof(*cl));
+  cl->fd = -1;
+  accept_paused = 0;
+  for (int i = 0; i < jobs_used; i++)
+    if (jobs[i].client == c)
+      jobs[i].client = -1;
+  for (int k = 0; k < sched_len; k++)
+    if (sched_q[k].client == c)
+      sched_q[k].client = -1;
+}
+
+// Makes the job in slot i one of the client whose line is being evaluated.
+void client_own(int i) {
+  jobs[i].client = server_client;
+  clients[server_client].njobs++;
+  clients[server_client].started = i;
+}
+
+// Reports the job in slot i, which terminated, to its client.
+void client_done(int i) {
+  job *j = &jobs[i];
+  int c = j->client;
+  client_printf(c, "done %d %d %.6f %.6f %.6f %ld\n", j->jid, job_exit(i),
+                elapsed(&j->start, &j->end),
+                tv_secs(&j->utime), tv_secs(&j->stime), j->maxrss);
+  clients[c].njobs--;
+  j->client = -1;
+}
+
+void server_accept() {
+  int fd;
+  while ((fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+         0) {
+    int c = 0;
+    while (c < clients_cap && clients[c].fd >= 0)
+      c++;
+    if (c == clients_cap) {
+      int cap = clients_cap ? clients_cap * 2 : 16;
+      client *cls = realloc(clients, cap * sizeof(client));
+      if (cls == NULL)
+        unix_error("realloc error");
+      memset(cls + clients_cap, 0, (cap - clients_cap) * sizeof(client));
+      for (int k = clients_cap; k < cap; k++)
+        cls[k].fd = -1;
+      clients = cls;
+      clients_cap = cap;
+    }
+
+    client *cl = &clients[c];
+    cl->fd = fd;
+    cl->out_cap = 256;
+    if ((cl->out = malloc(cl->out_cap)) == NULL)
+      unix_error("malloc error");
+  }
+  if (errno == EMFILE || errno == ENFILE)
+    accept_paused = 1;
+  else if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+    log_async(LOG_ERROR, "accept error: %s", strerror(errno));
+}
+
+// Runs a line of client c and answers it, qid is the one the line got when it
+// was queued if it's admitted now.
+void server_eval(int c, char *cmdline, int qid) {
+  client *cl = &clients[c];
+  if (qid > 0)
+    cl->njobs--;
+  server_client = c;
+  cl->started = -1;
+  cl->queued = 0;
+  eval(cmdline);
+  server_client = -1;
+
+  char tail[16] = "";
+  if (qid > 0)
+    snprintf(tail, sizeof(tail), " %d", qid);
+  if (cl->started >= 0)
+    client_printf(c, "job %d %d%s\n", jobs[cl->started].jid,
+                  jobs[cl->started].pgid, tail);
+  else if (cl->queued > 0)
+    client_printf(c, "queued %d\n", cl->queued);
+  else
+    client_printf(c, "status %d%s\n", last_status, tail);
+}
+
+// Milliseconds client_line waits for more of a here-document body.
+#define HERE_TIMEOUT 5000
+
+// Returns the next line from the client whose line is being evaluated, for
+// its here-documents, NULL once the client shut down its side. The server
+// waits for the client to send the whole body and serves no other client
+// meanwhile, so a client which is silent for HERE_TIMEOUT is taken as shut
+// down.
+char *client_line() {
+  client *cl = &clients[server_client];
+  char *line;
+  while ((line = lb_next(&cl->in)) == NULL && !cl->eof) {
+    struct pollfd pfd = {.fd = cl->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, HERE_TIMEOUT);
+    if (ready < 0 && errno != EINTR)
+      unix_error("poll error");
+    ssize_t n = ready == 0 ? 0 : lb_fill(&cl->in, cl->fd);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      lb_finish(&cl->in);
+      cl->eof = 1;
+    }
+  }
+  return line;
+}
+
+// Reads from the client and runs every complete line it sent so far.
+void server_read(int c) {
+  client *cl = &clients[c];
+  ssize_t n = lb_fill(&cl->in, cl->fd);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      client_close(c);
+    return;
+  }
+  if (n == 0) {
+    lb_finish(&cl->in);
+    cl->eof = 1;
+  }
+
+  char *cmdline;
+  here_next = client_line;
+  while ((cmdline = lb_next(&cl->in)) != NULL)
+    server_eval(c, cmdline, 0);
+  here_next = input_line;
+}
+
+// Binds the socket at server_path. A socket left behind by a server which is
+// gone is replaced, one which still accepts connections is not.
+void server_listen() {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(server_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: %s\n", server_path, strerror(ENAMETOOLONG));
+    exit(1);
+  }
+  strcpy(addr.sun_path, server_path);
+
+  if ((server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0)) < 0)
+    unix_error("socket error");
+  if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int stale = 0;
+    if (errno == EADDRINUSE) {
+      int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      stale = probe >= 0 &&
+              connect(probe, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+              errno == ECONNREFUSED;
+      if (probe >= 0)
+        close(probe);
+      errno = EADDRINUSE;
+    }
+    if (!stale || unlink(server_path) < 0 ||
+        bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "%s: %s\n", server_path, strerror(errno));
+      exit(1);
+    }
+  }
+  if (listen(server_fd, SOMAXCONN) < 0)
+    unix_error("listen error");
+}
+
+// Main loop of server mode, it runs until SIGINT or SIGTERM.
+void server_loop() {
+  sigset_t mask;
+  if (sigemptyset(&mask) < 0 || sigaddset(&mask, SIGTERM) < 0)
+    unix_error("sigset error");
+  open_signalfd(&mask);
+  server_listen();
+
+  struct pollfd *fds = NULL;
+  int *slots = NULL;
+  int fds_cap = 0;
+  while (!server_stop) {
+    if (fds_cap < clients_cap + 2) {
+      fds_cap = clients_cap + 2;
+      if ((fds = realloc(fds, fds_cap * sizeof(*fds))) == NULL ||
+          (slots = realloc(slots, fds_cap * sizeof(*slots))) == NULL)
+        unix_error("realloc error");
+    }
+
+    int n = 0;
+    fds[n++] = (struct pollfd){.fd = sig_fd, .events = POLLIN};
+    fds[n++] = (struct pollfd){.fd = accept_paused ? -1 : server_fd,
+                               .events = POLLIN};
+    for (int c = 0; c < clients_cap; c++) {
+      client *cl = &clients[c];
+      if (cl->fd < 0)
+        continue;
+      if (cl->eof && cl->njobs == 0 && cl->out_len == 0) {
+        client_close(c);
+        continue;
+      }
+      slots[n] = c;
+      fds[n++] = (struct pollfd){
+          .fd = cl->fd,
+          .events = (cl->eof ? 0 : POLLIN) | (cl->out_len ? POLLOUT : 0)};
+    }
+
+    fflush(stdout);
+    log_flush();
+    blocked_end();
+    int ready = poll(fds, n, -1);
+    blocked_begin();
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("poll error");
+    }
+
+    // Reports terminated jobs before any new line is run, like the prompt
+    // of the other modes.
+    if (fds[0].revents & POLLIN) {
+      handle_signals();
+      cleanup_jobs();
+      sched_admit();
+    }
+    if (fds[1].revents & POLLIN)
+      server_accept();
+
+    for (int k = 2; k < n; k++) {
+      client *cl = &clients[slots[k]];
+      if (cl->fd < 0)
+        continue;
+      if (!cl->eof && (fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+        server_read(slots[k]);
+      else if (fds[k].revents & (POLLHUP | POLLERR))
+        client_close(slots[k]);
+    }
+
+    for (int c = 0; c < clients_cap; c++)
+      if (clients[c].fd >= 0 && clients[c].out_len > 0 && client_flush(c) < 0)
+        client_close(c);
+  }
+
+  unlink(server_path);
+  exit(0);
+}
+
+// The queued line being evaluated, its here-documents are read from it.
+static linebuf *queued_lb = NULL;
+
+char *queued_line() { return lb_next(queued_lb); }
+
+// Evaluates queued lines for as long as there's room for their jobs. It can
+// run while a command is being evaluated, e.g. from the wait builtin, where
+// eval_line then leaves the done list alone.
+void sched_admit() {
+  if (sched_admitting)
+    return;
+  sched_admitting = 1;
+  int status = last_status;
+  int pgid = fg_pid;
+  int client = server_client;
+
+  char *(*next)() = here_next;
+  linebuf *lb = queued_lb;
+
+  while (sched_len > 0 && (sched_limit == 0 || sched_running < sched_limit)) {
+    // The text is the line followed by the bodies of its here-documents.
+    pending p = sched_pop();
+    linebuf in = {.buf = p.text, .len = strlen(p.text)};
+    in.cap = in.len + 2;
+    lb_finish(&in);
+    queued_lb = &in;
+    here_next = queued_line;
+    char *cmdline = lb_next(&in);
+    if (p.client >= 0)
+      server_eval(p.client, cmdline, p.qid);
+    else
+      eval(cmdline);
+    free(p.text);
+  }
+
+  last_status = status;
+  fg_pid = pgid;
+  server_client = client;
+  here_next = next;
+  queued_lb = lb;
+  sched_admitting = 0;
+}
+
+// Admits every queued job before the shell exits at the end of its input,
+// they would be lost otherwise.
+void sched_drain() {
+  sched_admit();
+  while (sched_len > 0 && have_running_jobs())
+    wait_for_child();
+}
+
+// Turns a forked child into a shell of its own, for builtins in pipelines
+// and command substitutions. It keeps the signal setup of the shell so it can
+// wait for children of its own, but Ctrl+C/Ctrl+Z act on it like on any
+// other process. Jobs, clients and queued lines of the shell are left to the
+// shell.
+void enter_subshell() {
+  sigset_t mask;
+  if (sigemptyset(&mask) < 0 || sigaddset(&mask, SIGINT) < 0 ||
+      sigaddset(&mask, SIGTSTP) < 0 ||
+      sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0)
+    unix_error("sigprocmask unblock error");
+  if (signal(SIGINT, SIG_DFL) == SIG_ERR || signal(SIGTSTP, SIG_DFL) == SIG_ERR)
+    unix_error("signal error");
+  job_control = 0;
+  fg_pid = 0;
+  interactive = 0;
+  // Messages queued by the shell are its own to write out.
+  log_level = LOG_ERROR;
+  log_tail = log_head;
+
+  for (int i = 0; i < jobs_used; i++)
+    jobs[i].client = -1;
+  server_client = -1;
+  sched_len = 0;
+  // Timers aren't inherited.
+  tmo_len = 0;
+  tmo_timer_ok = 0;
+  stats_timer_ok = 0;
+  stats_fd = -1;
+  here_next = NULL;
+  ed_on = 0;
+  // Children of the zygote are children of the shell, the subshell couldn't
+  // wait for them.
+  if (spawn_mode == SPAWN_ZYGOTE)
+    spawn_mode = SPAWN_POSIX;
+}
+
+// Sets up input for ash -c command, ash script or reading stdin.
+void open_input(char *command, char *script) {
+  if (command != NULL) {
+    size_t len = strlen(command);
+    if ((input.buf = malloc(len + 2)) == NULL)
+      unix_error("malloc error");
+    memcpy(input.buf, command, len);
+    input.len = len;
+    input.cap = len + 2;
+    lb_finish(&input);
+    input_fd = -1;
+    interactive = 0;
+    return;
+  }
+
+  if (script != NULL) {
+    int fd;
+    struct stat sb;
+    if ((fd = open(script, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &sb) < 0) {
+      fprintf(stderr, "%s: %s\n", script, strerror(errno));
+      exit(1);
+    }
+    interactive = 0;
+
+    // Anything but a regular file, e.g. a fifo, is read like stdin.
+    if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+        lb_map(&input, fd, sb.st_size) == 0) {
+      close(fd);
+      input_fd = -1;
+    } else {
+      input_fd = fd;
+    }
+    return;
+  }
+
+  interactive = isatty(STDIN_FILENO);
+}
+
+int main(int argc, char **argv) {
+  char *command = NULL;
+  int opt;
+  int zygote = 0;
+  while ((opt = getopt(argc, argv, "c:el:s:t:vz")) != -1) {
+    switch (opt) {
+    case 'c':
+      command = optarg;
+      break;
+    case 'e':
+      event_mode = 1;
+      break;
+    case 'l':
+      if (log_open(optarg) < 0) {
+        fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+        exit(1);
+      }
+      break;
+    case 's':
+      server_path = optarg;
+      event_mode = 1;
+      break;
+    case 't':
+      trace_path = optarg;
+      tracing = 1;
+      break;
+    case 'v':
+      log_level = LOG_DEBUG;
+      break;
+    case 'z':
+      zygote = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-evz] [-l logfile] [-t tracefile] "
+              "[-s socket | -c command | script]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  shell_pid = getpid();
+  var_import(environ, 1);
+  if (sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) < 0)
+    unix_error("sched_getaffinity error");
+  if (trace_path != NULL)
+    atexit(trace_exit);
+  open_input(command, optind < argc ? argv[optind] : NULL);
+  if (server_path != NULL) {
+    // Jobs of clients must not read from the terminal of the server.
+    int fd = open("/dev/null", O_RDONLY);
+    if (fd < 0 || dup2(fd, STDIN_FILENO) < 0)
+      unix_error("/dev/null error");
+    if (fd != STDIN_FILENO)
+      close(fd);
+    interactive = 0;
+  }
+
+  if (sigprocmask(SIG_SETMASK, NULL, &child_mask) < 0)
+    unix_error("sigprocmask error");
+
+  if (interactive) {
+    init_job_control();
+    ed_init();
+  }
+
+  // Before the shell gets any bigger.
+  if (zygote) {
+    start_zygote();
+    spawn_mode = SPAWN_ZYGOTE;
+  }
+
+  if (server_path != NULL)
+    server_loop();
+  if (event_mode)
+    event_loop();
+
+  sigset_t mask_one, prev_one;
+  if (sigemptyset(&mask_one) < 0)
+    unix_error("sigempty error");
+  if (sigaddset(&mask_one, SIGCHLD) < 0 || sigaddset(&mask_one, SIGALRM) < 0)
+    unix_error("sigaddset error");
+
+  if (signal(SIGINT, forward_signal) == SIG_ERR) {
+    unix_error("Install SIGINT handler error");
+  }
+  if (signal(SIGTSTP, forward_signal) == SIG_ERR) {
+    unix_error("Install SIGTSTP handler error");
+  }
+  if (signal(SIGCHLD, reap_child) == SIG_ERR) {
+    unix_error("Install SIGCHLD handler error");
+  }
+  if (signal(SIGALRM, timeout_handler) == SIG_ERR) {
+    unix_error("Install SIGALRM handler error");
+  }
+
+  char *cmdline;
+  while (1) {
+    prompt();
+    if ((cmdline = read_command()) == NULL) {
+      if (sigprocmask(SIG_BLOCK, &mask_one, NULL) < 0)
+        unix_error("sigprocmask block error");
+      sched_drain();
+      exit(0);
+    }
+    if ((cmdline = hist_input(cmdline)) == NULL)
+      continue;
+
+    // Block SIGCHLD before eval. In the next loop iter when we get to
+    // read_command SIGCHLD handler will get a chance to run. SIGALRM is
+    // blocked with it since its handler looks at the job table too. We don't
+    // have to block all signals because we still want to receive SIGINT and
+    // SIGTSTP and forward them to the foreground process.
+    if (sigprocmask(SIG_BLOCK, &mask_one, &prev_one) < 0)
+      unix_error("sigprocmask block error");
+    blocked_begin();
+
+    eval(cmdline);
+
+    if (sigprocmask(SIG_SETMASK, &prev_one, NULL) < 0)
+      unix_error("sigprocmask set mask error");
+    blocked_end();
+  }
+}
+
+// Command lists. A line is a list of and-or lists separated by ;, & or
+// newlines, each one a chain of pipelines joined by && and ||, and
+// { list; } groups a list into one command of a pipeline. They're cut
+// apart on the raw text before any word is expanded, so every pipeline is
+// parsed by eval_line only when it runs: it sees the variables and the
+// working directory left by the ones before it, and one skipped by && or ||
+// costs nothing, not even its $(...). A group runs in the shell itself,
+// unless it's part of a pipeline or in background, see parseline.
+
+// Operators list_scan stops at, besides ; & and newline.
+#define OP_AND 'A'
+#define OP_OR 'O'
+#define OP_CLOSE '}'
+
+// Returns the end of the word at s, which may be quoted, on the raw text.
+// Unterminated quotes end it at the end of the line, parseline reports them.
+char *word_skip(char *s) {
+  while (*s != '\0' && strchr(" \t\n;&|<>", *s) == NULL) {
+    char *end = NULL;
+    if (*s == '\\') {
+      s += s[1] != '\0' ? 2 : 1;
+      continue;
+    } else if (*s == '\'') {
+      end = strchr(s + 1, '\'');
+    } else if (*s == '$' && s[1] == '(') {
+      end = subst_end(s + 2);
+    } else if (*s == '"') {
+      for (end = s + 1; *end != '"' && *end != '\0'; end++) {
+        if (*end == '\\' && end[1] != '\0')
+          end++;
+        else if (*end == '$' && end[1] == '(' &&
+                 (end = subst_end(end + 2)) == NULL)
+          break;
+      }
+      if (end != NULL && *end == '\0')
+        end = NULL;
+    } else {
+      s++;
+      continue;
+    }
+    if (end == NULL)
+      return s + strlen(s);
+    s = end + 1;
+  }
+  return s;
+}
+
+// Returns the end of the pipeline at s, where one of ;, &, newline, &&, ||,
+// the } of the group s is in or the end of the line is, and sets *op to it
+// or to 0 at the end. Groups nested in the pipeline are skipped. { and }
+// are only special as the first word of a command.
+char *list_scan(char *s, int *op) {
+  int depth = 0, command = 1;
+  while (*s != '\0') {
+    char c = *s;
+    if (c == ' ' || c == '\t') {
+      s++;
+    } else if (c == ';' || c == '\n' || c == '&' || c == '|') {
+      int two = (c == '&' || c == '|') && s[1] == c;
+      if (depth == 0 && (c != '|' || two)) {
+        *op = c == '&' && two ? OP_AND : c == '|' ? OP_OR : c;
+        return s;
+      }
+      s += 1 + two;
+      command = 1;
+    } else if (c == '<' || c == '>') {
+      // The word after a redirection is a file, or the descriptor of <&.
+      s += strspn(s, "<>&");
+      s += strspn(s, " \t");
+      s = word_skip(s);
+    } else if (command && c == '{' && strchr(" \t\n", s[1]) && s[1]) {
+      depth++;
+      s++;
+    } else if (command && c == '}' && strchr(" \t\n;&|<>", s[1])) {
+      if (depth == 0) {
+        *op = OP_CLOSE;
+        return s;
+      }
+      depth--;
+      s++;
+      command = 0;
+    } else {
+      s = word_skip(s);
+      command = 0;
+    }
+  }
+  *op = 0;
+  return s;
+}
+
+// Length of the operator list_scan stopped at.
+int op_len(int op) {
+  return op == OP_AND || op == OP_OR ? 2 : op != 0;
+}
+
+char *op_name(int op) {
+  switch (op) {
+  case OP_AND:
+    return "&&";
+  case OP_OR:
+    return "||";
+  case ';':
+    return ";";
+  case '&':
+    return "&";
+  case OP_CLOSE:
+    return "}";
+  default:
+    return "newline";
+  }
+}
+
+// Copies the len chars at s to the arena, NUL terminated, without the
+// blanks around them.
+char *copy_trimmed(char *s, size_t len) {
+  size_t skip = strspn(s, " \t\n");
+  s += skip < len ? skip : len;
+  len -= skip < len ? skip : len;
+  while (len > 0 && strchr(" \t\n", s[len - 1]))
+    len--;
+  char *t = arena_alloc(&cmd_arena, len + 1);
+  memcpy(t, s, len);
+  t[len] = '\0';
+  return t;
+}
+
+// Runs the list of len chars at s in background, as a group of its own.
+// text is the job's command line, what's queued, which comes back here when
+// it's evaluated again.
+void eval_bg_list(char *s, size_t len, char *text) {
+  char *line = arena_alloc(&cmd_arena, len + 7);
+  memcpy(line, "{ ", 2);
+  memcpy(line + 2, s, len);
+  strcpy(line + 2 + len, "\n} &");
+  eval_line(line, text);
+}
+
+// Returns -1 after printing the syntax error if the line s has an empty
+// pipeline where one is needed, before anything of it ran.
+int list_check(char *s) {
+  int op, link = 0;
+  do {
+    char *end = list_scan(s, &op);
+    if (strspn(s, " \t\n") >= (size_t)(end - s) &&
+        (op == OP_AND || op == OP_OR || op == ';' || op == OP_CLOSE ||
+         link == OP_AND || link == OP_OR)) {
+      printf("syntax error near unexpected token `%s'\n",
+             op_name(op != 0 && op != '\n' ? op : link));
+      return -1;
+    }
+    link = op;
+    s = end + op_len(op);
+  } while (op != 0);
+  return 0;
+}
+
+// Evaluates the lists of the line s, see list_scan.
+void eval_list(char *s) {
+  if (list_check(s) < 0) {
+    last_status = 2;
+    return;
+  }
+
+  // A line of a server client is one background job, whatever it's made of.
+  int op;
+  char *end = list_scan(s, &op);
+  if (server_client >= 0 && op != 0 &&
+      end[op_len(op) + strspn(end + op_len(op), " \t\n")] != '\0') {
+    eval_bg_list(s, strlen(s), copy_trimmed(s, strlen(s)));
+    return;
+  }
+
+  while (*(s += strspn(s, " \t\n")) != '\0') {
+    // Pipelines of one and-or list, it runs in a child of its own when it's
+    // followed by & and has more than one.
+    int n = 0;
+    char *p = s;
+    do {
+      end = list_scan(p, &op);
+      p = end + op_len(op);
+      n++;
+    } while (op == OP_AND || op == OP_OR);
+    if (op == '&' && n > 1) {
+      eval_bg_list(s, end - s, copy_trimmed(s, end - s + 1));
+      s = p;
+      continue;
+    }
+
+    int link = 0;
+    do {
+      end = list_scan(s, &op);
+      size_t len = end - s + (op == '&');
+      // A pipeline after && runs if the one before succeeded, after || if
+      // it failed, otherwise $? stays what it was.
+      if (link == 0 || (link == OP_AND) == (last_status == 0)) {
+        char *line = arena_alloc(&cmd_arena, len + 1);
+        memcpy(line, s, len);
+        line[len] = '\0';
+        list_break = 0;
+        eval_line(line, copy_trimmed(s, len));
+        if (list_break)
+          return;
+      } else {
+        skip_heredocs(s, len);
+      }
+      link = op;
+      s = end + op_len(op);
+    } while (op == OP_AND || op == OP_OR);
+  }
+}
+
+// cmdline is a line of any length handed out by read_command. It's copied
+// to the command arena, cut into its lists and each pipeline is tokenized
+// there in place, reading the bodies of its here-documents may move the
+// buffer it came from. The text of each is copied too, so a job can intern
+// it once it's started. Queued lines are evaluated while another one may be,
+// so only what this line allocated is freed.
+void eval(char *cmdline) {
+  arena_mark m = arena_pos(&cmd_arena);
+  int here_mark = here_len;
+  size_t size = strlen(cmdline) + 1;
+  char *line = arena_alloc(&cmd_arena, size);
+  memcpy(line, cmdline, size);
+
+  eval_list(line);
+  glob_reset();
+  while (here_len > here_mark)
+    close(here_fds[--here_len]);
+  arena_release(&cmd_arena, m);
+}
+
+// Operators are words of their own in argv, told apart from quoted words
+// with the same text by their address.
+static char op_pipe[] = "|";
+static char op_bg[] = "&";
+// Followed by the text of a { list; } group, see parseline.
+static char op_group[] = "{";
+
+void eval_line(char *cmdline, char *text) {
+  char **argv;
+  redir *redirs;
+  int bg;
+
+  // A queued line evaluated from within another command must not free jobs
+  // that command may still look at.
+  if (!sched_admitting) {
+    cleanup_jobs();
+    sched_admit();
+  }
+
+  char *body;
+  subst_ran = 0;
+  if ((argv = parseline(cmdline, &bg, &redirs)) == NULL ||
+      (body = read_heredocs(redirs)) == NULL) {
+    last_status = 2;
+    return;
+  }
+  // Lines of server clients always run in background.
+  if (server_client >= 0)
+    bg = 1;
+
+  if (argv[0] == NULL) /* Ignore empty commands. */
+    return;
+  if (argv[0] == op_bg) /* Ignore singleton '&'. */
+    return;
+
+  if (!strcmp(argv[0], "fg")) {
+    last_status = 1;
+    if (argv[1] == NULL) {
+      return;
+    }
+    // The server can't wait for one client's job while serving the others.
+    if (server_client >= 0) {
+      printf("fg: not available in server mode\n");
+      return;
+    }
+
+    int i;
+    char *id_part = argv[1];
+
+    if ((i = parse_job(id_part)) >= 0) {
+      // i is the slot of a stopped background job which now
+      // needs to resume and run in foreground. It gets the terminal before
+      // it can run and try to read from it.
+      tty_give(i);
+      if (kill(-jobs[i].pgid, SIGCONT) < 0) {
+        unix_error("Forward SIGCONT error");
+      }
+      continuejob(i);
+      trace_event(EV_RESUME_FG, jobs[i].pgid, jobs[i].pgid, 0);
+      run_fg(i);
+      return;
+    }
+
+    printf("%s: No such process\n", argv[1]);
+    return;
+  }
+
+  if (!strcmp(argv[0], "bg")) {
+    last_status = 1;
+    if (argv[1] == NULL) {
+      return;
+    }
+
+    int i;
+    char *id_part = argv[1];
+
+    if ((i = parse_job(id_part)) >= 0) {
+      // i is the slot of a stopped background job which now
+      // needs to resume and run in background.
+      //
+      // If the job already terminated, we should have received SIGCHLD for
+      // it before the current run of eval which will change its status, thus
+      // parse_job will return -1.
+      if (kill(-jobs[i].pgid, SIGCONT) < 0) {
+        unix_error("Forward SIGCONT error");
+      }
+      continuejob(i);
+      trace_event(EV_RESUME_BG, jobs[i].pgid, jobs[i].pgid, 0);
+      run_bg(i);
+      return;
+    }
+
+    printf("%s: No such process\n", argv[1]);
+    return;
+  }
+
+  // prio <level> <cmd> runs the pipeline at a lower CPU priority, and puts
+  // it after pipelines of higher ones in the admission queue.
+  //
+  // timeout [-k grace] <secs> <cmd> sends SIGTERM to the pipeline once it
+  // ran for secs, and SIGKILL if it's still there grace seconds later. One
+  // timer serves all jobs, see timeout_add.
+  //
+  // pin <cpus> <cmd> and pin -n <node> <cmd> run the pipeline on the given
+  // CPUs, or on the ones of a NUMA node, see spawn_cpus.
+  //
+  // They come in any order before time.
+  int skip = 0;
+  int pri = PRI_NORMAL;
+  double secs = 0;
+  double grace = TIMEOUT_GRACE;
+  cpu_set_t cpus;
+  int pinned = 0;
+  while (1) {
+    if (!strcmp(argv[skip], "prio")) {
+      if (argv[skip + 1] == NULL || argv[skip + 2] == NULL ||
+          (pri = parse_pri(argv[skip + 1])) < 0) {
+        printf("usage: prio normal|low|idle command\n");
+        last_status = 2;
+        return;
+      }
+      skip += 2;
+    } else if (!strcmp(argv[skip], "timeout")) {
+      int k = skip + 1;
+      if (argv[k] != NULL && !strcmp(argv[k], "-k")) {
+        grace = parse_secs(argv[k + 1]);
+        k += 2;
+      }
+      if (grace < 0 || (secs = parse_secs(argv[k])) <= 0 ||
+          argv[k + 1] == NULL) {
+        printf("usage: timeout [-k grace] secs command\n");
+        last_status = 2;
+        return;
+      }
+      skip = k + 1;
+    } else if (!strcmp(argv[skip], "pin")) {
+      int k = skip + 1;
+      int node = argv[k] != NULL && !strcmp(argv[k], "-n");
+      k += node;
+      if (argv[k] == NULL || argv[k + 1] == NULL) {
+        printf("usage: pin cpus|-n node command\n");
+        last_status = 2;
+        return;
+      }
+      int bad = node ? parse_int(argv[k]) < 0 ||
+                           find_node(parse_int(argv[k]), &cpus) < 0
+                     : parse_cpulist(argv[k], &cpus) < 0;
+      if (bad) {
+        printf("pin: %s: invalid %s\n", argv[k], node ? "node" : "CPU list");
+        last_status = 2;
+        return;
+      }
+      CPU_AND(&cpus, &cpus, &shell_cpus);
+      if (CPU_COUNT(&cpus) == 0) {
+        printf("pin: %s: no CPU the shell may use\n", argv[k]);
+        last_status = 2;
+        return;
+      }
+      pinned = 1;
+      skip = k + 1;
+    } else {
+      break;
+    }
+  }
+
+  // time <cmd> reports the resources used by the whole pipeline that follows
+  // once it terminates, it doesn't cost a process of its own.
+  int timed = !strcmp(argv[skip], "time");
+  if (timed && argv[skip + 1] == NULL)
+    return;
+  skip += timed;
+
+  // Split the command into the stages of a pipeline at each "|".
+  int n = 1;
+  for (int k = skip; argv[k] != NULL; k++)
+    n += argv[k] == op_pipe;
+  char ***stages = arena_alloc(&cmd_arena, n * sizeof(char **));
+  n = 0;
+  stages[n++] = &argv[skip];
+  for (int k = skip; argv[k] != NULL; k++) {
+    if (argv[k] == op_pipe) {
+      argv[k] = NULL;
+      stages[n++] = &argv[k + 1];
+    }
+  }
+  for (int k = 0; k < n; k++) {
+    if (stages[k][0] == NULL) {
+      printf("syntax error near unexpected token `|'\n");
+      last_status = 2;
+      return;
+    }
+  }
+
+  // The name=value words a stage starts with, see parseline. On their own
+  // they set variables of the shell, with a builtin of the shell they're set
+  // while it runs, and otherwise they go to the environment of the command
+  // only, see var_overlay. A stage with nothing else runs true in a child,
+  // which can't change the shell either.
+  static char *no_command[] = {"true", NULL};
+  char ***assigns = arena_alloc(&cmd_arena, n * sizeof(char **));
+  int *nassigns = arena_alloc(&cmd_arena, n * sizeof(int));
+  for (int k = 0; k < n; k++) {
+    assigns[k] = stages[k];
+    nassigns[k] = count_assigns(stages[k]);
+    stages[k] += nassigns[k];
+  }
+  if (n == 1 && !bg && stages[0][0] == NULL) {
+    for (int k = 0; k < nassigns[0]; k++) {
+      size_t len = strchr(assigns[0][k], '=') - assigns[0][k];
+      var_set(assigns[0][k], len, assigns[0][k] + len + 1, 0);
+    }
+    if (!subst_ran)
+      last_status = 0;
+    return;
+  }
+  for (int k = 0; k < n; k++) {
+    if (stages[k][0] == NULL) {
+      stages[k] = no_command;
+      nassigns[k] = 0;
+    } else if (stages[k][0] == op_group && stages[k][2] != NULL) {
+      printf("syntax error near unexpected token `%s'\n", stages[k][2]);
+      last_status = 2;
+      return;
+    }
+  }
+
+  // A group runs in the shell like its builtins, unless it's in background,
+  // part of a pipeline or comes after prio, timeout, pin or time.
+  int group = n == 1 && !bg && skip == 0 && stages[0][0] == op_group;
+
+  // redirs are in the order of the stages, cut the list into one per stage.
+  redir **stage_redirs = arena_alloc(&cmd_arena, n * sizeof(redir *));
+  int nredirs = 0;
+  for (int k = 0; k < n; k++)
+    stage_redirs[k] = NULL;
+  for (redir *r = redirs, *prev = NULL; r != NULL; prev = r, r = r->next) {
+    if (prev == NULL || prev->stage != r->stage) {
+      stage_redirs[r->stage] = r;
+      if (prev != NULL)
+        prev->next = NULL;
+    }
+    nredirs++;
+  }
+
+  if (group || (n == 1 && is_builtin(stages[0][0]) == BUILTIN_SHELL)) {
+    // The builtin writes through stdout of the shell, so its buffer has to
+    // be written out before and after the descriptors change.
+    saved_fd *save = arena_alloc(&cmd_arena, nredirs * sizeof(saved_fd));
+    int nsave = 0;
+    var_saved *vars = arena_alloc(&cmd_arena, nassigns[0] * sizeof(var_saved));
+    fflush(stdout);
+    last_status = 1;
+    if (apply_redirs(redirs, save, &nsave) == 0) {
+      var_push(assigns[0], nassigns[0], vars);
+      if (group)
+        eval(stages[0][1]);
+      else if (timed)
+        last_status = time_builtin(stages[0]);
+      else
+        last_status = builtin_command(stages[0]);
+      var_pop(vars, nassigns[0]);
+    }
+    // The next command may write to the same file without going through
+    // stdout.
+    fflush(stdout);
+    restore_redirs(save, nsave);
+    return;
+  }
+
+  // Resolve every command before starting any of them, so a typo won't cost
+  // a child. Builtins in a pipeline run in a child of their own.
+  char **paths = arena_alloc(&cmd_arena, n * sizeof(char *));
+  for (int k = 0; k < n; k++) {
+    if (stages[k][0] == op_group || is_builtin(stages[k][0]) != NOT_BUILTIN) {
+      paths[k] = NULL;
+    } else if ((paths[k] = find_command(stages[k][0])) == NULL) {
+      printf("%s: Command not found.\n", stages[k][0]);
+      stats.exec_failures++;
+      last_status = 127;
+      return;
+    }
+  }
+
+  // Background jobs over the limit wait in the admission queue, their line
+  // is evaluated again once they're admitted.
+  if (bg && !sched_admitting && sched_full()) {
+    // The bodies of its here-documents were read from the input already,
+    // they're queued after the line.
+    char *queued = text;
+    if (*body != '\0') {
+      queued = arena_alloc(&cmd_arena, strlen(text) + strlen(body) + 2);
+      sprintf(queued, "%s\n%s", text, body);
+    }
+    int qid = sched_push(queued, pri, server_client);
+    if (server_client >= 0) {
+      clients[server_client].njobs++;
+      clients[server_client].queued = qid;
+    } else {
+      printf("[q%d] Queued %s\n", qid, text);
+    }
+    last_status = 0;
+    return;
+  }
+
+  if (!pinned && bg && place_mode != PLACE_OFF)
+    pinned = place_next(&cpus) == 0;
+  spawn_cpus = pinned ? &cpus : NULL;
+
+  // All stages join the process group of the first one, with one pipe
+  // between each two of them.
+  pid_t *pids = arena_alloc(&cmd_arena, n * sizeof(pid_t));
+  int np = 0;
+  int in = -1;
+  for (int k = 0; k < n; k++) {
+    int fds[2] = {-1, -1};
+    if (k < n - 1) {
+      if (pipe2(fds, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+      if (pipe_size > 0)
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    spawn_env = nassigns[k] ? var_overlay(assigns[k], nassigns[k]) : NULL;
+    pid_t pid = spawn_cmd(paths[k], stages[k], np ? pids[0] : 0, in, fds[1],
+                          stage_redirs[k], job_control && !bg);
+    if (pid > 0)
+      pids[np++] = pid;
+
+    // The children have their own copies now.
+    if (in != -1)
+      close(in);
+    if (fds[1] != -1)
+      close(fds[1]);
+    in = fds[0];
+  }
+  spawn_cpus = NULL;
+  spawn_env = NULL;
+
+  if (np == 0) {
+    last_status = 126;
+    return;
+  }
+  if (pri != PRI_NORMAL)
+    for (int k = 0; k < np; k++)
+      sched_renice(pids[k], pri);
+
+  int i = addjob(pids, np, RUNNING, text);
+  if (secs > 0)
+    timeout_add(i, secs, grace);
+  if (server_client >= 0)
+    client_own(i);
+  if (bg) {
+    jobs[i].counted = 1;
+    sched_running++;
+  }
+  if (!bg) {
+    run_fg(i);
+    job *j = &jobs[i];
+    if (timed && j->st == TERMINATED)
+      print_times(elapsed(&j->start, &j->end), &j->utime, &j->stime,
+                  j->maxrss, j->nvcsw, j->nivcsw);
+  } else {
+    run_bg(i);
+  }
+}
+
+// Appends word to argv, which has room for cap words and is copied into a
+// new block twice its size from the arena when it's full. There's always
+// room left for the NULL which ends it.
+char **argv_push(char **argv, size_t *n, size_t *cap, char *word) {
+  if (*n + 1 >= *cap) {
+    size_t ncap = *cap ? *cap * 2 : 64;
+    char **v = arena_alloc(&cmd_arena, ncap * sizeof(char *));
+    if (*n > 0)
+      memcpy(v, argv, *n * sizeof(char *));
+    argv = v;
+    *cap = ncap;
+  }
+  argv[(*n)++] = word;
+  return argv;
+}
+
+// Command substitution and here-documents. $(cmd) runs cmd in a forked copy
+// of the shell with its stdout on a memfd and is replaced by what it wrote,
+// minus trailing newlines. The shell waits for the subshell and then reads
+// the whole output with one pread, so there's no pipe to drain while it
+// runs. Bodies of here-documents are written to a memfd the command gets as
+// the redirected descriptor. Inside a body the subshell writes its output to
+// that memfd itself, it's never copied through the shell. Nothing is written
+// to /tmp.
+
+// Char which the output of an unquoted $(...) has in place of blanks,
+// parseline splits the word into fields there.
+#define FIELD_SEP '\x01'
+
+// Set by next_word when the word it returned has to be split.
+static int split_word = 0;
+
+// Set while a pipeline skipped by && or || is parsed for the bodies of its
+// here-documents only, nothing is substituted then.
+static int parse_only = 0;
+
+// Raw text of the bodies read for the current line.
+static char *here_raw = NULL;
+static size_t here_raw_cap = 0;
+
+void write_full(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      unix_error("write error");
+    buf += n;
+    len -= n;
+  }
+}
+
+// Returns the ')' which ends the $( right before s, NULL if there is none.
+// Quotes and nested parentheses are skipped.
+char *subst_end(char *s) {
+  int depth = 0;
+  for (; *s != '\0'; s++) {
+    if (*s == '\\' && s[1] != '\0') {
+      s++;
+    } else if (*s == '\'') {
+      if ((s = strchr(s + 1, '\'')) == NULL)
+        return NULL;
+    } else if (*s == '"') {
+      for (s++; *s != '"'; s++) {
+        if (*s == '\0')
+          return NULL;
+        if (*s == '\\' && s[1] != '\0')
+          s++;
+      }
+    } else if (*s == '(') {
+      depth++;
+    } else if (*s == ')' && depth-- == 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+// Runs the command line cmd in a child which is a copy of the shell, with
+// its stdout on fd, and waits for it. The child has SIGCHLD blocked or read
+// from sig_fd like the shell, so only this waitpid reaps it. Its exit status
+// becomes last_status, which a line of assignments only then keeps. In
+// server mode no other client is served until the child is done.
+void subshell(char *cmd, int fd) {
+  // Otherwise the child would write out whatever is buffered once more.
+  fflush(stdout);
+  pid_t pid = Fork();
+  if (pid == 0) {
+    enter_subshell();
+    if (dup2(fd, STDOUT_FILENO) < 0)
+      unix_error("dup2 error");
+    eval(cmd);
+    exit(last_status);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      unix_error("waitpid error");
+  last_status = exit_code(status);
+  subst_ran = 1;
+}
+
+int memfd(char *name) {
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0)
+    unix_error("memfd_create error");
+  return fd;
+}
+
+// Replaces the $(...) at src in the word being unquoted at *word, whose end
+// so far is *dstp. The output may be longer than the text it replaces, so
+// the word moves to a new block from the arena with room for the output and
+// the rest of the line. Returns the position past the ')', NULL after a
+// syntax error.
+char *subst_word(char **word, char **dstp, char *src, int quoted) {
+  char *end = subst_end(src + 2);
+  if (end == NULL) {
+    printf("syntax error: unterminated $(\n");
+    return NULL;
+  }
+  int fd = memfd("subst");
+  *end = '\0';
+  subshell(src + 2, fd);
+  *end = ')';
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0)
+    unix_error("fstat error");
+  size_t prefix = *dstp - *word;
+  size_t size = sb.st_size;
+  char *w = arena_alloc(&cmd_arena, prefix + size + strlen(end + 1) + 1);
+  memcpy(w, *word, prefix);
+  char *out = w + prefix;
+  for (size_t got = 0; got < size;) {
+    ssize_t n = pread(fd, out + got, size - got, got);
+    if (n < 0 && errno != EINTR)
+      unix_error("read error");
+    if (n == 0)
+      size = got;
+    if (n > 0)
+      got += n;
+  }
+  close(fd);
+
+  while (size > 0 && out[size - 1] == '\n')
+    size--;
+  if (!quoted) {
+    for (size_t k = 0; k < size; k++)
+      if (strchr(" \t\n", out[k]) != NULL)
+        out[k] = FIELD_SEP;
+    split_word = 1;
+  }
+  *word = w;
+  *dstp = out + size;
+  return end + 1;
+}
+
+// Replaces the $name or ${name} at src in the word being unquoted at *word
+// with the value of the variable, or nothing when it isn't set. The value is
+// written in place when it's no longer than what's left of the reference,
+// otherwise the word moves to the arena like for subst_word. Unquoted, the
+// value is split into fields at blanks. Returns the position past the
+// reference, NULL if src isn't one.
+char *var_word(char **word, char **dstp, char *src, int quoted) {
+  char *name;
+  size_t len;
+  char *end = var_ref(src, &name, &len);
+  if (end == NULL)
+    return NULL;
+  char *value = var_get_n(name, len);
+  if (value == NULL)
+    value = "";
+  size_t size = strlen(value);
+
+  char *out = *dstp;
+  if (size > (size_t)(end - out)) {
+    size_t prefix = out - *word;
+    char *w = arena_alloc(&cmd_arena, prefix + size + strlen(end) + 1);
+    memcpy(w, *word, prefix);
+    *word = w;
+    out = w + prefix;
+  }
+  memcpy(out, value, size);
+  if (!quoted) {
+    for (size_t k = 0; k < size; k++)
+      if (strchr(" \t\n", out[k]) != NULL)
+        out[k] = FIELD_SEP;
+    // An empty value leaves no field unless something else is in the word.
+    split_word |= size == 0 || memchr(out, FIELD_SEP, size) != NULL;
+  }
+  *dstp = out + size;
+  return end;
+}
+
+// Drops the newlines at the end of the output a subshell wrote to the memfd
+// fd from offset from on.
+void trim_newlines(int fd, off_t from) {
+  off_t end = lseek(fd, 0, SEEK_END);
+  char c;
+  while (end > from && pread(fd, &c, 1, end - 1) == 1 && c == '\n')
+    end--;
+  if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0)
+    unix_error("ftruncate error");
+}
+
+// Writes a line of the body of a here-document to fd. Unless the delimiter
+// was quoted $(...) and variables are substituted, and \$ \` \\ and
+// \newline are escapes.
+void here_write(int fd, char *line, int expand) {
+  char *s = line, *name;
+  size_t len;
+  while (*s != '\0') {
+    size_t n = expand ? strcspn(s, "$\\") : strlen(s);
+    write_full(fd, s, n);
+    s += n;
+
+    char *end;
+    if (*s == '\0') {
+      break;
+    } else if (*s == '\\') {
+      if (s[1] == '\n') {
+        s += 2;
+      } else if (s[1] != '\0' && strchr("$`\\", s[1]) != NULL) {
+        write_full(fd, s + 1, 1);
+        s += 2;
+      } else {
+        write_full(fd, s++, 1);
+      }
+    } else if (s[1] == '(' && (end = subst_end(s + 2)) != NULL) {
+      off_t from = lseek(fd, 0, SEEK_END);
+      *end = '\0';
+      subshell(s + 2, fd);
+      *end = ')';
+      trim_newlines(fd, from);
+      s = end + 1;
+    } else if ((end = var_ref(s, &name, &len)) != NULL) {
+      char *value = var_get_n(name, len);
+      if (value != NULL)
+        write_full(fd, value, strlen(value));
+      s = end;
+    } else {
+      write_full(fd, s++, 1);
+    }
+  }
+}
+
+// Reads the bodies of the here-documents in r from here_next, in order, and
+// gives each one a memfd with it. Returns their raw text in the arena, which
+// is queued together with the line, NULL after an error.
+char *read_heredocs(redir *r) {
+  size_t raw = 0;
+  for (; r != NULL; r = r->next) {
+    if (r->type != REDIR_HEREDOC)
+      continue;
+    if (here_next == NULL) {
+      printf("here-document: not available in command substitution\n");
+      return NULL;
+    }
+    if (here_len == here_cap) {
+      int cap = here_cap ? here_cap * 2 : 16;
+      int *fds = realloc(here_fds, cap * sizeof(int));
+      if (fds == NULL)
+        unix_error("realloc error");
+      here_fds = fds;
+      here_cap = cap;
+    }
+    here_fds[here_len++] = r->hfd = memfd("heredoc");
+
+    size_t dlen = strlen(r->word);
+    char *line;
+    while ((line = here_next()) != NULL) {
+      size_t len = strlen(line);
+      if (raw + len + 1 > here_raw_cap) {
+        size_t cap = (raw + len + 1) * 2;
+        char *buf = realloc(here_raw, cap);
+        if (buf == NULL)
+          unix_error("realloc error");
+        here_raw = buf;
+        here_raw_cap = cap;
+      }
+      memcpy(here_raw + raw, line, len);
+      raw += len;
+
+      if (r->hflags & HERE_STRIP)
+        line += strspn(line, "\t");
+      if (strcspn(line, "\n") == dlen && !strncmp(line, r->word, dlen))
+        break;
+      if (!parse_only)
+        here_write(r->hfd, line, !(r->hflags & HERE_QUOTED));
+    }
+    if (line == NULL)
+      printf("warning: here-document delimited by end-of-file (wanted `%s')\n",
+             r->word);
+    if (lseek(r->hfd, 0, SEEK_SET) < 0)
+      unix_error("lseek error");
+  }
+
+  char *body = arena_alloc(&cmd_arena, raw + 1);
+  if (raw > 0)
+    memcpy(body, here_raw, raw);
+  body[raw] = '\0';
+  return body;
+}
+
+// Reads past the bodies of the here-documents of the pipeline of len chars
+// at s, which doesn't run.
+void skip_heredocs(char *s, size_t len) {
+  if (memmem(s, len, "<<", 2) == NULL)
+    return;
+  char *line = arena_alloc(&cmd_arena, len + 1);
+  memcpy(line, s, len);
+  line[len] = '\0';
+  int bg;
+  redir *redirs;
+  parse_only = 1;
+  if (parseline(line, &bg, &redirs) != NULL)
+    read_heredocs(redirs);
+  parse_only = 0;
+}
+
+// Appends the fields of a word split at FIELD_SEP to argv, empty ones are
+// dropped.
+char **push_fields(char **argv, size_t *n, size_t *cap, char *word) {
+  char sep[] = {FIELD_SEP, '\0'};
+  for (char *f = strtok(word, sep); f != NULL; f = strtok(NULL, sep))
+    argv = argv_push(argv, n, cap, f);
+  return argv;
+}
+
+// Pathname expansion. next_word records where the unquoted *, ? and [ of a
+// word are, only those are special, and parseline hands a word with any to
+// glob_push. The pattern is compiled once into one glob_seg per component
+// and matched against the listings of the directories it walks, which are
+// read with getdents64 by dir_fresh and kept until the end of the line, so
+// a directory several words look into is read once. Listings are sorted,
+// the literal chars a component starts with narrow it to a range of them
+// with a binary search. ** as a whole component matches any number of
+// directories, except those starting with a dot, and doesn't follow
+// symbolic links. Matches go straight to the arena, sorted. A word which
+// matches nothing is left as it is.
+static size_t *glob_at = NULL;
+static size_t glob_len = 0;
+static size_t glob_cap = 0;
+
+void glob_mark(size_t off) {
+  if (glob_len == glob_cap) {
+    glob_cap = glob_cap ? 2 * glob_cap : 16;
+    if ((glob_at = realloc(glob_at, glob_cap * sizeof(size_t))) == NULL)
+      unix_error("realloc error");
+  }
+  glob_at[glob_len++] = off;
+}
+
+typedef enum {
+  GL_CHAR,
+  GL_ANY,
+  GL_STAR,
+  GL_CLASS,
+} GlobOp;
+
+typedef struct {
+  GlobOp op;
+  unsigned char c;
+  // For GL_CLASS, the chars it matches.
+  uint64_t set[4];
+} glob_op;
+
+typedef enum {
+  SEG_LITERAL,
+  SEG_PATTERN,
+  // ** as a whole component.
+  SEG_ANYDIR,
+} SegKind;
+
+typedef struct {
+  SegKind kind;
+  // The text of a SEG_LITERAL, and the literal chars a SEG_PATTERN starts
+  // with, NUL terminated.
+  char *lit;
+  glob_op *ops;
+  int nops;
+} glob_seg;
+
+// Listings of the directories looked into by the line being evaluated, by
+// path. Chained per bucket of glob_tab.
+typedef struct glob_dir {
+  dirlist list;
+  struct glob_dir *next;
+} glob_dir;
+
+static glob_dir **glob_tab = NULL;
+static size_t glob_tab_cap = 0;
+static size_t glob_tab_len = 0;
+
+// The state of an expansion: the components, the path matched so far and
+// the matches.
+typedef struct {
+  glob_seg *segs;
+  int nsegs;
+  // The pattern ends with a slash, only directories match.
+  int dir_only;
+  char *path;
+  size_t path_cap;
+  char **argv;
+  size_t *argc;
+  size_t *cap;
+} glob_ctx;
+
+dirlist *glob_list(char *path) {
+  if (glob_tab_len + 1 > glob_tab_cap / 4 * 3) {
+    size_t cap = glob_tab_cap ? glob_tab_cap * 2 : 64;
+    glob_dir **tab = calloc(cap, sizeof(glob_dir *));
+    if (tab == NULL)
+      unix_error("calloc error");
+    for (size_t i = 0; i < glob_tab_cap; i++) {
+      for (glob_dir *g = glob_tab[i], *next; g != NULL; g = next) {
+        next = g->next;
+        size_t b = hash_str(g->list.path) & (cap - 1);
+        g->next = tab[b];
+        tab[b] = g;
+      }
+    }
+    free(glob_tab);
+    glob_tab = tab;
+    glob_tab_cap = cap;
+  }
+
+  size_t b = hash_str(path) & (glob_tab_cap - 1);
+  for (glob_dir *g = glob_tab[b]; g != NULL; g = g->next)
+    if (!strcmp(g->list.path, path))
+      return &g->list;
+  glob_dir *g = calloc(1, sizeof(glob_dir));
+  if (g == NULL)
+    unix_error("calloc error");
+  dir_fresh(&g->list, path);
+  g->next = glob_tab[b];
+  glob_tab[b] = g;
+  glob_tab_len++;
+  return &g->list;
+}
+
+// Forgets the listings once the line is done.
+void glob_reset() {
+  for (size_t i = 0; i < glob_tab_cap && glob_tab_len > 0; i++) {
+    for (glob_dir *g = glob_tab[i], *next; g != NULL; g = next) {
+      next = g->next;
+      free(g->list.path);
+      free(g->list.pool);
+      free(g->list.ents);
+      free(g);
+      glob_tab_len--;
+    }
+    glob_tab[i] = NULL;
+  }
+}
+
+int glob_op_match(glob_op *op, unsigned char c) {
+  switch (op->op) {
+  case GL_CHAR:
+    return op->c == c;
+  case GL_ANY:
+    return 1;
+  case GL_CLASS:
+    return (op->set[c >> 6] >> (c & 63)) & 1;
+  default:
+    return 0;
+  }
+}
+
+// Whether name matches the component. Only a * is backtracked to, and only
+// the last one, which is enough since a later one can match anything an
+// earlier one could. A dot starting a name has to be matched literally.
+int glob_match(glob_seg *seg, char *name) {
+  glob_op *p = seg->ops;
+  int np = seg->nops;
+  if (name[0] == '.' && (np == 0 || p[0].op != GL_CHAR || p[0].c != '.'))
+    return 0;
+  int pi = 0, star = -1;
+  char *star_s = NULL;
+  while (*name != '\0') {
+    if (pi < np && p[pi].op == GL_STAR) {
+      star = ++pi;
+      star_s = name;
+    } else if (pi < np && glob_op_match(&p[pi], *name)) {
+      pi++;
+      name++;
+    } else if (star >= 0) {
+      pi = star;
+      name = ++star_s;
+    } else {
+      return 0;
+    }
+  }
+  while (pi < np && p[pi].op == GL_STAR)
+    pi++;
+  return pi == np;
+}
+
+// Compiles the component of word from s to end, marks is the first entry
+// of glob_at at or after s. Returns the entry following the component.
+size_t glob_compile(glob_seg *seg, char *word, char *s, char *end,
+                    size_t marks) {
+  size_t len = end - s;
+  seg->lit = arena_alloc(&cmd_arena, len + 1);
+  seg->ops = arena_alloc(&cmd_arena, (len + 1) * sizeof(glob_op));
+  seg->nops = 0;
+  int meta = 0;
+  size_t nlit = 0;
+  int prefix = 1;
+  while (s < end) {
+    int special = marks < glob_len && glob_at[marks] == (size_t)(s - word);
+    if (special)
+      marks++;
+    glob_op *op = &seg->ops[seg->nops];
+    unsigned char c = *s++;
+    if (special && c == '[') {
+      // The closing ] may come first, after the optional !.
+      char *t = s;
+      int negate = *t == '!' || *t == '^';
+      t += negate;
+      if (t < end && *t == ']')
+        t++;
+      while (t < end && *t != ']')
+        t++;
+      if (t < end) {
+        op->op = GL_CLASS;
+        memset(op->set, 0, sizeof(op->set));
+        for (char *k = s + negate; k < t; k++) {
+          unsigned char lo = k[0], hi = lo;
+          if (k + 2 < t && k[1] == '-') {
+            hi = k[2];
+            k += 2;
+          }
+          for (unsigned v = lo; v <= hi; v++)
+            op->set[v >> 6] |= 1ULL << (v & 63);
+        }
+        if (negate)
+          for (int k = 0; k < 4; k++)
+            op->set[k] = ~op->set[k];
+        while (marks < glob_len && glob_at[marks] <= (size_t)(t - word))
+          marks++;
+        s = t + 1;
+        seg->nops++;
+        meta = 1;
+        prefix = 0;
+        continue;
+      }
+    }
+    if (special && (c == '*' || c == '?')) {
+      op->op = c == '*' ? GL_STAR : GL_ANY;
+      meta = 1;
+      prefix = 0;
+      if (c == '*' && seg->nops > 0 && op[-1].op == GL_STAR)
+        continue;
+    } else {
+      op->op = GL_CHAR;
+      op->c = c;
+      if (prefix)
+        seg->lit[nlit++] = c;
+    }
+    seg->nops++;
+  }
+  seg->lit[nlit] = '\0';
+  if (!meta) {
+    seg->kind = SEG_LITERAL;
+    memcpy(seg->lit, end - len, len);
+    seg->lit[len] = '\0';
+  } else if (seg->nops == 1 && seg->ops[0].op == GL_STAR && len == 2) {
+    seg->kind = SEG_ANYDIR;
+  } else {
+    seg->kind = SEG_PATTERN;
+  }
+  return marks;
+}
+
+void glob_add(glob_ctx *g, size_t len) {
+  char *m = arena_alloc(&cmd_arena, len + 1);
+  memcpy(m, g->path, len);
+  m[len] = '\0';
+  g->argv = argv_push(g->argv, g->argc, g->cap, m);
+}
+
+// Appends name and a slash to the path matched so far, which is len long.
+size_t glob_append(glob_ctx *g, size_t len, char *name, int slash) {
+  size_t n = strlen(name);
+  if (len + n + 2 > g->path_cap) {
+    while (len + n + 2 > g->path_cap)
+      g->path_cap *= 2;
+    if ((g->path = realloc(g->path, g->path_cap)) == NULL)
+      unix_error("realloc error");
+  }
+  memcpy(g->path + len, name, n);
+  len += n;
+  if (slash)
+    g->path[len++] = '/';
+  g->path[len] = '\0';
+  return len;
+}
+
+// Whether entry k of a listing of the directory at path is a directory,
+// symbolic links are followed unless nofollow.
+int glob_isdir(glob_ctx *g, size_t len, dirlist *d, size_t k, int nofollow) {
+  int type = dir_type(d, k);
+  if (type == DT_DIR)
+    return 1;
+  if (type != DT_UNKNOWN && (type != DT_LNK || nofollow))
+    return 0;
+  struct stat sb;
+  glob_append(g, len, dir_name(d, k), 0);
+  int r = (nofollow ? lstat : stat)(g->path, &sb);
+  g->path[len] = '\0';
+  return r == 0 && S_ISDIR(sb.st_mode);
+}
+
+// Adds everything below the directory the path matched so far names, see
+// glob_walk.
+void glob_all(glob_ctx *g, size_t len) {
+  dirlist *d = glob_list(len > 0 ? g->path : ".");
+  for (size_t k = 0; k < d->n; k++) {
+    char *name = dir_name(d, k);
+    if (name[0] == '.')
+      continue;
+    glob_add(g, glob_append(g, len, name, 0));
+    if (glob_isdir(g, len, d, k, 1))
+      glob_all(g, glob_append(g, len, name, 1));
+  }
+  g->path[len] = '\0';
+}
+
+// Matches the components from seg on in the directory the path matched so
+// far names, it's len long and ends with a slash unless it's empty.
+void glob_walk(glob_ctx *g, int seg, size_t len) {
+  if (seg == g->nsegs) {
+    // With a trailing slash the last match is followed by one.
+    if (len > 0)
+      glob_add(g, g->dir_only ? len : len - 1);
+    return;
+  }
+  glob_seg *s = &g->segs[seg];
+  int last = seg == g->nsegs - 1;
+  if (s->kind == SEG_LITERAL && !last)
+    return glob_walk(g, seg + 1, glob_append(g, len, s->lit, 1));
+  dirlist *d = glob_list(len > 0 ? g->path : ".");
+  if (s->kind == SEG_LITERAL) {
+    // The parent's listing tells whether it's there, no need to stat it.
+    size_t k = dir_lower(d, s->lit);
+    if (k < d->n && !strcmp(dir_name(d, k), s->lit) &&
+        (!g->dir_only || glob_isdir(g, len, d, k, 0)))
+      glob_walk(g, seg + 1, glob_append(g, len, s->lit, 1));
+    return;
+  }
+
+  if (s->kind == SEG_ANYDIR) {
+    // A trailing ** is the directory itself and everything below it.
+    if (last && !g->dir_only) {
+      if (len > 0)
+        glob_add(g, len);
+      glob_all(g, len);
+      return;
+    }
+    // No directory at all, then each one in turn.
+    glob_walk(g, seg + 1, len);
+    for (size_t k = 0; k < d->n; k++) {
+      if (dir_name(d, k)[0] != '.' && glob_isdir(g, len, d, k, 1))
+        glob_walk(g, seg, glob_append(g, len, dir_name(d, k), 1));
+    }
+    g->path[len] = '\0';
+    return;
+  }
+
+  size_t plen = strlen(s->lit);
+  for (size_t k = dir_lower(d, s->lit);
+       k < d->n && !strncmp(dir_name(d, k), s->lit, plen); k++) {
+    char *name = dir_name(d, k);
+    if (!glob_match(s, name))
+      continue;
+    if (last && !g->dir_only)
+      glob_add(g, glob_append(g, len, name, 0));
+    else if (glob_isdir(g, len, d, k, 0))
+      glob_walk(g, seg + 1, glob_append(g, len, name, 1));
+  }
+  g->path[len] = '\0';
+}
+
+int compare_str(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Pushes the paths word matches to argv, or word if there's none.
+char **glob_push(char **argv, size_t *n, size_t *cap, char *word) {
+  size_t wlen = strlen(word);
+  glob_seg *segs = arena_alloc(&cmd_arena, (wlen / 2 + 2) * sizeof(glob_seg));
+  int nsegs = 0, meta = 0;
+  size_t marks = 0;
+  char *s = word;
+  int absolute = *s == '/';
+  s += strspn(s, "/");
+  while (*s != '\0') {
+    char *end = strchr(s, '/');
+    if (end == NULL)
+      end = s + strlen(s);
+    marks = glob_compile(&segs[nsegs], word, s, end, marks);
+    meta |= segs[nsegs++].kind != SEG_LITERAL;
+    s = end + strspn(end, "/");
+  }
+
+  // Like a lone [, which is test.
+  if (!meta)
+    return argv_push(argv, n, cap, word);
+
+  static char *path = NULL;
+  static size_t path_cap = 0;
+  if (path == NULL && (path = malloc(path_cap = MAXLINE)) == NULL)
+    unix_error("malloc error");
+  glob_ctx g = {.segs = segs,
+                .nsegs = nsegs,
+                .dir_only = wlen > 0 && word[wlen - 1] == '/',
+                .path = path,
+                .path_cap = path_cap,
+                .argv = argv,
+                .argc = n,
+                .cap = cap};
+  size_t from = *n;
+  size_t len = 0;
+  if (absolute)
+    path[len++] = '/';
+  path[len] = '\0';
+  glob_walk(&g, 0, len);
+  path = g.path;
+  path_cap = g.path_cap;
+  if (*n == from)
+    return argv_push(g.argv, n, cap, word);
+  qsort(g.argv + from, *n - from, sizeof(char *), compare_str);
+  return g.argv;
+}
+
+// Set by parseline when the next word may be an assignment. The value of
+// one isn't split into fields.
+static int word_assign = 0;
+
+// Returns 1 if the chars from s to end start with name=.
+int assign_prefix(char *s, char *end) {
+  char *eq = memchr(s, '=', end - s);
+  if (eq == NULL || eq == s || (*s >= '0' && *s <= '9'))
+    return 0;
+  for (; s < eq; s++)
+    if (strchr(NAME_CHARS, *s) == NULL)
+      return 0;
+  return 1;
+}
+
+// Unquotes the word at *srcp in place and NUL terminates it, see
+// parseline. Returns the char which ended it, 0 at the end of the line, and
+// *srcp is left past it. Returns -1 after a syntax error.
+int next_word(char **srcp, char **word) {
+  static char *special = " \t\n|&<>'\"\\$*?[";
+  char *src = *srcp, *dst = src, *end;
+  *word = src;
+  glob_len = 0;
+  while (1) {
+    size_t n = strcspn(src, special);
+    if (dst != src)
+      memmove(dst, src, n);
+    dst += n;
+    src += n;
+
+    if (*src == '\'') {
+      char *end = strchr(src + 1, '\'');
+      if (end == NULL) {
+        printf("syntax error: unterminated quote\n");
+        return -1;
+      }
+      memmove(dst, src + 1, end - src - 1);
+      dst += end - src - 1;
+      src = end + 1;
+    } else if (*src == '"') {
+      src++;
+      while (*src != '"') {
+        n = strcspn(src, "\"\\$");
+        memmove(dst, src, n);
+        dst += n;
+        src += n;
+        if (*src == '\0') {
+          printf("syntax error: unterminated quote\n");
+          return -1;
+        }
+        if (*src == '$') {
+          if (parse_only) {
+            *dst++ = *src++;
+          } else if (src[1] == '(') {
+            if ((src = subst_word(word, &dst, src, 1)) == NULL)
+              return -1;
+          } else if ((end = var_word(word, &dst, src, 1)) != NULL) {
+            src = end;
+          } else {
+            *dst++ = *src++;
+          }
+        } else if (*src == '\\') {
+          if (src[1] == '\n') {
+            src += 2;
+          } else if (src[1] != '\0' && strchr("\"\\$`", src[1])) {
+            *dst++ = src[1];
+            src += 2;
+          } else {
+            *dst++ = *src++;
+          }
+        }
+      }
+      src++;
+    } else if (*src == '$') {
+      int quoted = word_assign && assign_prefix(*word, dst);
+      if (parse_only) {
+        *dst++ = *src++;
+      } else if (src[1] == '(') {
+        if ((src = subst_word(word, &dst, src, quoted)) == NULL)
+          return -1;
+      } else if ((end = var_word(word, &dst, src, quoted)) != NULL) {
+        src = end;
+      } else {
+        *dst++ = *src++;
+      }
+    } else if (*src == '*' || *src == '?' || *src == '[') {
+      glob_mark(dst - *word);
+      *dst++ = *src++;
+    } else if (*src == '\\') {
+      if (src[1] == '\0') {
+        *dst++ = *src++;
+      } else if (src[1] == '\n') {
+        src += 2;
+      } else {
+        *dst++ = src[1];
+        src += 2;
+      }
+    } else {
+      break;
+    }
+  }
+
+  // dst may be where the char which ended the word is, it's saved first.
+  int c = *src;
+  *dst = '\0';
+  *srcp = c != '\0' ? src + 1 : src;
+  return c;
+}
+
+// Splits buf into words separated by blanks in a single pass. "|" and "&"
+// are words of their own even when they are not surrounded by blanks, so
+// "a|b" is a pipeline. Quotes and backslashes work as in sh: nothing is
+// special inside '...', only \" \\ \$ \` and \newline are escapes inside
+// "...", and outside of quotes a backslash takes the next char literally.
+//
+// Redirections <, >, >>, <&, >&, << and <<-, optionally prefixed with a
+// descriptor as in 2>&1, are taken out of argv together with the word that
+// follows them, and appended in order to *redirs.
+//
+// Words are unquoted in place, the text only ever gets shorter so each one
+// is written behind the position it's read from. Runs of ordinary chars are
+// found with strcspn, which glibc implements with SIMD. Only a word with a
+// $(...) moves to the arena, see subst_word, and is split into fields where
+// the output of an unquoted one had blanks. $name and ${name} are replaced
+// by the value of the variable the same way, see var_word. Words with
+// unquoted *, ? or [ are expanded to the paths they match, see glob_push.
+// The name=value words a stage starts with are neither split nor expanded,
+// eval_line takes them as assignments. A { list; } group is op_group and
+// its text, which is evaluated as a line of its own once it runs.
+//
+// Returns argv in the command arena, NULL after a syntax error. *bg is set to
+// 1 when the command ends with "&" and should run in background.
+char **parseline(char *buf, int *bg, redir **redirs) {
+  char **argv = NULL;
+  size_t argc = 0, cap = 0;
+  char *src = buf;
+  int stage = 0;
+  redir **tail = redirs;
+  // Redirection still waiting for its word.
+  redir *pending = NULL;
+  // Set once the stage has a word which isn't an assignment.
+  int command = 0;
+
+  *redirs = NULL;
+  while (1) {
+    // Trim leading spaces.
+    src += strspn(src, " \t\n");
+    if (*src == '\0')
+      break;
+
+    int c;
+    int fd = -1;
+    size_t digits = strspn(src, "0123456789");
+    if (digits > 0 && digits < 10 &&
+        (src[digits] == '<' || src[digits] == '>')) {
+      fd = atoi(src);
+      src += digits;
+      c = *src++;
+    } else if (strchr("|&<>", *src)) {
+      c = *src++;
+    } else if (!command && pending == NULL && *src == '{' && src[1] != '\0' &&
+               strchr(" \t\n", src[1])) {
+      // A group is op_group followed by its text, which is only parsed once
+      // it runs. Whatever follows the } applies to the whole group.
+      int op;
+      char *body = src + 1, *end = body;
+      do
+        end = list_scan(end, &op) + op_len(op);
+      while (op != 0 && op != OP_CLOSE);
+      if (op == 0) {
+        printf("syntax error: unterminated {\n");
+        return NULL;
+      }
+      end[-1] = '\0';
+      argv = argv_push(argv, &argc, &cap, op_group);
+      argv = argv_push(argv, &argc, &cap, body);
+      command = 1;
+      src = end;
+      continue;
+    } else {
+      char *word, *start = src;
+      split_word = 0;
+      word_assign = !command && pending == NULL;
+      if ((c = next_word(&src, &word)) < 0)
+        return NULL;
+      size_t len = var_name_len(word);
+      int assign = word_assign && len > 0 && word[len] == '=';
+      command |= word_assign && !assign;
+      if (pending != NULL) {
+        if (split_word) {
+          size_t n = 0, ncap = 0;
+          char **fields = push_fields(NULL, &n, &ncap, word);
+          if (n != 1) {
+            printf("ambiguous redirect\n");
+            return NULL;
+          }
+          word = fields[0];
+        }
+        // Quotes and backslashes make the word shorter than its text.
+        if (pending->type == REDIR_HEREDOC &&
+            strlen(word) != (size_t)(src - start) - (c != '\0'))
+          pending->hflags |= HERE_QUOTED;
+        pending->word = word;
+        pending = NULL;
+      } else if (assign) {
+        argv = argv_push(argv, &argc, &cap, word);
+      } else if (split_word) {
+        argv = push_fields(argv, &argc, &cap, word);
+      } else if (glob_len > 0 && !parse_only) {
+        argv = glob_push(argv, &argc, &cap, word);
+      } else {
+        argv = argv_push(argv, &argc, &cap, word);
+      }
+      if (c == '\0')
+        break;
+      if (strchr(" \t\n", c))
+        continue;
+    }
+
+    // c is an operator and src points past it.
+    if (pending != NULL) {
+      printf("syntax error near unexpected token `%c'\n", c);
+      return NULL;
+    }
+    if (c == '|') {
+      argv = argv_push(argv, &argc, &cap, op_pipe);
+      stage++;
+      command = 0;
+      continue;
+    }
+    if (c == '&') {
+      argv = argv_push(argv, &argc, &cap, op_bg);
+      continue;
+    }
+
+    redir *r = arena_alloc(&cmd_arena, sizeof(redir));
+    r->hfd = -1;
+    r->hflags = 0;
+    if (*src == '&') {
+      r->type = REDIR_DUP;
+      src++;
+    } else if (c == '<' && *src == '<') {
+      r->type = REDIR_HEREDOC;
+      if (*++src == '-') {
+        r->hflags = HERE_STRIP;
+        src++;
+      }
+    } else if (c == '>' && *src == '>') {
+      r->type = REDIR_APPEND;
+      src++;
+    } else {
+      r->type = c == '<' ? REDIR_IN : REDIR_OUT;
     }
+    r->fd = fd >= 0 ? fd : c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+    r->word = NULL;
+    r->stage = stage;
+    r->next = NULL;
+    *tail = pending = r;
+    tail = &r->next;
   }
-
-  // If managed to find an empty job slot, use it.
-  if (free_job != NULL) {
-    int jid = ++next_jid;
-    free_job->jid = jid;
-    free_job->pid = pid;
-    free_job->st = st;
-    return jid;
+  if (pending != NULL) {
+    printf("syntax error near unexpected token `newline'\n");
+    return NULL;
   }
+  argv = argv_push(argv, &argc, &cap, NULL);
+  argc--;
 
-  return -1;
+  if ((*bg = argc > 0 && argv[argc - 1] == op_bg) != 0)
+    argv[--argc] = NULL;
+
+  return argv;
 }
 
-// Returns jid when there is a match for the given pid, or -1 otherwise.
-int setjobstat(pid_t pid, Status st) {
-  for (int i = 0; i < MAXJOBS; i++) {
+// Seconds from a to b.
+double elapsed(struct timespec *a, struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+double tv_secs(struct timeval *tv) { return tv->tv_sec + tv->tv_usec / 1e6; }
+
+// jobs [-l]
+// With -l also prints the resources used by each job, CPU times and context
+// switches only cover its processes which terminated already.
+int builtin_jobs(char **argv) {
+  int long_fmt = argv[1] != NULL && !strcmp(argv[1], "-l");
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (int i = 0; i < jobs_used; i++) {
     job *j = &jobs[i];
+    if (j->st == TERMINATED || j->st == UNINIT || j->jid == 0)
+      continue;
 
-    // An entry already exists for this pid;
-    if (j->pid == pid) {
-      j->st = st;
-      return j->jid;
+    if (!long_fmt) {
+      printf("[%d] %d %s %s\n", j->jid, j->pgid, jstatus_str(j->st),
+             cmd_str(j->cmd));
+      continue;
     }
+    printf("[%d] %d %s real %.3fs user %.3fs sys %.3fs maxrss %ldKB "
+           "ctxsw %ld/%ld %s\n",
+           j->jid, j->pgid, jstatus_str(j->st), elapsed(&j->start, &now),
+           tv_secs(&j->utime), tv_secs(&j->stime), j->maxrss, j->nvcsw,
+           j->nivcsw, cmd_str(j->cmd));
   }
-  return -1;
+
+  if (sched_len == 0)
+    return 0;
+
+  // Queued lines follow in the order they'll be admitted in.
+  pending *q = malloc(sched_len * sizeof(pending));
+  if (q == NULL)
+    unix_error("malloc error");
+  memcpy(q, sched_q, sched_len * sizeof(pending));
+  qsort(q, sched_len, sizeof(pending), compare_pending);
+  for (int k = 0; k < sched_len; k++)
+    printf("[q%d] - Queued %s %.*s\n", q[k].qid, pri_names[q[k].pri],
+           (int)strcspn(q[k].text, "\n"), q[k].text);
+  free(q);
+  return 0;
 }
 
-char *jstatus_str(Status st) {
-  switch (st) {
-  case UNINIT:
-    return "UNINIT";
-  case RUNNING:
-    return "RUNNING";
-  case STOPPED:
-    return "STOPPED";
-  case TERMINATED:
-    return "TERMINATED";
+// limit [n] shows or sets how many background jobs may run at the same time,
+// 0 for no limit.
+int builtin_limit(char **argv) {
+  if (argv[1] == NULL) {
+    printf("limit %d running %d queued %d\n", sched_limit, sched_running,
+           sched_len);
+    return 0;
   }
 
-  return "";
+  int n = parse_int(argv[1]);
+  if (n < 0) {
+    printf("limit: %s: invalid limit\n", argv[1]);
+    return 1;
+  }
+  sched_limit = n;
+  sched_admit();
+  return 0;
 }
 
-// Used to forward Ctrl+C/Ctrl+Z to the foreground process group.
-// When a process is running in foreground, it should be set to
-// pgid of that process. When a command is run with &, this should
-// be set to 0 and there will be no signal forwarding.
-static int fg_pid = 0;
-
-void unix_error(char *msg) {
-  fprintf(stderr, "%s: %s\n", msg, strerror(errno));
-  exit(0);
+// Prints what time reports for a command, in the format of bash plus memory
+// and context switches.
+void print_times(double real, struct timeval *utime, struct timeval *stime,
+                 long maxrss, long nvcsw, long nivcsw) {
+  fprintf(stderr,
+          "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ldKB\n"
+          "ctxsw\t%ld voluntary, %ld involuntary\n",
+          real, tv_secs(utime), tv_secs(stime), maxrss, nvcsw, nivcsw);
 }
 
-// handles SIGINT and SIGTSTP.
-void forward_signal(int sig) {
-  // No need to save and restore errno as we don't expected any errors here.
-  sigset_t mask_all, prev_all;
-  if (sigfillset(&mask_all) < 0)
-    unix_error("sigfillset error");
+// Runs a builtin in the shell and reports the times for it, which are the
+// ones of the shell itself for as long as it ran.
+int time_builtin(char **argv) {
+  struct rusage r0, r1;
+  struct timespec t0, t1;
+  getrusage(RUSAGE_SELF, &r0);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
 
-  if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
-    unix_error("sigprocmask block error");
+  int status = builtin_command(argv);
+  fflush(stdout);
 
-  // Only forward if there is a foreground process, otherwise
-  // ignore the signal.
-  if (fg_pid) {
-    printf("[ForwardSignalHandler] forwarding sig %d to %d\n", sig, fg_pid);
-    /* It's tempting to try to handle the error and not fail in case
-     * of ESRCH, but we're making sure that we will only call kill for
-     * valid pids by checking fg_pid, and we want such errors to be deteced.
-     * Addtionally all signals are blocked when this function starts, so it
-     * eliminates the possibility of receiving SIGINT while handling SIGTSTP,
-     * thus we won't end up sending the same signal twice to a process.
-     * Due to implicit signal blocking, receiving the same signal won't
-     * interrupt handling another, even without an explicit sigprocmask. */
-    if (kill(fg_pid, sig) < 0) {
-      unix_error("Forward SIGINT|SIGTSTP error");
-    }
-  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  getrusage(RUSAGE_SELF, &r1);
+  struct timeval utime, stime;
+  timersub(&r1.ru_utime, &r0.ru_utime, &utime);
+  timersub(&r1.ru_stime, &r0.ru_stime, &stime);
+  print_times(elapsed(&t0, &t1), &utime, &stime, r1.ru_maxrss,
+              r1.ru_nvcsw - r0.ru_nvcsw, r1.ru_nivcsw - r0.ru_nivcsw);
+  return status;
+}
 
-  if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
-    unix_error("sigprocmask set mask error");
+// Exit status the way $? reports it, 128 plus the signal for a process
+// terminated by one.
+int exit_code(int status) {
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return WEXITSTATUS(status);
 }
 
-// Reaps children and updates the job status to be one of the following:
-// TERMINATED: when child exists normally or terminated by a signal.
-// STOPPED: when child is suspended with SIGTSTP.
-// RUNNING: when child resumes execution.
-void reap_child(int sig) {
-  sigset_t mask_all, prev_all;
-  if (sigfillset(&mask_all) < 0)
-    unix_error("sigfillset error");
+int builtin_quit(char **argv) { exit(0); }
 
-  if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
-    unix_error("sigprocmask block error");
+int builtin_true(char **argv) { return 0; }
 
-  int status;
-  pid_t pid;
+int builtin_false(char **argv) { return 1; }
 
-  // We want to be informed if children were terminated, stopped or continued
-  // so that we can keep update their status accordingly.
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-    Status st;
-    if (WIFEXITED(status) || WIFSIGNALED(status))
-      st = TERMINATED;
-    else if (WIFSTOPPED(status))
-      st = STOPPED;
-    else // WIFCONTINUED
-      st = RUNNING;
-    printf("[ReapChildHandler] setjobstat %d to %s\n", pid, jstatus_str(st));
-    setjobstat(pid, st);
+// cd [dir|-]
+// Changes to dir, $HOME without arguments or $OLDPWD for -, and updates PWD
+// and OLDPWD.
+int builtin_cd(char **argv) {
+  char *dir = argv[1];
+  int print = 0;
+  if (dir == NULL && (dir = var_get("HOME")) == NULL) {
+    printf("cd: HOME not set\n");
+    return 1;
+  }
+  if (!strcmp(dir, "-")) {
+    if ((dir = var_get("OLDPWD")) == NULL) {
+      printf("cd: OLDPWD not set\n");
+      return 1;
+    }
+    print = 1;
   }
 
-  assert(pid == 0 || errno == ECHILD);
+  char *old = getcwd(NULL, 0);
+  if (chdir(dir) < 0) {
+    printf("cd: %s: %s\n", dir, strerror(errno));
+    free(old);
+    return 1;
+  }
+  if (old != NULL)
+    var_set("OLDPWD", 6, old, 1);
+  free(old);
 
-  if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
-    unix_error("sigprocmask set mask error");
+  char *cwd = getcwd(NULL, 0);
+  if (cwd != NULL) {
+    var_set("PWD", 3, cwd, 1);
+    if (print)
+      printf("%s\n", cwd);
+  }
+  free(cwd);
+  return 0;
 }
 
-pid_t Fork() {
-  pid_t pid;
-
-  if ((pid = fork()) < 0)
-    unix_error("Fork error");
-  return pid;
+int builtin_pwd(char **argv) {
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    printf("pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  printf("%s\n", cwd);
+  free(cwd);
+  return 0;
 }
 
-int main() {
-  sigset_t mask_one, prev_one;
-  if (sigemptyset(&mask_one) < 0)
-    unix_error("sigempty error");
-  if (sigaddset(&mask_one, SIGCHLD) < 0)
-    unix_error("sigaddset error");
+// echo [-n] [arg ...]
+int builtin_echo(char **argv) {
+  int k = 1, newline = 1;
+  if (argv[k] != NULL && !strcmp(argv[k], "-n")) {
+    newline = 0;
+    k++;
+  }
+  for (; argv[k] != NULL; k++) {
+    fputs(argv[k], stdout);
+    if (argv[k + 1] != NULL)
+      putchar(' ');
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
 
-  if (signal(SIGINT, forward_signal) == SIG_ERR) {
-    unix_error("Install SIGINT handler error");
+// Prints the escape sequence at s, returns the number of chars it took.
+int print_escape(char *s) {
+  static char *from = "abfnrtv\\\"";
+  static char *to = "\a\b\f\n\r\t\v\\\"";
+  char *c;
+  if (*s != '\0' && (c = strchr(from, *s)) != NULL) {
+    putchar(to[c - from]);
+    return 1;
   }
-  if (signal(SIGTSTP, forward_signal) == SIG_ERR) {
-    unix_error("Install SIGTSTP handler error");
+  if (*s >= '0' && *s <= '7') {
+    int n = 0, v = 0;
+    for (; n < 3 && s[n] >= '0' && s[n] <= '7'; n++)
+      v = v * 8 + s[n] - '0';
+    putchar(v);
+    return n;
   }
-  if (signal(SIGCHLD, reap_child) == SIG_ERR) {
-    unix_error("Install SIGCHLD handler error");
+  putchar('\\');
+  return 0;
+}
+
+// printf format [arg ...]
+// Knows the conversions d, i, u, o, x, X, c, s and %% with flags, width and
+// precision, and the escapes of C. The format is reused as long as there are
+// arguments left, missing ones are empty or 0.
+int builtin_printf(char **argv) {
+  if (argv[1] == NULL) {
+    printf("printf: usage: printf format [arguments]\n");
+    return 1;
   }
 
-  char cmdline[MAXLINE];
-  while (1) {
-    printf("> ");
-    fgets(cmdline, MAXLINE, stdin);
-    // Ctrl+D sends EOF signal.
-    if (feof(stdin))
-      exit(0);
+  char *fmt = argv[1];
+  char **args = &argv[2];
+  int status = 0;
+  do {
+    char **start = args;
+    for (char *p = fmt; *p != '\0'; p++) {
+      if (*p == '\\') {
+        p += print_escape(p + 1);
+        continue;
+      }
+      if (*p != '%') {
+        putchar(*p);
+        continue;
+      }
+      if (p[1] == '%') {
+        putchar('%');
+        p++;
+        continue;
+      }
 
-    // Block SIGCHLD before eval. In the next loop iter when we get to fgets
-    // SIGCHLD handler will get a chance to run. We don't have to block all
-    // signals because we still want to receive SIGINT and SIGTSTP and forward
-    // them to the foreground process.
-    if (sigprocmask(SIG_BLOCK, &mask_one, &prev_one) < 0)
-      unix_error("sigprocmask block error");
+      // Copy the spec, leaving room for the ll length modifier.
+      char spec[32];
+      size_t n = strspn(p + 1, "-+ #0123456789.");
+      char conv = p[1 + n];
+      if (n > sizeof(spec) - 5 || conv == '\0' || !strchr("diuoxXcs", conv)) {
+        printf("printf: %.*s: invalid format\n", (int)n + 2, p);
+        return 1;
+      }
+      memcpy(spec, p, n + 1);
+      spec[n + 1] = '\0';
+      p += n + 1;
 
-    eval(cmdline);
+      char *arg = *args != NULL ? *args++ : NULL;
+      if (conv == 's' || conv == 'c') {
+        strcat(spec, conv == 's' ? "s" : "c");
+        if (conv == 's')
+          printf(spec, arg != NULL ? arg : "");
+        else
+          printf(spec, arg != NULL ? arg[0] : '\0');
+        continue;
+      }
 
-    if (sigprocmask(SIG_SETMASK, &prev_one, NULL) < 0)
-      unix_error("sigprocmask set mask error");
+      char *end = "";
+      long long v = 0;
+      if (arg != NULL) {
+        errno = 0;
+        if (conv == 'd' || conv == 'i')
+          v = strtoll(arg, &end, 0);
+        else
+          v = (long long)strtoull(arg, &end, 0);
+        if (*end != '\0' || errno != 0) {
+          printf("printf: %s: invalid number\n", arg);
+          status = 1;
+        }
+      }
+      size_t k = strlen(spec);
+      spec[k++] = 'l';
+      spec[k++] = 'l';
+      spec[k++] = conv;
+      spec[k] = '\0';
+      printf(spec, v);
+    }
+    // A format without conversions is only printed once.
+    if (args == start)
+      break;
+  } while (*args != NULL);
+  return status;
+}
+
+// Parses an integer operand of test, prints an error and returns -1 if it
+// isn't one.
+int test_int(char *s, long long *v) {
+  char *end;
+  errno = 0;
+  *v = strtoll(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || errno != 0) {
+    printf("test: %s: integer expression expected\n", s);
+    return -1;
   }
+  return 0;
 }
 
-void eval(char *cmdline) {
-  char *argv[MAXARGS];
-  char buf[MAXLINE];
-  int bg;
-  pid_t pid;
+int test_unary(char *op, char *arg) {
+  struct stat sb;
+  switch (op[1]) {
+  case 'n':
+    return arg[0] != '\0';
+  case 'z':
+    return arg[0] == '\0';
+  case 'r':
+    return access(arg, R_OK) == 0;
+  case 'w':
+    return access(arg, W_OK) == 0;
+  case 'x':
+    return access(arg, X_OK) == 0;
+  case 't':
+    return isatty(parse_int(arg));
+  case 'h':
+  case 'L':
+    return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+  }
+  if (stat(arg, &sb) < 0)
+    return 0;
+  switch (op[1]) {
+  case 'e':
+    return 1;
+  case 'f':
+    return S_ISREG(sb.st_mode);
+  case 'd':
+    return S_ISDIR(sb.st_mode);
+  case 's':
+    return sb.st_size > 0;
+  case 'p':
+    return S_ISFIFO(sb.st_mode);
+  case 'S':
+    return S_ISSOCK(sb.st_mode);
+  case 'b':
+    return S_ISBLK(sb.st_mode);
+  case 'c':
+    return S_ISCHR(sb.st_mode);
+  }
+  return 0;
+}
 
-  strcpy(buf, cmdline);
-  bg = parseline(buf, argv);
+// Evaluates the n operands of test. Returns 1 for true, 0 for false and -1
+// on errors.
+int test_eval(char **args, int n) {
+  if (n == 0)
+    return 0;
+  if (!strcmp(args[0], "!")) {
+    int r = test_eval(args + 1, n - 1);
+    return r < 0 ? r : !r;
+  }
+  if (n == 1)
+    return args[0][0] != '\0';
+  if (n == 2) {
+    if (args[0][0] == '-' && args[0][1] != '\0' && args[0][2] == '\0' &&
+        strchr("nzrwxthLefdspSbc", args[0][1]))
+      return test_unary(args[0], args[1]);
+    printf("test: %s: unary operator expected\n", args[0]);
+    return -1;
+  }
+  if (n == 3) {
+    char *op = args[1];
+    if (!strcmp(op, "=") || !strcmp(op, "=="))
+      return !strcmp(args[0], args[2]);
+    if (!strcmp(op, "!="))
+      return strcmp(args[0], args[2]) != 0;
 
-  if (argv[0] == NULL) /* Ignore empty commands. */
-    return;
-  if (!strcmp(argv[0], "&")) /* Ignore singleton '&'. */
-    return;
+    static char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    int k = 0;
+    while (ops[k] != NULL && strcmp(ops[k], op))
+      k++;
+    if (ops[k] == NULL) {
+      printf("test: %s: binary operator expected\n", op);
+      return -1;
+    }
+    long long a, b;
+    if (test_int(args[0], &a) < 0 || test_int(args[2], &b) < 0)
+      return -1;
+    int r[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    return r[k];
+  }
+  printf("test: too many arguments\n");
+  return -1;
+}
 
-  if (!strcmp(argv[0], "fg")) {
-    if (argv[1] == NULL) {
-      return;
+// test expr, [ expr ]
+// Exits with 0 if expr is true, 1 if it's false and 2 on errors.
+int builtin_test(char **argv) {
+  int n = 0;
+  while (argv[n + 1] != NULL)
+    n++;
+  if (!strcmp(argv[0], "[")) {
+    if (n == 0 || strcmp(argv[n], "]")) {
+      printf("[: missing `]'\n");
+      return 2;
     }
+    n--;
+  }
+  int r = test_eval(&argv[1], n);
+  return r < 0 ? 2 : !r;
+}
 
-    pid_t stp_pid;
-    char *id_part = argv[1];
+// export [name=value ...]
+// Puts variables in the environment of the commands the shell runs, setting
+// them first when a value is given. Prints the environment without arguments.
+int builtin_export(char **argv) {
+  if (argv[1] == NULL || !strcmp(argv[1], "-p")) {
+    for (char **e = var_environ(); *e != NULL; e++)
+      printf("export %s\n", *e);
+    return 0;
+  }
 
-    if ((stp_pid = parse_pid(id_part)) > 0) {
-      // stp_pid is the pid of a stopped background process which now
-      // needs to resume and run in foreground.
-      if (kill(stp_pid, SIGCONT) < 0) {
-        unix_error("Forward SIGCONT error");
-      }
-      run_fg(stp_pid);
-      return;
+  int status = 0;
+  for (int k = 1; argv[k] != NULL; k++) {
+    size_t len = var_name_len(argv[k]);
+    if (len == 0 || (argv[k][len] != '\0' && argv[k][len] != '=')) {
+      printf("export: %s: not a valid identifier\n", argv[k]);
+      status = 1;
+      continue;
     }
+    var *v = var_find(argv[k], len);
+    if (argv[k][len] == '=')
+      var_set(argv[k], len, argv[k] + len + 1, 1);
+    else if (v != NULL && !v->exported)
+      v->exported = env_stale = 1;
+  }
+  return status;
+}
 
-    printf("%s: No such process\n", argv[1]);
-    return;
+// unset name ...
+int builtin_unset(char **argv) {
+  for (int k = 1; argv[k] != NULL; k++)
+    var_unset(argv[k], strlen(argv[k]));
+  return 0;
+}
+
+// Returns 1 while any job runs in background.
+int have_running_jobs() {
+  for (int i = 0; i < jobs_used; i++) {
+    if (jobs[i].st == RUNNING)
+      return 1;
   }
+  return 0;
+}
 
-  if (!strcmp(argv[0], "bg")) {
-    if (argv[1] == NULL) {
-      return;
+// Slot of the job wait is given as %jid or the pid of one of its processes,
+// -1 if there's none. Unlike parse_job it finds the terminated ones which
+// were kept for wait.
+int wait_find(char *s) {
+  if (*s == '%') {
+    int jid = parse_int(s + 1);
+    return jid > 0 ? findjob_jid(jid) : -1;
+  }
+  int pid = parse_int(s);
+  if (pid <= 0)
+    return -1;
+  int i = findjob_pid(pid);
+  for (int d = jobs_done; i == -1 && d != -1; d = jobs[d].next)
+    for (int p = jobs[d].procs; p != -1; p = procs[p].sibling)
+      if (procs[p].pid == pid)
+        i = d;
+  return i;
+}
+
+static struct pollfd *wait_fds = NULL;
+static int wait_fds_cap = 0;
+
+// Sleeps in one poll until a process of the n jobs in v terminates, or a
+// signal comes, and updates the job table. Each process gets a pidfd the
+// first time, kept until it's reaped. In the default mode SIGCHLD stays
+// blocked, so other children can't wake the shell, and mask is what's let
+// through while it sleeps: SIGINT and SIGALRM. In event mode sig_fd is
+// polled with them. Without pidfds it sleeps until any child changes state.
+//
+// A process which stops doesn't make its pidfd readable, so in the default
+// mode a job which stops meanwhile is only seen once something else wakes
+// the shell, e.g. Ctrl+C. In event mode its SIGCHLD wakes it through sig_fd.
+void wait_sleep(int *v, int n, sigset_t *mask) {
+  int nfds = 0, all = 0;
+  for (int k = 0; k < n; k++)
+    for (int p = jobs[v[k]].procs; p != -1; p = procs[p].sibling)
+      nfds += procs[p].st != TERMINATED;
+  if (nfds + 1 > wait_fds_cap) {
+    wait_fds_cap = 2 * (nfds + 1);
+    if ((wait_fds = realloc(wait_fds, wait_fds_cap * sizeof(struct pollfd))) ==
+        NULL)
+      unix_error("realloc error");
+  }
+
+  nfds = 0;
+  if (event_mode)
+    wait_fds[nfds++] = (struct pollfd){.fd = sig_fd, .events = POLLIN};
+  for (int k = 0; k < n && !all; k++) {
+    for (int p = jobs[v[k]].procs; p != -1 && !all; p = procs[p].sibling) {
+      if (procs[p].st == TERMINATED)
+        continue;
+      if (procs[p].pidfd < 0)
+        procs[p].pidfd = syscall(SYS_pidfd_open, procs[p].pid, 0);
+      all = procs[p].pidfd < 0;
+      wait_fds[nfds++] =
+          (struct pollfd){.fd = procs[p].pidfd, .events = POLLIN};
     }
+  }
+  sigset_t sleep_mask = *mask;
+  if (all) {
+    nfds = event_mode;
+    sigdelset(&sleep_mask, SIGCHLD);
+  }
 
-    pid_t stp_pid;
-    char *id_part = argv[1];
+  blocked_end();
+  int ready = event_mode ? poll(wait_fds, nfds, -1)
+                         : ppoll(wait_fds, nfds, NULL, &sleep_mask);
+  if (ready < 0 && errno != EINTR)
+    unix_error("poll error");
+  blocked_begin();
+  if (event_mode && wait_fds[0].revents)
+    handle_signals();
+  // SIGCHLD is blocked, or its handler ran already and this finds nothing.
+  if (!event_mode && ready > 0)
+    reap_children();
 
-    if ((stp_pid = parse_pid(id_part)) > 0) {
-      // stp_pid is the pid of a stopped background process which now
-      // needs to resume and run in background.
-      //
-      // If the process already terminated, we should have received SIGCHLD for
-      // it before the current run of eval which will change its status, thus
-      // parse_pid will return -1.
-      if (kill(stp_pid, SIGCONT) < 0) {
-        unix_error("Forward SIGCONT error");
+  for (int k = 0; k < n; k++)
+    for (int p = jobs[v[k]].procs; p != -1; p = procs[p].sibling)
+      if (procs[p].st == TERMINATED && procs[p].pidfd >= 0) {
+        close(procs[p].pidfd);
+        procs[p].pidfd = -1;
       }
-      run_bg(stp_pid, "");
-      return;
-    }
+  sched_admit();
+  log_flush();
+}
 
-    printf("%s: No such process\n", argv[1]);
-    return;
+// Exit status wait returns for the job in slot i, which terminated or stopped.
+int wait_status(int i) {
+  if (jobs[i].st == STOPPED)
+    return exit_code(job_status(i));
+  // It's not reported at the prompt either then.
+  jobs[i].unwaited = jobs[i].bg = 0;
+  return job_exit(i);
+}
+
+// wait [-n] [%jid|pid ...]
+// Waits for the given jobs to terminate, or for all background jobs without
+// any, and exits with the status of the last one given, 0 without any. With
+// -n it waits for the first of them to terminate and exits with its status,
+// 127 if there's none. Jobs which terminated before are found with their
+// status, and a job found stopped counts as done, see wait_sleep for when
+// that is. Ctrl+C stops waiting.
+int builtin_wait(char **argv) {
+  // A stage of a pipeline has no children of its own to wait for.
+  if (getpid() != shell_pid)
+    return 0;
+  // The server can't wait for one client's jobs while serving the others.
+  if (server_client >= 0) {
+    printf("wait: not available in server mode\n");
+    return 1;
   }
 
-  if (!builtin_command(argv)) {
-    /* START - CHILD PROCESS */
-    if ((pid = Fork()) == 0) {
-      // Set process group ID of this job to the pid of child.
-      if (setpgid(0, 0) < 0) {
-        unix_error("setpgid error");
+  int first = argv[1] != NULL && !strcmp(argv[1], "-n");
+  char **args = &argv[1 + first];
+  int nargs = 0;
+  while (args[nargs] != NULL)
+    nargs++;
+
+  int status = 0, n = 0, cap = nargs;
+  int *v = arena_alloc(&cmd_arena, nargs * sizeof(int));
+  for (int k = 0; k < nargs; k++) {
+    if ((v[n] = wait_find(args[k])) < 0) {
+      printf("wait: %s: No such job\n", args[k]);
+      status = 127;
+    } else {
+      n++;
+    }
+  }
+  if (nargs > 0 && n == 0)
+    return 127;
+
+  // SIGINT is only let through while the shell sleeps, so one which comes
+  // right before can't be missed.
+  sigset_t mask, prev;
+  if (sigemptyset(&mask) < 0 || sigaddset(&mask, SIGINT) < 0 ||
+      sigprocmask(SIG_BLOCK, &mask, &prev) < 0)
+    unix_error("sigprocmask block error");
+  mask = prev;
+  sigdelset(&mask, SIGINT);
+  sigdelset(&mask, SIGALRM);
+
+  // What was printed before may be what the jobs are waited for after.
+  fflush(stdout);
+  sigint_pending = 0;
+  while (!sigint_pending) {
+    // Without jobs given it's every background job, which includes the
+    // queued ones admitted while waiting.
+    if (nargs == 0) {
+      sched_admit();
+      // Only grows with the job table, not on every wakeup.
+      if (jobs_used > cap) {
+        cap = 2 * jobs_used;
+        v = arena_alloc(&cmd_arena, cap * sizeof(int));
       }
-      if (execve(argv[0], argv, environ) < 0) {
-        printf("%s: Command not found.\n", argv[0]);
-        exit(0);
+      n = 0;
+      for (int i = 0; i < jobs_used; i++)
+        if (jobs[i].st != UNINIT && jobs[i].unwaited)
+          v[n++] = i;
+      if (n == 0 && sched_len == 0) {
+        status = first ? 127 : 0;
+        break;
       }
     }
-    /* END - CHILD PROCESS */
 
-    if (!bg) {
-      run_fg(pid);
-    } else {
-      run_bg(pid, cmdline);
+    int done = -1, stopped = -1, live = 0;
+    for (int k = 0; k < n; k++) {
+      if (jobs[v[k]].st == RUNNING)
+        live++;
+      else if (jobs[v[k]].st == TERMINATED && done < 0)
+        done = v[k];
+      else if (jobs[v[k]].st == STOPPED && stopped < 0)
+        stopped = v[k];
     }
-    return;
+    if (first && done < 0 && live == 0)
+      done = stopped;
+    if (first && done >= 0) {
+      status = wait_status(done);
+      break;
+    }
+    if (!first && live == 0 && (nargs > 0 || sched_len == 0)) {
+      for (int k = 0; k < n; k++)
+        status = wait_status(v[k]);
+      if (nargs == 0)
+        status = 0;
+      break;
+    }
+    wait_sleep(v, n, &mask);
   }
+  if (sigint_pending)
+    status = 128 + SIGINT;
 
-  return;
+  if (sigprocmask(SIG_SETMASK, &prev, NULL) < 0)
+    unix_error("sigprocmask set mask error");
+  return status;
 }
 
-int parseline(char *buf, char **argv) {
-  char *delim;
-  int argc;
-  int bg;
+typedef struct {
+  char *name;
+  int (*fn)(char **argv);
+  Builtin kind;
+} builtin_def;
 
-  buf[strlen(buf) - 1] = ' ';
-  // Trim leading spaces.
-  while (*buf && (*buf == ' '))
-    buf++;
+static builtin_def builtins[] = {
+    {"quit", builtin_quit, BUILTIN_SHELL},
+    {"jobs", builtin_jobs, BUILTIN_SHELL},
+    {"hash", builtin_hash, BUILTIN_SHELL},
+    {"spawn", builtin_spawn, BUILTIN_SHELL},
+    {"pipesz", builtin_pipesz, BUILTIN_SHELL},
+    {"place", builtin_place, BUILTIN_SHELL},
+    {"trace", builtin_trace, BUILTIN_SHELL},
+    {"log", builtin_log, BUILTIN_SHELL},
+    {"cd", builtin_cd, BUILTIN_SHELL},
+    {"pwd", builtin_pwd, BUILTIN_SHELL},
+    {"echo", builtin_echo, BUILTIN_SHELL},
+    {"printf", builtin_printf, BUILTIN_SHELL},
+    {"test", builtin_test, BUILTIN_SHELL},
+    {"[", builtin_test, BUILTIN_SHELL},
+    {"true", builtin_true, BUILTIN_SHELL},
+    {"false", builtin_false, BUILTIN_SHELL},
+    {"export", builtin_export, BUILTIN_SHELL},
+    {"unset", builtin_unset, BUILTIN_SHELL},
+    {"wait", builtin_wait, BUILTIN_SHELL},
+    {"limit", builtin_limit, BUILTIN_SHELL},
+    {"stats", builtin_stats, BUILTIN_SHELL},
+    {"history", builtin_history, BUILTIN_SHELL},
+    {"parallel", builtin_parallel, BUILTIN_JOB},
+};
 
-  argc = 0;
-  while ((delim = strchr(buf, ' '))) {
-    argv[argc++] = buf;
-    *delim = '\0';
-    buf = delim + 1;
-    while (*buf && (*buf == ' '))
-      buf++;
-  }
-  argv[argc] = NULL;
+// builtins hashed by name with hash_str and linear probing, the table is
+// sparse enough for most names to be found with a single strcmp.
+#define BUILTIN_TAB 64
 
-  if (argc == 0)
-    return 1;
+static builtin_def *builtin_tab[BUILTIN_TAB];
 
-  if ((bg = (*argv[argc - 1] == '&')) != 0)
-    argv[--argc] = NULL;
+// Name of builtin k, NULL past the last one.
+char *builtin_name(size_t k) {
+  return k < sizeof(builtins) / sizeof(builtins[0]) ? builtins[k].name : NULL;
+}
+
+builtin_def *find_builtin(char *name) {
+  static int ready = 0;
+  if (!ready) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+      unsigned h = hash_str(builtins[i].name) % BUILTIN_TAB;
+      while (builtin_tab[h] != NULL)
+        h = (h + 1) % BUILTIN_TAB;
+      builtin_tab[h] = &builtins[i];
+    }
+    ready = 1;
+  }
 
-  return bg;
+  for (unsigned h = hash_str(name) % BUILTIN_TAB; builtin_tab[h] != NULL;
+       h = (h + 1) % BUILTIN_TAB) {
+    if (!strcmp(builtin_tab[h]->name, name))
+      return builtin_tab[h];
+  }
+  return NULL;
 }
 
-// Return value is -1, 0 or a positive integers.
-// 1: it was a built-in command and handled already.
-// 0: it was not build-in command.
+// Runs the builtin argv[0], or the group in a child of its own, and returns
+// its exit status.
 int builtin_command(char **argv) {
-  // strcmp return 0 if strings are equal.
-  if (!strcmp(argv[0], "quit"))
-    exit(0);
-
-  if (!strcmp(argv[0], "jobs")) {
-    for (int i = 0; i < MAXJOBS; i++) {
-      job j = jobs[i];
-      if (j.st != TERMINATED && j.st != UNINIT) {
-        printf("[%d] %d %s\n", j.jid, j.pid, jstatus_str(j.st));
-      }
-    }
-    return 1;
+  if (argv[0] == op_group) {
+    eval(argv[1]);
+    return last_status;
   }
+  return find_builtin(argv[0])->fn(argv);
+}
 
-  return 0;
+// Returns BUILTIN_SHELL if name is a builtin which runs in the shell itself
+// when it isn't part of a pipeline, BUILTIN_JOB if it always needs a child of
+// its own and NOT_BUILTIN otherwise.
+Builtin is_builtin(char *name) {
+  builtin_def *b = find_builtin(name);
+  return b != NULL ? b->kind : NOT_BUILTIN;
 }
 
 // Assuming s (argv) has at least two elements, it performs no bound checking.
-// Returns values are -1 or a value greater than 0.
-// >0: pid of a process which should run in foreground.
+// s is either %jid or the pid of one of the processes of a job.
+// Returns values are -1 or a value greater or equal to 0.
+// >=0: slot of the job which should be resumed.
 // -1: if there were any errors parsing pid pr if the job is uninit or has
 //     has already finished.
-pid_t parse_pid(char *s) {
+int parse_job(char *s) {
+  int i;
   if (*s == '%') {
-    // parse jid after %, and find a correspoding pid for it.
+    // parse jid after %, and find a correspoding job for it.
     int jid = parse_int(++s);
 
-    // Avoid matching against the default value (0) in jobs array.
+    // jids start from 1, so 0 never matches a job.
     // And return early in case of errors (-1) in parse_int.
     if (jid <= 0)
       return -1;
 
-    // check status is not terminated or uninit.
-    for (int i = 0; i < MAXJOBS; i++) {
-      job *j = &jobs[i];
-      if (j->st == TERMINATED && j->st == UNINIT)
-        return -1;
-      if (j->jid == jid) {
-        return jobs[i].pid;
-      }
-    }
-
     // Not being able to find a match for a jid is considered error.
-    return -1;
+    i = findjob_jid(jid);
+  } else {
+    // If there's no such pid in jobs, return error.
+    int pid = parse_int(s);
+    i = pid <= 0 ? -1 : findjob_pid(pid);
   }
 
-  int pid = parse_int(s);
-  for (int i = 0; i < MAXJOBS; i++) {
-    job *j = &jobs[i];
-    if (j->st == TERMINATED && j->st == UNINIT)
-      return -1;
-    if (j->pid == pid)
-      return pid;
-  }
-
-  // If there's no such pid in jobs, return error.
-  return -1;
+  if (i == -1 || jobs[i].st == TERMINATED)
+    return -1;
+  return i;
 }
 
 int parse_int(char *str) {
@@ -417,61 +7948,130 @@ int parse_int(char *str) {
   return val;
 }
 
-void run_fg(pid_t pid) {
-  // Enable signal forwarding when FOREGROUND.
-  fg_pid = pid;
+// Parses a number of seconds which may have a fraction, returns -1 if str
+// isn't one.
+double parse_secs(char *str) {
+  if (str == NULL)
+    return -1;
+  char *endptr;
+  double val = strtod(str, &endptr);
+  if (endptr == str || *endptr != '\0' || !(val >= 0 && val < 1e9))
+    return -1;
+  return val;
+}
 
-  /*
-   * Because we explicitly wait for this pid, if another background process
-   * terminates we won't mistakenly reap it here instead of running this child
-   * process to completion.
-   */
-  int status;
-  if (waitpid(pid, &status, WUNTRACED) < 0)
-    unix_error("waitpid error");
+void run_fg(int i) {
+  // Enable signal forwarding when FOREGROUND. With job control the signals
+  // go to the job from the terminal instead.
+  fg_pid = jobs[i].pgid;
+  jobs[i].bg = 0;
+  trace_event(EV_FG_BEGIN, shell_pid, fg_pid, 0);
+  tty_give(i);
 
-  if (WIFSIGNALED(status)) {
-    int jid;
-    if ((jid = setjobstat(pid, TERMINATED)) != -1)
-      sprintf(sigbuf, "Job [%d] %d terminated by signal", jid, pid);
-    else
-      sprintf(sigbuf, "Job [-] %d terminated by signal", pid);
-    psignal(WTERMSIG(status), sigbuf);
-  } else if (WIFSTOPPED(status)) {
-    fg_pid = 0;
-
-    int jid;
-    if ((jid = addjob(pid, STOPPED)) < 0) {
-      printf("Could not add new job\n");
-      exit(0);
+  if (event_mode) {
+    // Keep serving the signalfd, so Ctrl+C/Ctrl+Z are still forwarded and
+    // background children are reaped while the foreground job runs.
+    while (jobs[i].st == RUNNING)
+      wait_for_child();
+  } else {
+    /*
+     * Because we explicitly wait for this process group, if another
+     * background process terminates we won't mistakenly reap it here instead
+     * of running this job to completion.
+     */
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    sigset_t alrm;
+    if (sigemptyset(&alrm) < 0 || sigaddset(&alrm, SIGALRM) < 0)
+      unix_error("sigset error");
+    pid_t target = -jobs[i].pgid;
+    while (jobs[i].st == RUNNING) {
+      // Deadlines, of this job or background ones, and stats dumps may come
+      // due while waiting.
+      int tmo = tmo_len > 0 || stats_fd >= 0;
+      if (tmo && sigprocmask(SIG_UNBLOCK, &alrm, NULL) < 0)
+        unix_error("sigprocmask unblock error");
+      pid = wait4(target, &status, WUNTRACED, &ru);
+      if (tmo && sigprocmask(SIG_BLOCK, &alrm, NULL) < 0)
+        unix_error("sigprocmask block error");
+      if (pid < 0) {
+        if (errno == EINTR)
+          continue;
+        // Processes which moved to a process group of their own, as
+        // timeout(1) does, are waited for one by one.
+        if (errno != ECHILD || (target = live_proc(i)) == 0)
+          unix_error("wait4 error");
+        continue;
+      }
+      int j;
+      if (WIFSTOPPED(status))
+        j = setjobstat(pid, STOPPED, status, NULL);
+      else
+        j = setjobstat(pid, TERMINATED, status, &ru);
+      trace_status(j, pid, status);
     }
+  }
 
-    // For children terminated by Ctrl+C, clear fg_pid so we avoid sending the
-    // same signal again to a terminated process. Since the child is already
-    // terminated the shell will crash.
-    //
-    // For children stopped by Ctrl+Z, clear fg_pid so we avoid sending SIGTSTP
-    // several times to an already stopped process, and also add them to jobs
-    // list as STOPPED. The shell won't crash but it's not necessary to send
-    // that signal over and over again if the child is already suspended.
-    //
-    // For children that terminate normally also we need to clear fg_pid to
-    // avoid sending signals to a terminated process.
-    fg_pid = 0;
+  // For children terminated by Ctrl+C, clear fg_pid so we avoid sending the
+  // same signal again to a terminated process. Since the child is already
+  // terminated the shell will crash.
+  //
+  // For children stopped by Ctrl+Z, clear fg_pid so we avoid sending SIGTSTP
+  // several times to an already stopped process, and also add them to jobs
+  // list as STOPPED. The shell won't crash but it's not necessary to send
+  // that signal over and over again if the child is already suspended.
+  //
+  // For children that terminate normally also we need to clear fg_pid to
+  // avoid sending signals to a terminated process.
+  fg_pid = 0;
+  tty_take(i);
+  log_flush();
 
-    sprintf(sigbuf, "Job [%d] %d stopped by signal", jid, pid);
-    psignal(WSTOPSIG(status), sigbuf);
+  pid_t pgid = jobs[i].pgid;
+  int jid = jobs[i].jid;
+  trace_event(EV_FG_END, shell_pid, pgid, 0);
+  if (jobs[i].st == TERMINATED) {
+    int status = job_status(i);
+    last_status = job_exit(i);
+    if (jobs[i].expired) {
+      if (jid != 0)
+        fprintf(stderr, "Job [%d] %d timed out\n", jid, pgid);
+      else
+        fprintf(stderr, "Job [-] %d timed out\n", pgid);
+    } else if (WIFSIGNALED(status)) {
+      list_break = WTERMSIG(status) == SIGINT;
+      if (jid != 0)
+        sprintf(sigbuf, "Job [%d] %d terminated by signal", jid, pgid);
+      else
+        sprintf(sigbuf, "Job [-] %d terminated by signal", pgid);
+      psignal(WTERMSIG(status), sigbuf);
+    }
+    return;
   }
+
+  // Stopped, report the signal that stopped one of its processes.
+  int p = jobs[i].procs;
+  while (procs[p].st != STOPPED)
+    p = procs[p].sibling;
+  last_status = exit_code(procs[p].status);
+  if (jid == 0)
+    jid = index_jid(i);
+  sprintf(sigbuf, "Job [%d] %d stopped by signal", jid, pgid);
+  psignal(WSTOPSIG(procs[p].status), sigbuf);
 }
 
-void run_bg(pid_t pid, char *cmd) {
+void run_bg(int i) {
   // Disable signal forwarding when BACKGROUND.
   fg_pid = 0;
+  jobs[i].bg = 1;
+  jobs[i].unwaited = 1;
 
-  int jid;
-  if ((jid = addjob(pid, RUNNING)) < 0) {
-    printf("Could not add new job\n");
-    exit(0);
-  }
-  printf("[%d] %d %s\n", jid, pid, cmd);
+  int jid = jobs[i].jid;
+  if (jid == 0)
+    jid = index_jid(i);
+  last_status = 0;
+  // Clients of the server are answered with the jid instead.
+  if (server_client < 0)
+    printf("[%d] %d %s\n", jid, jobs[i].pgid, cmd_str(jobs[i].cmd));
 }
@@ -0,0 +1,552 @@
+// Benchmark driver for ash. Runs scripted workloads through the shell, in
+// every spawn mode with both the handler and the event loop, and appends one
+// JSON object per result to a file for regression tracking:
+//
+//   {"workload":"true","spawn":"posix","loop":"handler",
+//    "metric":"cmds_per_sec","value":1234.5}
+//
+//   gcc -O2 -o ash 826.c
+//   gcc -O2 -o inf_loop inf_loop.c
+//   gcc -O2 -o bench bench.c
+//   ./bench [-s ./ash] [-i ./inf_loop] [-o bench.jsonl] [-n count]
+//           [-m fork|posix|zygote] [-l handler|event]
+//
+// Workloads:
+//
+//   true     count runs of /bin/true, commands per second.
+//   exec     probes run one at a time. exec_us is the time from writing the
+//            line to the shell until the command's main runs, so it covers
+//            reading and parsing the line besides fork and exec. reap_us is
+//            the time from the probe exiting until the shell recorded its
+//            status, taken from the job trace of the shell (-t, trace dump).
+//   storm    100 and 1000 background probes which all exit at once, once the
+//            driver closes the pipe they wait on. reap_us as above, drain_ms
+//            until wait returned.
+//   jobs     the jobs builtin with 10, 100 and 1000 live inf_loop jobs, per
+//            call and next to a builtin which does nothing.
+//
+// The driver runs itself as the probe, bench probe start|gate. It writes a
+// record when it starts and one right before it exits to fd 3, whose
+// timestamps are compared against the ones the shell traced.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Descriptors the shell, and so every command it runs, inherits.
+#define REC_FD 3
+#define TRACE_FD 4
+#define GATE_FD 5
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void die(char *msg) {
+  fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+  exit(1);
+}
+
+void probe_record(char type) {
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "%c %d %lld\n", type, getpid(), now_ns());
+  // A short record would garble the ones of other probes, as they all
+  // append to the same file.
+  if (write(REC_FD, buf, n) != n)
+    die("write error");
+}
+
+// bench probe start exits right away, bench probe gate once GATE_FD is at
+// EOF.
+int probe(char *kind) {
+  probe_record('S');
+  if (!strcmp(kind, "gate")) {
+    char c;
+    ssize_t n;
+    while ((n = read(GATE_FD, &c, 1)) > 0 || (n < 0 && errno == EINTR))
+      ;
+  }
+  probe_record('X');
+  return 0;
+}
+
+typedef struct {
+  char type;
+  pid_t pid;
+  long long ns;
+} record;
+
+int compare_record(const void *a, const void *b) {
+  const record *x = a, *y = b;
+  return x->pid != y->pid ? (x->pid < y->pid ? -1 : 1) : x->type - y->type;
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// A shell being driven. Its stdout is read line by line, for the marks sent
+// to synchronize with it and the pgids of background jobs it reports.
+typedef struct {
+  pid_t pid;
+  int in;
+  int out;
+  char buf[65536];
+  size_t len;
+  int marks;
+  int seen;
+  pid_t *bg;
+  int nbg;
+  int bgcap;
+  int rec;
+  int trace;
+  int gate;
+} session;
+
+void sh_line(session *s, char *line) {
+  int jid, mark;
+  pid_t pid;
+  if (sscanf(line, "@mark %d", &mark) == 1) {
+    s->seen = mark;
+  } else if (sscanf(line, "[%d] %d", &jid, &pid) == 2) {
+    if (s->nbg == s->bgcap) {
+      s->bgcap = s->bgcap ? s->bgcap * 2 : 256;
+      if ((s->bg = realloc(s->bg, s->bgcap * sizeof(pid_t))) == NULL)
+        die("realloc error");
+    }
+    s->bg[s->nbg++] = pid;
+  }
+}
+
+// Reads what the shell wrote, waiting for it with block. Returns 0 at EOF.
+int sh_read(session *s, int block) {
+  struct pollfd pfd = {.fd = s->out, .events = POLLIN};
+  if (poll(&pfd, 1, block ? -1 : 0) <= 0)
+    return 1;
+  ssize_t n = read(s->out, s->buf + s->len, sizeof(s->buf) - s->len - 1);
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n <= 0)
+    return 0;
+  s->len += n;
+  s->buf[s->len] = '\0';
+
+  char *line = s->buf, *nl;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    sh_line(s, line);
+    line = nl + 1;
+  }
+  s->len -= line - s->buf;
+  memmove(s->buf, line, s->len);
+  if (s->len == sizeof(s->buf) - 1)
+    s->len = 0;
+  return 1;
+}
+
+// Writes to the shell, reading its output meanwhile so neither side can
+// block the other.
+void sh_send(session *s, char *fmt, ...) {
+  char buf[4096];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  for (char *p = buf; n > 0;) {
+    struct pollfd fds[2] = {{.fd = s->in, .events = POLLOUT},
+                            {.fd = s->out, .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      die("poll error");
+    if (fds[1].revents)
+      sh_read(s, 0);
+    if (fds[0].revents & POLLOUT) {
+      ssize_t k = write(s->in, p, n);
+      if (k < 0 && errno != EINTR && errno != EAGAIN)
+        die("write error");
+      if (k > 0) {
+        p += k;
+        n -= k;
+      }
+    }
+  }
+}
+
+// Waits until the shell ran everything sent so far.
+void sh_sync(session *s) {
+  int mark = ++s->marks;
+  sh_send(s, "echo @mark %d\n", mark);
+  while (s->seen < mark)
+    if (!sh_read(s, 1)) {
+      fprintf(stderr, "shell exited\n");
+      exit(1);
+    }
+}
+
+int memfd(char *name) {
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0)
+    die("memfd_create error");
+  return fd;
+}
+
+// Descriptors of the driver are kept above the ones the shell gets.
+int high_fd(int fd) {
+  int h = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+  if (h < 0)
+    die("fcntl error");
+  close(fd);
+  return h;
+}
+
+void sh_start(session *s, char *shell, char *spawn, int event) {
+  memset(s, 0, sizeof(*s));
+  int in[2], out[2], gate[2];
+  if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 ||
+      pipe2(gate, O_CLOEXEC) < 0)
+    die("pipe error");
+  s->rec = high_fd(memfd("records"));
+  s->trace = high_fd(memfd("trace"));
+  for (int k = 0; k < 2; k++) {
+    in[k] = high_fd(in[k]);
+    out[k] = high_fd(out[k]);
+    gate[k] = high_fd(gate[k]);
+  }
+  // Records of probes running at the same time mustn't overwrite each other.
+  fcntl(s->rec, F_SETFL, O_APPEND);
+
+  if ((s->pid = fork()) < 0)
+    die("fork error");
+  if (s->pid == 0) {
+    if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0 ||
+        dup2(s->rec, REC_FD) < 0 || dup2(s->trace, TRACE_FD) < 0 ||
+        dup2(gate[0], GATE_FD) < 0)
+      die("dup2 error");
+    execl(shell, shell, event ? "-e" : NULL, NULL);
+    die(shell);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(gate[0]);
+  s->in = in[1];
+  s->out = out[0];
+  s->gate = gate[1];
+  sh_send(s, "spawn %s\ntrace on\n", spawn);
+}
+
+// Ends the session, dumps the trace of the shell first, and kills the jobs
+// it left running.
+void sh_end(session *s) {
+  sh_send(s, "trace dump /dev/fd/%d\n", TRACE_FD);
+  sh_sync(s);
+  close(s->in);
+  if (s->gate >= 0)
+    close(s->gate);
+  while (sh_read(s, 1))
+    ;
+  close(s->out);
+  waitpid(s->pid, NULL, 0);
+  for (int k = 0; k < s->nbg; k++)
+    kill(-s->bg[k], SIGKILL);
+  free(s->bg);
+}
+
+// Reads the whole memfd fd into a NUL terminated buffer.
+char *slurp(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) < 0)
+    die("fstat error");
+  char *buf = malloc(sb.st_size + 1);
+  if (buf == NULL)
+    die("malloc error");
+  ssize_t n = pread(fd, buf, sb.st_size, 0);
+  buf[n > 0 ? n : 0] = '\0';
+  return buf;
+}
+
+// Records the probes wrote during the session, sorted by pid.
+record *read_records(session *s, int *n) {
+  char *buf = slurp(s->rec);
+  int cap = 1024;
+  record *r = malloc(cap * sizeof(record));
+  *n = 0;
+  for (char *line = strtok(buf, "\n"); line != NULL;
+       line = strtok(NULL, "\n")) {
+    if (*n == cap && (r = realloc(r, (cap *= 2) * sizeof(record))) == NULL)
+      die("realloc error");
+    if (sscanf(line, "%c %d %lld", &r[*n].type, &r[*n].pid, &r[*n].ns) == 3)
+      (*n)++;
+  }
+  free(buf);
+  qsort(r, *n, sizeof(record), compare_record);
+  return r;
+}
+
+record *find_record(record *r, int n, pid_t pid, char type) {
+  record key = {.type = type, .pid = pid};
+  return bsearch(&key, r, n, sizeof(record), compare_record);
+}
+
+// Latencies in microseconds from each probe exiting to the shell recording
+// its exit, which trace_status does right where setjobstat is called.
+double *reap_latencies(session *s, record *r, int nr, int *n) {
+  char *buf = slurp(s->trace);
+  double *v = malloc((nr + 1) * sizeof(double));
+  *n = 0;
+  for (char *line = strtok(buf, "\n"); line != NULL;
+       line = strtok(NULL, "\n")) {
+    double ts;
+    pid_t pgid, pid;
+    if (sscanf(line,
+               "{\"name\":\"process\",\"ph\":\"E\",\"ts\":%lf,\"pid\":%d,"
+               "\"tid\":%d",
+               &ts, &pgid, &pid) != 3)
+      continue;
+    record *x = find_record(r, nr, pid, 'X');
+    if (x != NULL && *n < nr)
+      v[(*n)++] = ts - x->ns / 1e3;
+  }
+  free(buf);
+  return v;
+}
+
+static FILE *results;
+static char *cur_spawn;
+static char *cur_loop;
+
+void emit(char *workload, char *metric, double value) {
+  fprintf(results,
+          "{\"workload\":\"%s\",\"spawn\":\"%s\",\"loop\":\"%s\","
+          "\"metric\":\"%s\",\"value\":%.3f}\n",
+          workload, cur_spawn, cur_loop, metric, value);
+  fflush(results);
+  printf("%-8s %-7s %-10s %-20s %12.3f\n", cur_spawn, cur_loop, workload,
+         metric, value);
+}
+
+// Warns when fewer than want of the probes that ran were found in the trace
+// of the shell. Its ring holds the last TRACE_CAP events only, see 826.c, so
+// the oldest ones are gone once more were recorded.
+void check_wrap(char *workload, int got, int want) {
+  if (got < want)
+    fprintf(stderr,
+            "%s: %d of %d probes missing from the trace, its ring wrapped\n",
+            workload, want - got, want);
+}
+
+// Emits percentiles of the n values in v as metric_p50 and so on.
+void emit_pcts(char *workload, char *metric, double *v, int n) {
+  static struct {
+    char *name;
+    double p;
+  } pcts[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"max", 1}};
+  if (n == 0)
+    return;
+  qsort(v, n, sizeof(double), compare_double);
+  for (size_t k = 0; k < sizeof(pcts) / sizeof(pcts[0]); k++) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%s", metric, pcts[k].name);
+    int i = (int)(pcts[k].p * (n - 1) + 0.5);
+    emit(workload, name, v[i]);
+  }
+}
+
+static char *shell = "./ash";
+static char *inf_loop = "./inf_loop";
+static char self[4096];
+static int count = 1000;
+
+void bench_true(char *spawn, int event) {
+  session s;
+  sh_start(&s, shell, spawn, event);
+  sh_sync(&s);
+  long long t0 = now_ns();
+  for (int k = 0; k < count; k++)
+    sh_send(&s, "/bin/true\n");
+  sh_sync(&s);
+  emit("true", "cmds_per_sec", count / ((now_ns() - t0) / 1e9));
+  sh_end(&s);
+}
+
+void bench_exec(char *spawn, int event) {
+  // Every probe costs four trace events, they must fit the ring of the shell.
+  int n = count < 500 ? count : 500;
+  long long *sent = malloc(n * sizeof(long long));
+  session s;
+  sh_start(&s, shell, spawn, event);
+  sh_sync(&s);
+  for (int k = 0; k < n; k++) {
+    sent[k] = now_ns();
+    sh_send(&s, "%s probe start\n", self);
+    sh_sync(&s);
+  }
+  sh_end(&s);
+
+  // Probes ran one after the other, their start records are in that order.
+  char *buf = slurp(s.rec);
+  double *v = malloc(n * sizeof(double));
+  int nv = 0;
+  for (char *line = strtok(buf, "\n"); line != NULL && nv < n;
+       line = strtok(NULL, "\n")) {
+    char type;
+    pid_t pid;
+    long long ns;
+    if (sscanf(line, "%c %d %lld", &type, &pid, &ns) == 3 && type == 'S') {
+      v[nv] = (ns - sent[nv]) / 1e3;
+      nv++;
+    }
+  }
+  free(buf);
+  emit_pcts("exec", "exec_us", v, nv);
+
+  int nr;
+  record *r = read_records(&s, &nr);
+  double *reap = reap_latencies(&s, r, nr, &nv);
+  check_wrap("exec", nv, n);
+  emit_pcts("exec", "reap_us", reap, nv);
+  free(reap);
+  free(r);
+  free(v);
+  free(sent);
+  close(s.rec);
+  close(s.trace);
+}
+
+void bench_storm(char *spawn, int event, int n) {
+  char name[32];
+  snprintf(name, sizeof(name), "storm%d", n);
+  session s;
+  sh_start(&s, shell, spawn, event);
+  for (int k = 0; k < n; k++)
+    sh_send(&s, "%s probe gate &\n", self);
+  sh_sync(&s);
+
+  long long go = now_ns();
+  close(s.gate);
+  s.gate = -1;
+  sh_send(&s, "wait\n");
+  sh_sync(&s);
+  emit(name, "drain_ms", (now_ns() - go) / 1e6);
+  sh_end(&s);
+
+  int nr, nv;
+  record *r = read_records(&s, &nr);
+  double *reap = reap_latencies(&s, r, nr, &nv);
+  check_wrap(name, nv, n);
+  emit_pcts(name, "reap_us", reap, nv);
+  free(reap);
+  free(r);
+  close(s.rec);
+  close(s.trace);
+}
+
+// Per call cost of running line reps times.
+double per_call_us(session *s, char *line, int reps) {
+  sh_sync(s);
+  long long t0 = now_ns();
+  for (int k = 0; k < reps; k++)
+    sh_send(s, "%s\n", line);
+  sh_sync(s);
+  return (now_ns() - t0) / 1e3 / reps;
+}
+
+void bench_jobs(char *spawn, int event, int n) {
+  char name[32];
+  snprintf(name, sizeof(name), "jobs%d", n);
+  session s;
+  sh_start(&s, shell, spawn, event);
+  for (int k = 0; k < n; k++)
+    sh_send(&s, "%s > /dev/null &\n", inf_loop);
+  sh_sync(&s);
+  emit(name, "builtin_us", per_call_us(&s, "true > /dev/null", 200));
+  emit(name, "jobs_us", per_call_us(&s, "jobs > /dev/null", 200));
+  emit(name, "jobs_l_us", per_call_us(&s, "jobs -l > /dev/null", 200));
+  sh_end(&s);
+  close(s.rec);
+  close(s.trace);
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && !strcmp(argv[1], "probe"))
+    return probe(argv[2]);
+
+  char *out = "bench.jsonl";
+  char *only_spawn = NULL, *only_loop = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:l:m:n:o:s:")) != -1) {
+    switch (opt) {
+    case 'i':
+      inf_loop = optarg;
+      break;
+    case 'l':
+      only_loop = optarg;
+      break;
+    case 'm':
+      only_spawn = optarg;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-s shell] [-i inf_loop] [-o results] [-n count] "
+              "[-m fork|posix|zygote] [-l handler|event]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (count <= 0 || access(shell, X_OK) < 0 || access(inf_loop, X_OK) < 0) {
+    fprintf(stderr, "%s, %s: build them first, see bench.c\n", shell,
+            inf_loop);
+    exit(1);
+  }
+  ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (len < 0)
+    die("readlink error");
+  self[len] = '\0';
+  if ((results = fopen(out, "ae")) == NULL)
+    die(out);
+  // The shell going away must not take the driver with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  static char *spawns[] = {"posix", "fork", "zygote"};
+  static char *loops[] = {"handler", "event"};
+  for (int m = 0; m < 3; m++) {
+    for (int l = 0; l < 2; l++) {
+      if ((only_spawn != NULL && strcmp(only_spawn, spawns[m])) ||
+          (only_loop != NULL && strcmp(only_loop, loops[l])))
+        continue;
+      cur_spawn = spawns[m];
+      cur_loop = loops[l];
+      bench_true(spawns[m], l);
+      bench_exec(spawns[m], l);
+      bench_storm(spawns[m], l, 100);
+      bench_storm(spawns[m], l, 1000);
+      for (int n = 10; n <= 1000; n *= 10)
+        bench_jobs(spawns[m], l, n);
+    }
+  }
+  fclose(results);
+  return 0;
+}